@@ -0,0 +1,262 @@
+/** @file BinaryLogFormat.h
+ *  @brief Self describing binary log format, shared with the host decoder
+ *
+ *  A log file starts with a header that lists every record type and its
+ *  fields, followed by records framed as [type][length][payload]. All
+ *  values are little endian fixed point integers, the header gives the
+ *  number of decimals of each field so the decoder needs no knowledge of
+ *  the firmware. Text records (eg. raw CTD lines) are carried verbatim.
+ *
+ *  Header:
+ *      char magic[4] = "BUMB", uint8 version, uint8 schemaCount
+ *      schemaCount x (BinaryLogSchema, fieldCount x BinaryLogField)
+ *
+ *  The minimum of a signed field type means no value (eg. a frame without
+ *  CTD data), values are clamped one above it.
+ *
+ *  Only depends on the C standard library so tools/binlog2csv.cpp can
+ *  include it on a host.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _BINARYLOGFORMAT
+
+#define _BINARYLOGFORMAT
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+#define BINLOG_MAGIC "BUMB"
+#define BINLOG_VERSION 1
+#define BINLOG_FRAME_SIZE 2         /**< Type and length bytes before each payload */
+
+// Record types
+#define BINLOG_TYPE_PCTL 1
+#define BINLOG_TYPE_FRAME 2
+#define BINLOG_TYPE_TEXT 0x7F       /**< Payload is ASCII without line ending */
+
+// Flags of a PCTL record
+#define BINLOG_FLAG_CAMERA 0x01
+#define BINLOG_FLAG_POWERFAULT 0x02
+#define BINLOG_FLAG_STROBEALARM 0x04
+
+/** Storage type of a field */
+typedef enum {
+    BINLOG_U8 = 1,
+    BINLOG_I8,
+    BINLOG_U16,
+    BINLOG_I16,
+    BINLOG_U32,
+    BINLOG_I32
+} BinaryFieldType;
+
+#define BINLOG_NULL_I16 INT16_MIN   /**< No value in a BINLOG_I16 field */
+#define BINLOG_NULL_I32 INT32_MIN   /**< No value in a BINLOG_I32 field */
+
+/** One field of a record, value = raw / 10^decimals */
+struct BinaryLogField {
+    char name[16];
+    char unit[6];
+    uint8_t type;
+    int8_t decimals;
+} __attribute__((packed));
+
+/** Header entry of a record type, followed by its fields */
+struct BinaryLogSchema {
+    uint8_t recordType;
+    uint8_t fieldCount;
+    char name[8];
+} __attribute__((packed));
+
+/** System status, the binary form of a $PCTL line */
+struct BinaryPctlRecord {
+    uint32_t epoch;             /**< RTC time in s */
+    uint16_t millis;            /**< ms part of the time */
+    uint8_t flags;              /**< BINLOG_FLAG_* */
+    int16_t temp[3];            /**< Mean, min, max in 0.01 C */
+    uint32_t pressure[3];       /**< Mean, min, max in Pa */
+    uint16_t humidity[3];       /**< Mean, min, max in 0.01 % */
+    uint16_t voltage[3];        /**< Mean, min, max in mV */
+    uint16_t power[3];          /**< Mean, min, max in 10 mW, the INA260 LSB */
+} __attribute__((packed));
+
+/** CTD depth and temperature interpolated at a trigger, and the lens focal power */
+struct BinaryFrameRecord {
+    uint32_t frame;
+    int32_t pressure;           /**< 0.001 dBar, BINLOG_NULL_I32 without CTD data */
+    int32_t temp;               /**< 0.0001 C, BINLOG_NULL_I32 without CTD data */
+    int16_t focalPower;         /**< 0.001 dpt, BINLOG_NULL_I16 with the lens off */
+} __attribute__((packed));
+
+const BinaryLogField binlogPctlFields[] = {
+    {"epoch", "s", BINLOG_U32, 0},
+    {"millis", "ms", BINLOG_U16, 0},
+    {"flags", "", BINLOG_U8, 0},
+    {"temp", "C", BINLOG_I16, 2},
+    {"temp_min", "C", BINLOG_I16, 2},
+    {"temp_max", "C", BINLOG_I16, 2},
+    {"pressure", "kPa", BINLOG_U32, 3},
+    {"pressure_min", "kPa", BINLOG_U32, 3},
+    {"pressure_max", "kPa", BINLOG_U32, 3},
+    {"humidity", "%", BINLOG_U16, 2},
+    {"humidity_min", "%", BINLOG_U16, 2},
+    {"humidity_max", "%", BINLOG_U16, 2},
+    {"voltage", "V", BINLOG_U16, 3},
+    {"voltage_min", "V", BINLOG_U16, 3},
+    {"voltage_max", "V", BINLOG_U16, 3},
+    {"power", "W", BINLOG_U16, 2},
+    {"power_min", "W", BINLOG_U16, 2},
+    {"power_max", "W", BINLOG_U16, 2}
+};
+
+const BinaryLogField binlogFrameFields[] = {
+    {"frame", "", BINLOG_U32, 0},
+    {"pressure", "dBar", BINLOG_I32, 3},
+    {"temp", "C", BINLOG_I32, 4},
+    {"focal_power", "dpt", BINLOG_I16, 3}
+};
+
+#define BINLOG_FIELDS(f) (uint8_t)(sizeof(f) / sizeof(f[0]))
+
+/** Size in bytes of a field type, 0 if unknown */
+inline size_t binlogFieldSize(uint8_t type) {
+    switch (type) {
+        case BINLOG_U8:
+        case BINLOG_I8:
+            return 1;
+        case BINLOG_U16:
+        case BINLOG_I16:
+            return 2;
+        case BINLOG_U32:
+        case BINLOG_I32:
+            return 4;
+    }
+    return 0;
+}
+
+/** Read a little endian field as a signed 64 bit value */
+inline int64_t binlogReadField(const uint8_t * p, uint8_t type) {
+    uint32_t u = 0;
+    for (size_t i = binlogFieldSize(type); i > 0; i--)
+        u = (u << 8) | p[i - 1];
+    switch (type) {
+        case BINLOG_I8:
+            return (int8_t)u;
+        case BINLOG_I16:
+            return (int16_t)u;
+        case BINLOG_I32:
+            return (int32_t)u;
+    }
+    return u;
+}
+
+/** True if a field read by binlogReadField() holds no value */
+inline bool binlogIsNull(int64_t raw, uint8_t type) {
+    switch (type) {
+        case BINLOG_I8:
+            return raw == INT8_MIN;
+        case BINLOG_I16:
+            return raw == BINLOG_NULL_I16;
+        case BINLOG_I32:
+            return raw == BINLOG_NULL_I32;
+    }
+    return false;
+}
+
+/**
+ * @brief Text of a field value, raw / 10^decimals, empty for no value
+ *
+ * @param decimals  Decimals from the header, 0 to 18
+ */
+inline char * binlogFormatValue(char * buf, size_t size, int64_t raw, uint8_t type, int decimals) {
+    if (binlogIsNull(raw, type)) {
+        buf[0] = '\0';
+        return buf;
+    }
+    if (decimals <= 0 || decimals > 18) {
+        snprintf(buf, size, "%lld", (long long)raw);
+        return buf;
+    }
+    long long div = 1;
+    for (int i = 0; i < decimals; i++)
+        div *= 10;
+    long long whole = raw / div;
+    long long frac = raw % div;
+    const char * sign = "";
+    if (raw < 0) {
+        sign = "-";
+        whole = -whole;
+        frac = -frac;
+    }
+    snprintf(buf, size, "%s%lld.%0*lld", sign, whole, decimals, frac);
+    return buf;
+}
+
+/** Round a value to fixed point with the given scale and clamp it to the field range */
+inline int32_t binlogFixed(float value, float scale, int32_t lo, int32_t hi) {
+    float v = value * scale;
+    v += v >= 0 ? 0.5f : -0.5f;
+    if (v < lo)
+        return lo;
+    if (v > hi)
+        return hi;
+    return (int32_t)v;
+}
+
+/** Clamp a fixed point value that is already in the field units to the field range */
+inline int32_t binlogClamp(int32_t value, int32_t lo, int32_t hi) {
+    if (value < lo)
+        return lo;
+    if (value > hi)
+        return hi;
+    return value;
+}
+
+inline uint32_t binlogFixedU32(float value, float scale) {
+    float v = value * scale + 0.5f;
+    if (v < 0)
+        return 0;
+    if (v > 4294967040.0f)
+        return 0xFFFFFF00UL;
+    return (uint32_t)v;
+}
+
+inline size_t binlogWriteSchema(uint8_t * buf, uint8_t recordType, const char * name,
+    const BinaryLogField * fields, uint8_t fieldCount) {
+    BinaryLogSchema s;
+    memset(&s, 0, sizeof(s));
+    s.recordType = recordType;
+    s.fieldCount = fieldCount;
+    strncpy(s.name, name, sizeof(s.name));
+    memcpy(buf, &s, sizeof(s));
+    memcpy(buf + sizeof(s), fields, fieldCount * sizeof(BinaryLogField));
+    return sizeof(s) + fieldCount * sizeof(BinaryLogField);
+}
+
+/** Size of the header written by binlogWriteHeader() */
+constexpr size_t binlogHeaderSize() {
+    return 6 + 2 * sizeof(BinaryLogSchema)
+        + (BINLOG_FIELDS(binlogPctlFields) + BINLOG_FIELDS(binlogFrameFields)) * sizeof(BinaryLogField);
+}
+
+/**
+ * @brief Write the file header describing every record type
+ *
+ * @param buf At least binlogHeaderSize() bytes
+ * @return Bytes written
+ */
+inline size_t binlogWriteHeader(uint8_t * buf) {
+    size_t n = 0;
+    memcpy(buf, BINLOG_MAGIC, 4);
+    buf[4] = BINLOG_VERSION;
+    buf[5] = 2;
+    n = 6;
+    n += binlogWriteSchema(buf + n, BINLOG_TYPE_PCTL, "PCTL", binlogPctlFields, BINLOG_FIELDS(binlogPctlFields));
+    n += binlogWriteSchema(buf + n, BINLOG_TYPE_FRAME, "FRAME", binlogFrameFields, BINLOG_FIELDS(binlogFrameFields));
+    return n;
+}
+
+#endif
@@ -0,0 +1,293 @@
+/** @file CommandTable.h
+ *  @brief Command table with a perfect hash lookup and argument schemas
+ *
+ *  Commands are listed once in a static table of CommandEntry: the name,
+ *  the member function handling it, an argument schema, an optional y/N
+ *  question asked before it runs and an optional SessionLock it takes. At boot CommandTable::build()
+ *  searches for a hash seed that puts every name in its own slot, so a
+ *  lookup is one case insensitive hash of the typed name and one compare,
+ *  whatever the number of commands.
+ *
+ *  Argument schema, one character per comma separated argument:
+ *      i   integer
+ *      f   float
+ *      s   text up to the next comma
+ *      *   the rest of the line, commas included
+ *      [   the arguments after this are optional
+ *
+ *  eg. "f[f" is a float and an optional float. CommandArgs parses and
+ *  checks the arguments before the handler runs.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _COMMANDTABLE
+
+#define _COMMANDTABLE
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include "LineEditor.h"
+#include "SessionLock.h"
+
+#define CMD_MAX_ARGS 4
+#define CMD_TABLE_SLOTS 128     /**< Hash slots, power of 2, about 4x the number of commands */
+#define CMD_SEED_TRIES 4096
+#define CMD_NO_SLOT 0xFF
+
+/** Result of running a command line */
+typedef enum {
+    CMD_DONE,
+    CMD_EMPTY,          /**< Blank line */
+    CMD_UNKNOWN,
+    CMD_BAD_ARGS,       /**< Arguments do not match the schema, usage printed */
+    CMD_ASK,            /**< Needs its question answered, not run */
+    CMD_BUSY            /**< Its lock is held by another session, busy reply printed */
+} CommandStatus;
+
+class CommandArgs {
+
+    private:
+    char text[CMD_BUFFER_SIZE];
+    char * rest;
+    uint8_t count;
+    long ints[CMD_MAX_ARGS];
+    float floats[CMD_MAX_ARGS];
+    char * strings[CMD_MAX_ARGS];
+
+    static bool isBlank(const char * s) {
+        while (*s == ' ')
+            s++;
+        return *s == '\0';
+    }
+
+    public:
+
+    /** Editor of the port the command came from, NULL from a machine link */
+    LineEditor * editor;
+
+    CommandArgs() {
+        text[0] = '\0';
+        rest = NULL;
+        count = 0;
+        editor = NULL;
+    }
+
+    /**
+     * @brief Copy a command line and split off the command name
+     *
+     * The line itself is not modified.
+     *
+     * @return The command name, empty for a blank line
+     */
+    char * split(const char * line) {
+        strncpy(text, line, CMD_BUFFER_SIZE - 1);
+        text[CMD_BUFFER_SIZE - 1] = '\0';
+        char * name = text;
+        while (*name == ' ')
+            name++;
+        rest = strchr(name, ',');
+        if (rest != NULL)
+            *rest++ = '\0';
+        count = 0;
+        return name;
+    }
+
+    /**
+     * @brief Parse the arguments after the name with a schema
+     *
+     * @return false if an argument is missing, malformed or extra
+     */
+    bool bind(const char * schema) {
+        bool optional = false;
+        count = 0;
+        for (; *schema != '\0'; schema++) {
+            if (*schema == '[') {
+                optional = true;
+                continue;
+            }
+            if (rest == NULL || isBlank(rest))
+                return optional;
+            if (count >= CMD_MAX_ARGS)
+                return false;
+
+            char * arg = rest;
+            if (*schema == '*') {
+                rest = NULL;
+            }
+            else {
+                rest = strchr(arg, ',');
+                if (rest != NULL)
+                    *rest++ = '\0';
+            }
+
+            char * end = arg;
+            strings[count] = arg;
+            switch (*schema) {
+                case 'i':
+                    ints[count] = strtol(arg, &end, 10);
+                    floats[count] = ints[count];
+                    break;
+                case 'f':
+                    floats[count] = strtod(arg, &end);
+                    ints[count] = (long)floats[count];
+                    break;
+                default:
+                    if (!isBlank(arg))
+                        end = arg + strlen(arg);
+                    break;
+            }
+            if (end == arg || !isBlank(end))
+                return false;
+            count++;
+        }
+        // Nothing may be left over
+        return rest == NULL || isBlank(rest);
+    }
+
+    /** Number of arguments given */
+    int size() {
+        return count;
+    }
+
+    bool has(int n) {
+        return n < count;
+    }
+
+    long getInt(int n, long fallback = 0) {
+        return n < count ? ints[n] : fallback;
+    }
+
+    float getFloat(int n, float fallback = 0.0) {
+        return n < count ? floats[n] : fallback;
+    }
+
+    char * getString(int n) {
+        return n < count ? strings[n] : NULL;
+    }
+};
+
+/** Print a schema as an argument list, eg. "f[f" as ",float[,float]" */
+void printSchema(Stream * out, const char * schema) {
+    bool optional = false;
+    for (; *schema != '\0'; schema++) {
+        switch (*schema) {
+            case '[': out->print("["); optional = true; continue;
+            case 'i': out->print(",int"); break;
+            case 'f': out->print(",float"); break;
+            case 's': out->print(",text"); break;
+            case '*': out->print(",..."); break;
+        }
+    }
+    if (optional)
+        out->print("]");
+}
+
+template <class T>
+struct CommandEntry {
+    const char * name;
+    void (T::*handler)(CommandArgs & args, Stream * out);
+    const char * schema;
+    const char * question;      /**< Asked before running, NULL to run at once */
+    SessionLock * lock;         /**< Taken before running or asking, NULL for none */
+};
+
+template <class T>
+class CommandTable {
+
+    private:
+    const CommandEntry<T> * entries;
+    uint8_t count;
+    uint32_t seed;
+    bool perfect;
+    uint8_t slots[CMD_TABLE_SLOTS];
+
+    /** FNV-1a of the upper cased name */
+    static uint32_t hash(const char * name, uint32_t seed) {
+        uint32_t h = 2166136261UL ^ seed;
+        for (; *name != '\0'; name++) {
+            h ^= (uint8_t)toupper(*name);
+            h *= 16777619UL;
+        }
+        return h ^ (h >> 15);
+    }
+
+    bool trySeed(uint32_t seed) {
+        memset(slots, CMD_NO_SLOT, sizeof(slots));
+        for (uint8_t i = 0; i < count; i++) {
+            uint32_t slot = hash(entries[i].name, seed) & (CMD_TABLE_SLOTS - 1);
+            if (slots[slot] != CMD_NO_SLOT)
+                return false;
+            slots[slot] = i;
+        }
+        return true;
+    }
+
+    public:
+
+    CommandTable() {
+        entries = NULL;
+        count = 0;
+        seed = 0;
+        perfect = false;
+    }
+
+    /**
+     * @brief Find a collision free seed for the entries
+     *
+     * @return false if none was found, find() then searches the list
+     */
+    bool build(const CommandEntry<T> * entries, uint8_t count) {
+        this->entries = entries;
+        this->count = count;
+        perfect = false;
+        if (count >= CMD_TABLE_SLOTS)
+            return false;
+        for (seed = 0; seed < CMD_SEED_TRIES; seed++) {
+            if (trySeed(seed)) {
+                perfect = true;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Entry named name, any case, NULL if there is none */
+    const CommandEntry<T> * find(const char * name) {
+        if (perfect) {
+            uint8_t i = slots[hash(name, seed) & (CMD_TABLE_SLOTS - 1)];
+            if (i != CMD_NO_SLOT && strcasecmp(name, entries[i].name) == 0)
+                return &entries[i];
+            return NULL;
+        }
+        for (uint8_t i = 0; i < count; i++) {
+            if (strcasecmp(name, entries[i].name) == 0)
+                return &entries[i];
+        }
+        return NULL;
+    }
+
+    /** Index of an entry returned by find() */
+    int indexOf(const CommandEntry<T> * entry) {
+        return entry - entries;
+    }
+
+    const CommandEntry<T> * get(int index) {
+        return index >= 0 && index < count ? &entries[index] : NULL;
+    }
+
+    void printUsage(Stream * out, const CommandEntry<T> * entry) {
+        out->print(entry->name);
+        printSchema(out, entry->schema);
+    }
+
+    /** List the commands with their arguments */
+    void print(Stream * out) {
+        for (uint8_t i = 0; i < count; i++) {
+            out->print("\r\n");
+            printUsage(out, &entries[i]);
+        }
+    }
+};
+
+#endif
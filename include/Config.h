@@ -63,6 +63,13 @@ void SERCOM1_Handler()
 #define TRIG_0_0 4
 #define TRIG_0_1 3
 
+// ALERT output of the system INA260 (open drain, active low)
+#define INA260_ALERT_PIN A0
+
+// SD card on the shared SPI bus, detect switch closes to GND when empty
+#define SD_CS_PIN A3
+#define SDCARD_DETECT A4
+
 // Define flash triggers
 #define WHITE_FLASH_TRIG 7
 #define UV_FLASH_TRIG 6
@@ -81,6 +88,22 @@ void SERCOM1_Handler()
 #define JETSONPORT HWPORT1
 #define RBRPORT HWPORT1
 
+// Return the hardware serial port by number, NULL if not a valid port
+Stream * getHwPort(int num) {
+    switch (num) {
+        case 0:
+            return &HWPORT0;
+        case 1:
+            return &HWPORT1;
+        case 2:
+            return &HWPORT2;
+        case 3:
+            return &HWPORT3;
+        default:
+            return NULL;
+    }
+}
+
 // Define Config Settings
 #define LOGINT "LOGINT"
 #define DEPTHCHECKINTERVAL "DEPTHCHECKINTERVAL"
@@ -117,6 +140,27 @@ void SERCOM1_Handler()
 #define TEMPLIMIT "TEMPLIMIT"
 #define HUMLIMIT "HUMLIMIT"
 #define CHECKINTERVAL "CHECKINTERVAL"
+#define CTDPORT "CTDPORT"
+#define CTDTYPE "CTDTYPE"
+#define FRAMETAGS "FRAMETAGS"
+#define CURRENTLIMIT "CURRENTLIMIT"
+#define ALERTMODE "ALERTMODE"
+#define COUNTERINTERVAL "COUNTERINTERVAL"
+#define STROBECHECK "STROBECHECK"
+#define STROBEALARM "STROBEALARM"
+#define SDLOG "SDLOG"
+#define LOGFORMAT "LOGFORMAT"
+#define FLASHLOG "FLASHLOG"
+#define UI1TXPOLICY "UI1TXPOLICY"
+#define UI2TXPOLICY "UI2TXPOLICY"
+#define USBTXPOLICY "USBTXPOLICY"
+#define TIMESYNC "TIMESYNC"
+#define LINKPORT "LINKPORT"
+#define OPTOTIMEOUT "OPTOTIMEOUT"
+#define OPTORETRIES "OPTORETRIES"
+#define OPTOTICK "OPTOTICK"
+#define LOOPIDLE "LOOPIDLE"
+#define SHUTDOWNWAIT "SHUTDOWNWAIT"
 
 
 // Define Commands
@@ -140,6 +184,33 @@ void SERCOM1_Handler()
 #define MOVELENS "MOVELENS"
 #define STEPLENS "STEPLENS"
 #define FOCALSWEEP "FOCALSWEEP"
+#define CTDCLOCK "CTDCLOCK"
+#define CLEARFAULT "CLEARFAULT"
+#define COUNTERS "COUNTERS"
+#define STROBESTATS "STROBESTATS"
+#define STROBERESET "STROBERESET"
+#define SDSTATS "SDSTATS"
+#define FLASHSTATS "FLASHSTATS"
+#define FLASHDUMP "FLASHDUMP"
+#define FLASHDRAIN "FLASHDRAIN"
+#define TXSTATS "TXSTATS"
+#define TIMESTATS "TIMESTATS"
+#define RESETOPTO "RESETOPTO"
+#define LINKSTATS "LINKSTATS"
+#define ECHO "ECHO"
+#define SESSIONS "SESSIONS"
+#define OPTOSTATS "OPTOSTATS"
+#define FOCUS "FOCUS"
+#define FOCUSCAL "FOCUSCAL"
+#define FOCUSPOINT "FOCUSPOINT"
+#define FOCUSTEMP "FOCUSTEMP"
+#define FOCUSCLEAR "FOCUSCLEAR"
+#define FOCUSSAVE "FOCUSSAVE"
+#define LOOPSTATS "LOOPSTATS"
+#define SLEEPUNTIL "SLEEPUNTIL"
+#define SLEEPSTATS "SLEEPSTATS"
+#define WDTSTATS "WDTSTATS"
+#define HELP "HELP"
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,232 @@
+/** @file Counters.h
+ *  @brief Lifetime energy, strobe and frame counters
+ *
+ *  Counters are accumulated in RAM and checkpointed to the SPI flash at a
+ *  low rate. Checkpoints are appended to fixed size slots across
+ *  FLASH_COUNTERS_SECTORS sectors, so each sector is only erased once every
+ *  slotsPerSector checkpoints. At boot the valid slot with the highest
+ *  sequence number is restored.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _COUNTERS
+
+#define _COUNTERS
+
+#include <Arduino.h>
+#include "Config.h"
+#include "FlashLayout.h"
+#include "SystemConfig.h"
+#include "Utils.h"
+
+#define COUNTERS_MAGIC 0x43544E31      /**< "CTN1" */
+#define COUNTERS_SLOT_SIZE 128          /**< Two slots per flash page */
+#define COUNTERS_SLOTS (FLASH_COUNTERS_SECTORS * FLASH_SECTOR_SIZE / COUNTERS_SLOT_SIZE)
+#define COUNTERS_MAX_DT 2000            /**< Longest gap in ms between power readings that is integrated */
+
+// Power states that energy is accounted to
+#define STATE_IDLE 0
+#define STATE_CAMERA 1
+#define STATE_IMAGING 2
+#define N_STATES 3
+
+// Strobe channels
+#define CHANNEL_WHITE 0
+#define CHANNEL_UV 1
+#define N_CHANNELS 2
+
+/** Persistent counter values, one flash slot */
+struct CounterRecord {
+    uint32_t magic;
+    uint32_t sequence;                  /**< Incremented on every checkpoint */
+    uint32_t bootCount;
+    uint32_t uptime;                    /**< Total powered time in s */
+    uint64_t energy[N_STATES];          /**< Energy per power state in mJ */
+    uint64_t strobeOnTime[N_CHANNELS];  /**< Total flash duration per channel in us */
+    uint32_t frames[N_CHANNELS];        /**< Triggered frames per channel */
+    uint16_t reserved;
+    uint16_t crc;                       /**< CRC of all fields above */
+};
+
+static_assert(sizeof(CounterRecord) <= COUNTERS_SLOT_SIZE, "CounterRecord does not fit in a slot");
+
+class Counters {
+
+    private:
+    CounterRecord rec;
+    int nextSlot;                   /**< Slot the next checkpoint goes to */
+    bool pendingWrite;              /**< Waiting on a sector erase to finish */
+    unsigned long lastPowerTime;    /**< millis() of the last integrated power reading */
+    unsigned long uptimeMillis;     /**< ms not yet added to rec.uptime */
+    unsigned long lastUptime;       /**< millis() of the last uptime update */
+    unsigned long lastCheckpoint;   /**< millis() of the last checkpoint */
+
+    // Updated from the trigger interrupt, folded into rec in update()
+    volatile uint32_t isrStrobeOnTime[N_CHANNELS];
+    volatile uint32_t isrFrames[N_CHANNELS];
+
+    uint32_t slotAddr(int slot) {
+        return FLASH_COUNTERS_ADDR + (uint32_t)slot * COUNTERS_SLOT_SIZE;
+    }
+
+    uint16_t recordCrc(const CounterRecord & r) {
+        return crc16((const uint8_t*)&r, offsetof(CounterRecord, crc));
+    }
+
+    void foldInterruptCounts() {
+        for (int i = 0; i < N_CHANNELS; i++) {
+            noInterrupts();
+            uint32_t onTime = isrStrobeOnTime[i];
+            uint32_t frames = isrFrames[i];
+            isrStrobeOnTime[i] = 0;
+            isrFrames[i] = 0;
+            interrupts();
+            rec.strobeOnTime[i] += onTime;
+            rec.frames[i] += frames;
+        }
+    }
+
+    void writeSlot() {
+        rec.sequence++;
+        rec.crc = recordCrc(rec);
+        _flash.writeBytes(slotAddr(nextSlot), &rec, sizeof(rec));
+        nextSlot = (nextSlot + 1) % COUNTERS_SLOTS;
+    }
+
+    public:
+
+    Counters() {
+        memset(&rec, 0, sizeof(rec));
+        nextSlot = 0;
+        pendingWrite = false;
+        lastPowerTime = 0;
+        uptimeMillis = 0;
+        lastUptime = 0;
+        lastCheckpoint = 0;
+        for (int i = 0; i < N_CHANNELS; i++) {
+            isrStrobeOnTime[i] = 0;
+            isrFrames[i] = 0;
+        }
+    }
+
+    /**
+     * @brief Restore the newest valid checkpoint from flash
+     */
+    void begin() {
+        CounterRecord r;
+        bool found = false;
+        for (int slot = 0; slot < COUNTERS_SLOTS; slot++) {
+            _flash.readBytes(slotAddr(slot), &r, sizeof(r));
+            if (r.magic != COUNTERS_MAGIC || r.crc != recordCrc(r))
+                continue;
+            if (!found || (int32_t)(r.sequence - rec.sequence) > 0) {
+                rec = r;
+                nextSlot = (slot + 1) % COUNTERS_SLOTS;
+                found = true;
+            }
+        }
+
+        if (!found) {
+            memset(&rec, 0, sizeof(rec));
+            rec.magic = COUNTERS_MAGIC;
+            nextSlot = 0;
+        }
+
+        rec.bootCount++;
+        lastUptime = millis();
+        lastCheckpoint = millis();
+    }
+
+    /** Count a trigger, safe to call from an interrupt */
+    void addFlash(int channel, uint32_t duration) {
+        isrStrobeOnTime[channel] += duration;
+        isrFrames[channel]++;
+    }
+
+    /**
+     * @brief Integrate a new power reading into the current state
+     *
+     * @param state STATE_IDLE, STATE_CAMERA or STATE_IMAGING
+     * @param power Power in mW
+     */
+    void addPower(int state, float power) {
+        unsigned long now = millis();
+        unsigned long dt = now - lastPowerTime;
+        lastPowerTime = now;
+        if (dt <= COUNTERS_MAX_DT && power > 0.0)
+            rec.energy[state] += (uint64_t)(power * dt / 1000.0 + 0.5);
+    }
+
+    /**
+     * @brief Update uptime and checkpoint to flash when due
+     *
+     * @param interval Seconds between checkpoints
+     */
+    void update(unsigned long interval) {
+        unsigned long now = millis();
+        uptimeMillis += now - lastUptime;
+        lastUptime = now;
+        rec.uptime += uptimeMillis / 1000;
+        uptimeMillis %= 1000;
+
+        if (pendingWrite) {
+            // The sector erase runs in the background, write once it is done
+            if (!_flash.busy()) {
+                writeSlot();
+                pendingWrite = false;
+            }
+            return;
+        }
+
+        // Never wait on another user's erase
+        if (now - lastCheckpoint >= interval * 1000 && !_flash.busy())
+            checkpoint();
+    }
+
+    /**
+     * @brief Save the counters to the next flash slot
+     *
+     * Entering a new sector starts its erase and defers the write to a
+     * later update() so the loop never waits on the erase.
+     *
+     * @param wait Block until the record is written, eg. before power down
+     */
+    void checkpoint(bool wait = false) {
+        foldInterruptCounts();
+        lastCheckpoint = millis();
+        if (!pendingWrite && nextSlot % (FLASH_SECTOR_SIZE / COUNTERS_SLOT_SIZE) == 0) {
+            _flash.blockErase4K(slotAddr(nextSlot));
+            pendingWrite = true;
+        }
+        if (pendingWrite) {
+            if (!wait)
+                return;
+            while (_flash.busy());
+            pendingWrite = false;
+        }
+        writeSlot();
+    }
+
+    void print(Stream * ui) {
+        foldInterruptCounts();
+        const char * stateNames[N_STATES] = {"idle", "camera on", "imaging"};
+        const char * channelNames[N_CHANNELS] = {"white", "uv"};
+        char output[96];
+        ui->println();
+        sprintf(output, "Boots: %lu, uptime: %lu s, checkpoints: %lu",
+            (unsigned long)rec.bootCount, (unsigned long)rec.uptime, (unsigned long)rec.sequence);
+        ui->println(output);
+        for (int i = 0; i < N_STATES; i++) {
+            sprintf(output, "Energy %-10s: %0.3f Wh", stateNames[i], rec.energy[i] / 3600000.0);
+            ui->println(output);
+        }
+        for (int i = 0; i < N_CHANNELS; i++) {
+            sprintf(output, "Strobe %-5s: %lu frames, %0.3f s on", channelNames[i],
+                (unsigned long)rec.frames[i], rec.strobeOnTime[i] / 1000000.0);
+            ui->println(output);
+        }
+    }
+};
+
+#endif
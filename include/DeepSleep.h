@@ -1,3 +1,18 @@
+/** @file DeepSleep.h
+ *  @brief STANDBY until an RTC alarm at any time, with wake timing
+ *
+ *  The RTC alarm matches the full date and time, so a sleep can last any
+ *  number of seconds or end at an absolute time instead of the next minute
+ *  or hour boundary. Another interrupt that wakes the core early sends it
+ *  back to sleep until the alarm time.
+ *
+ *  The caller powers the peripherals down before sleepUntil() and brings
+ *  them back after it, then calls ready(): the time from the alarm to
+ *  ready() is the wake-to-ready time kept here.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
 #ifndef _DEEPSLEEP
 
 #define _DEEPSLEEP
@@ -6,20 +21,91 @@
 
 class DeepSleep {
 
+    private:
+    RTCZero * rtc;
+    static volatile bool alarmFired;
+
+    // Statistics
+    uint32_t sleeps;
+    uint32_t earlyWakes;            /**< Wakes before the alarm that went back to sleep */
+    uint32_t sleptSeconds;
+    unsigned long wokeMicros;       /**< micros() at the last wake */
+    unsigned long lastReady;        /**< us from the last wake to ready() */
+    unsigned long maxReady;
+
+    static void alarmCallback() {
+        alarmFired = true;
+    }
+
     public:
 
     DeepSleep() {
+        rtc = NULL;
+        sleeps = 0;
+        earlyWakes = 0;
+        sleptSeconds = 0;
+        wokeMicros = 0;
+        lastReady = 0;
+        maxReady = 0;
     }
 
-    void goToSleep(uint8_t sec, uint8_t min, uint8_t hour, RTCZero * rtc, RTCZero::Alarm_Match alarmMatch) {
-        if (rtc != NULL) {
-            rtc->setAlarmTime(0, 0, 0);
-            rtc->enableAlarm(alarmMatch);
+    void begin(RTCZero * rtc) {
+        this->rtc = rtc;
+    }
+
+    /**
+     * @brief Stand by until an RTC time, the peripherals must be down
+     *
+     * @param epoch Wake time in s, as RTCZero::getEpoch()
+     * @return false if the time is not in the future
+     */
+    bool sleepUntil(uint32_t epoch) {
+        if (rtc == NULL || epoch <= rtc->getEpoch())
+            return false;
+        uint32_t start = rtc->getEpoch();
+        alarmFired = false;
+        rtc->attachInterrupt(alarmCallback);
+        rtc->setAlarmEpoch(epoch);
+        rtc->enableAlarm(RTCZero::MATCH_YYMMDDHHMMSS);
+        rtc->standbyMode();
+        while (!alarmFired && rtc->getEpoch() < epoch) {
+            earlyWakes++;
             rtc->standbyMode();
         }
+        wokeMicros = micros();
+        rtc->disableAlarm();
+        rtc->detachInterrupt();
+        sleeps++;
+        sleptSeconds += rtc->getEpoch() - start;
+        return true;
     }
 
+    /**
+     * @brief Stand by for a number of seconds
+     */
+    bool sleepFor(uint32_t seconds) {
+        return rtc != NULL && sleepUntil(rtc->getEpoch() + seconds);
+    }
+
+    /** The system is back up after the last sleep */
+    void ready() {
+        lastReady = micros() - wokeMicros;
+        if (lastReady > maxReady)
+            maxReady = lastReady;
+    }
+
+    unsigned long getLastReady() {
+        return lastReady;
+    }
+
+    void print(Stream * ui) {
+        char output[128];
+        sprintf(output, "\r\nSleeps: %lu, slept: %lu s, early wakes: %lu, wake to ready: %lu us, max: %lu us",
+            (unsigned long)sleeps, (unsigned long)sleptSeconds, (unsigned long)earlyWakes, lastReady, maxReady);
+        ui->print(output);
+    }
 };
 
+volatile bool DeepSleep::alarmFired = false;
 
 #endif
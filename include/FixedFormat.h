@@ -0,0 +1,240 @@
+/** @file FixedFormat.h
+ *  @brief Allocation free formatting of fixed point telemetry
+ *
+ *  Values are passed as scaled integers (mV, 0.001 C, Pa, ...) with the
+ *  number of decimals to print, so a line is built with integer division
+ *  by 10 only, no soft float and no heap. Text is appended to a caller
+ *  buffer and always terminated; anything that does not fit is dropped
+ *  and flagged by overflow().
+ *
+ *  fixedRound() and fixedRoundQ() convert floats and binary fixed point
+ *  values with the round half to even of printf, so fixed() prints the
+ *  same digits as "%.Nf" on the same value.
+ *
+ *  No Arduino dependencies.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _FIXEDFORMAT
+
+#define _FIXEDFORMAT
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+/** Powers of ten up to the largest number of decimals supported */
+const uint32_t fixedPow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+#define FIXED_MAX_DECIMALS 6
+
+/**
+ * @brief Round a float to a scaled integer, value * 10^decimals
+ *
+ * Works on the bits of the float: mantissa * 10^decimals is exact in 44
+ * bits, so the binary exponent becomes a shift and ties are rounded to
+ * even as printf does, with no float or double math. Saturates at the
+ * int32 range, NaN gives 0.
+ */
+inline int32_t fixedRound(float value, int decimals) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bool negative = (bits >> 31) != 0;
+    int exponent = (bits >> 23) & 0xFF;
+    uint64_t mantissa = bits & 0x7FFFFF;
+    if (exponent == 0xFF)
+        return mantissa != 0 ? 0 : negative ? INT32_MIN : INT32_MAX;
+    // value = mantissa * 2^(exponent - 150), subnormals have exponent 1
+    if (exponent == 0)
+        exponent = 1;
+    else
+        mantissa |= 0x800000;
+    uint64_t v = mantissa * fixedPow10[decimals];
+    int shift = exponent - 150;
+    uint64_t n = 0;
+    bool up = false;
+    if (shift >= 0) {
+        n = shift > 20 ? UINT64_MAX : v << shift;
+    }
+    else if (shift >= -63) {
+        // Anything shifted further is below 2^44 / 2^64 and rounds to zero
+        n = v >> -shift;
+        uint64_t rem = v & ((1ULL << -shift) - 1);
+        uint64_t half = 1ULL << (-shift - 1);
+        up = rem > half || (rem == half && (n & 1));
+    }
+    if (n >= INT32_MAX)
+        return negative ? INT32_MIN : INT32_MAX;
+    if (up)
+        n++;
+    return negative ? -(int32_t)n : (int32_t)n;
+}
+
+/**
+ * @brief Round an unsigned binary fixed point value to a scaled integer
+ *
+ * @param value     Raw value, value / 2^fracBits
+ * @param fracBits  Fractional bits, at most 16
+ * @param decimals  Decimals of the result, value * 10^decimals must fit 32 bits
+ */
+inline uint32_t fixedRoundQ(uint32_t value, int fracBits, int decimals) {
+    uint64_t v = (uint64_t)value * fixedPow10[decimals];
+    uint32_t n = (uint32_t)(v >> fracBits);
+    uint64_t rem = v & ((1ULL << fracBits) - 1);
+    uint64_t half = fracBits > 0 ? 1ULL << (fracBits - 1) : 1;
+    if (rem > half || (rem == half && (n & 1)))
+        n++;
+    return n;
+}
+
+/**
+ * @brief Integer quotient rounded half away from zero, for window means
+ */
+inline int32_t fixedDivRound(int32_t value, int32_t divisor) {
+    if (value < 0)
+        return -((-value + divisor / 2) / divisor);
+    return (value + divisor / 2) / divisor;
+}
+
+class FixedFormat {
+
+    private:
+    char * buf;
+    size_t size;
+    size_t len;
+    bool truncated;
+
+    void put(char c) {
+        if (len + 1 < size)
+            buf[len++] = c;
+        else
+            truncated = true;
+    }
+
+    /** Digits of v, at least width of them with leading zeros */
+    void digits(uint32_t v, int width) {
+        char tmp[10];
+        int n = 0;
+        do {
+            tmp[n++] = '0' + v % 10;
+            v /= 10;
+        } while (v > 0);
+        while (width-- > n)
+            put('0');
+        while (n > 0)
+            put(tmp[--n]);
+    }
+
+    public:
+
+    /**
+     * @param buf   Output buffer, terminated after every append
+     * @param size  Size of buf in bytes including the terminator
+     */
+    FixedFormat(char * buf, size_t size) {
+        this->buf = buf;
+        this->size = size;
+        clear();
+    }
+
+    void clear() {
+        len = 0;
+        truncated = false;
+        if (size > 0)
+            buf[0] = '\0';
+    }
+
+    FixedFormat & str(const char * s) {
+        while (*s)
+            put(*s++);
+        buf[len] = '\0';
+        return *this;
+    }
+
+    FixedFormat & chr(char c) {
+        put(c);
+        buf[len] = '\0';
+        return *this;
+    }
+
+    /** Append a field separator */
+    FixedFormat & sep() {
+        return chr(',');
+    }
+
+    /**
+     * @brief Append an unsigned integer
+     *
+     * @param width Minimum number of digits, padded with zeros as "%0Nu"
+     */
+    FixedFormat & u32(uint32_t v, int width = 0) {
+        digits(v, width);
+        buf[len] = '\0';
+        return *this;
+    }
+
+    FixedFormat & i32(int32_t v) {
+        if (v < 0)
+            put('-');
+        digits(v < 0 ? 0U - (uint32_t)v : (uint32_t)v, 0);
+        buf[len] = '\0';
+        return *this;
+    }
+
+    /**
+     * @brief Append a scaled integer as a decimal number
+     *
+     * fixed(-1234, 3) appends "-1.234", like "%.3f" of -1.234.
+     *
+     * @param v         Value * 10^decimals
+     * @param decimals  0 to FIXED_MAX_DECIMALS
+     */
+    FixedFormat & fixed(int32_t v, int decimals) {
+        uint32_t mag = v < 0 ? 0U - (uint32_t)v : (uint32_t)v;
+        uint32_t scale = fixedPow10[decimals];
+        if (v < 0)
+            put('-');
+        digits(mag / scale, 0);
+        if (decimals > 0) {
+            put('.');
+            digits(mag % scale, decimals);
+        }
+        buf[len] = '\0';
+        return *this;
+    }
+
+    /** Append a float rounded as "%.Nf" does, for values that are not fixed point yet */
+    FixedFormat & fixedf(float v, int decimals) {
+        int32_t n = fixedRound(v, decimals);
+        // "%.Nf" keeps the sign of values that round to zero
+        if (n == 0 && signbit(v))
+            put('-');
+        return fixed(n, decimals);
+    }
+
+    /** Append a byte as two upper case hex digits */
+    FixedFormat & hex8(uint8_t v) {
+        const char * hex = "0123456789ABCDEF";
+        put(hex[v >> 4]);
+        put(hex[v & 0x0F]);
+        buf[len] = '\0';
+        return *this;
+    }
+
+    const char * c_str() {
+        return buf;
+    }
+
+    size_t length() {
+        return len;
+    }
+
+    /** True if something did not fit in the buffer */
+    bool overflow() {
+        return truncated;
+    }
+};
+
+#endif
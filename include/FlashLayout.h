@@ -0,0 +1,33 @@
+/** @file FlashLayout.h
+ *  @brief Allocation of the onboard SPI flash
+ *
+ *  The Moteino M0 carries a 4 Mbit (512 KB) SPI flash, erasable in 4 KB
+ *  sectors and programmable in 256 byte pages. Every user of the flash
+ *  takes its region from here so regions never overlap.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _FLASHLAYOUT
+
+#define _FLASHLAYOUT
+
+#define FLASH_SIZE 0x80000          /**< 4 Mbit */
+#define FLASH_SECTOR_SIZE 0x1000    /**< Smallest erasable block */
+#define FLASH_PAGE_SIZE 0x100       /**< Largest single program operation */
+
+// SystemConfig parameters, one sector
+#define FLASH_CONFIG_ADDR 0x000000
+
+// Lifetime counters, two sectors written alternately
+#define FLASH_COUNTERS_ADDR 0x001000
+#define FLASH_COUNTERS_SECTORS 2
+
+// Focus calibration table, one sector
+#define FLASH_FOCUSCAL_ADDR 0x003000
+
+// Telemetry ring used when the SD card is missing, rest of the chip
+#define FLASH_LOG_ADDR 0x010000
+#define FLASH_LOG_END FLASH_SIZE
+
+#endif
@@ -0,0 +1,300 @@
+/** @file FlashLog.h
+ *  @brief Circular telemetry log in the onboard SPI flash
+ *
+ *  Takes log records while the SD card is missing or failing and hands
+ *  them back in order once a sink is available again.
+ *
+ *  Records ([type][length][payload], as in BinaryLogFormat.h) are packed
+ *  into a RAM page and programmed one full page at a time. Sectors are
+ *  erased in the background ahead of the write pointer, and when the ring
+ *  is full the oldest sector is given up. update() performs at most one
+ *  flash operation and never waits on a busy chip.
+ *
+ *  Every page carries its sequence number, so the read and write pointers
+ *  are recovered at boot from the page headers alone. Drained pages are
+ *  marked by clearing a header byte, which needs no erase. read() hands
+ *  out a waiting page without draining it.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _FLASHLOG
+
+#define _FLASHLOG
+
+#include <Arduino.h>
+#include "FlashLayout.h"
+#include "SystemConfig.h"
+#include "BinaryLogFormat.h"
+#include "Utils.h"
+
+#define FLASHLOG_PAGES ((FLASH_LOG_END - FLASH_LOG_ADDR) / FLASH_PAGE_SIZE)
+#define FLASHLOG_SECTOR_PAGES (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define FLASHLOG_PAYLOAD (FLASH_PAGE_SIZE - sizeof(FlashLogHeader))
+#define FLASHLOG_PENDING 0xFF       /**< drained byte of a page not yet drained */
+
+/** Start of every programmed page */
+struct FlashLogHeader {
+    uint32_t sequence;              /**< Page number since the log was created */
+    uint8_t length;                 /**< Payload bytes */
+    uint8_t drained;                /**< FLASHLOG_PENDING until drained, then 0 */
+    uint16_t crc;                   /**< CRC of sequence, length and payload */
+} __attribute__((packed));
+
+class FlashLog {
+
+    private:
+    uint32_t head;                  /**< Sequence of the next page to program */
+    uint32_t tail;                  /**< Sequence of the oldest undrained page */
+    uint32_t erasedEnd;             /**< Pages before this sequence are erased */
+
+    uint8_t buffers[2][FLASH_PAGE_SIZE];
+    int active;
+    int fill;                       /**< Payload bytes in the active buffer */
+    int pendingBuf;                 /**< Buffer waiting to be programmed, -1 for none */
+    int pendingLen;
+
+    uint32_t droppedRecords;        /**< Lost because both RAM pages were full */
+    uint32_t lostPages;             /**< Overwritten before they were drained */
+    uint32_t badPages;              /**< Failed the CRC when drained */
+    uint32_t drainedPages;
+
+    uint32_t pageAddr(uint32_t sequence) {
+        return FLASH_LOG_ADDR + (sequence % FLASHLOG_PAGES) * FLASH_PAGE_SIZE;
+    }
+
+    uint16_t pageCrc(uint8_t * page) {
+        FlashLogHeader * h = (FlashLogHeader *)page;
+        uint16_t crc = crc16(page, 5);
+        return crc16(page + sizeof(FlashLogHeader), h->length, crc);
+    }
+
+    /** Read a programmed page, true if its header and CRC check out */
+    bool loadPage(uint32_t sequence, uint8_t * page) {
+        FlashLogHeader * h = (FlashLogHeader *)page;
+        uint32_t addr = pageAddr(sequence);
+        _flash.readBytes(addr, page, sizeof(FlashLogHeader));
+        if (h->length > FLASHLOG_PAYLOAD)
+            return false;
+        _flash.readBytes(addr + sizeof(FlashLogHeader), page + sizeof(FlashLogHeader), h->length);
+        return h->sequence == sequence && h->crc == pageCrc(page);
+    }
+
+    /** Call sink(type, payload, length) for every record of a loaded page */
+    template <class Sink>
+    void records(const uint8_t * page, Sink sink) {
+        const FlashLogHeader * h = (const FlashLogHeader *)page;
+        int i = sizeof(FlashLogHeader);
+        int end = i + h->length;
+        while (i + BINLOG_FRAME_SIZE <= end) {
+            uint8_t type = page[i];
+            uint8_t len = page[i + 1];
+            if (i + BINLOG_FRAME_SIZE + len > end)
+                break;
+            sink(type, page + i + BINLOG_FRAME_SIZE, len);
+            i += BINLOG_FRAME_SIZE + len;
+        }
+    }
+
+    void seal() {
+        pendingBuf = active;
+        pendingLen = fill;
+        active ^= 1;
+        fill = 0;
+    }
+
+    void program() {
+        uint8_t * page = buffers[pendingBuf];
+        FlashLogHeader * h = (FlashLogHeader *)page;
+        h->sequence = head;
+        h->length = pendingLen;
+        h->drained = FLASHLOG_PENDING;
+        h->crc = pageCrc(page);
+        _flash.writeBytes(pageAddr(head), page, sizeof(FlashLogHeader) + pendingLen);
+        head++;
+        pendingBuf = -1;
+    }
+
+    void eraseAhead() {
+        // Give up the oldest sector if the ring is full
+        uint32_t oldest = erasedEnd + FLASHLOG_SECTOR_PAGES - FLASHLOG_PAGES;
+        if (erasedEnd + FLASHLOG_SECTOR_PAGES > FLASHLOG_PAGES && (int32_t)(tail - oldest) < 0) {
+            lostPages += oldest - tail;
+            tail = oldest;
+        }
+        _flash.blockErase4K(pageAddr(erasedEnd));
+        erasedEnd += FLASHLOG_SECTOR_PAGES;
+    }
+
+    public:
+
+    FlashLog() {
+        head = 0;
+        tail = 0;
+        erasedEnd = 0;
+        active = 0;
+        fill = 0;
+        pendingBuf = -1;
+        pendingLen = 0;
+        droppedRecords = 0;
+        lostPages = 0;
+        badPages = 0;
+        drainedPages = 0;
+    }
+
+    /**
+     * @brief Recover the read and write pointers from the page headers
+     */
+    void begin() {
+        bool found = false;
+        bool pending = false;
+        uint32_t newest = 0;
+        uint32_t oldestPending = 0;
+        FlashLogHeader h;
+
+        for (uint32_t p = 0; p < FLASHLOG_PAGES; p++) {
+            _flash.readBytes(FLASH_LOG_ADDR + p * FLASH_PAGE_SIZE, &h, sizeof(h));
+            if (h.length > FLASHLOG_PAYLOAD || h.sequence % FLASHLOG_PAGES != p)
+                continue;
+            if (!found || (int32_t)(h.sequence - newest) > 0)
+                newest = h.sequence;
+            if (h.drained == FLASHLOG_PENDING && (!pending || (int32_t)(h.sequence - oldestPending) < 0))
+                oldestPending = h.sequence;
+            pending |= h.drained == FLASHLOG_PENDING;
+            found = true;
+        }
+
+        head = found ? newest + 1 : 0;
+        tail = pending ? oldestPending : head;
+
+        // The rest of the sector being written was erased with it
+        erasedEnd = head;
+        if (head % FLASHLOG_SECTOR_PAGES != 0)
+            erasedEnd += FLASHLOG_SECTOR_PAGES - head % FLASHLOG_SECTOR_PAGES;
+    }
+
+    /**
+     * @brief Queue a record, never touches the flash
+     *
+     * @return false if both RAM pages are full
+     */
+    bool write(uint8_t type, const void * payload, int len) {
+        if (len > 255)
+            len = 255;
+        int size = BINLOG_FRAME_SIZE + len;
+        if (size > (int)FLASHLOG_PAYLOAD) {
+            droppedRecords++;
+            return false;
+        }
+        if (fill + size > (int)FLASHLOG_PAYLOAD) {
+            if (pendingBuf >= 0) {
+                droppedRecords++;
+                return false;
+            }
+            seal();
+        }
+        uint8_t * p = buffers[active] + sizeof(FlashLogHeader) + fill;
+        p[0] = type;
+        p[1] = len;
+        memcpy(p + BINLOG_FRAME_SIZE, payload, len);
+        fill += size;
+        return true;
+    }
+
+    /**
+     * @brief Program or erase, at most one operation per call
+     *
+     * @param flush Also program a partly filled page, eg. when a sink is
+     *              ready and everything should move out of RAM
+     */
+    void update(bool flush = false) {
+        if (flush && pendingBuf < 0 && fill > 0)
+            seal();
+
+        if (_flash.busy())
+            return;
+
+        if (pendingBuf >= 0 && (int32_t)(erasedEnd - head) > 0) {
+            program();
+            return;
+        }
+
+        // Keep one erased sector ahead of the write pointer
+        if ((int32_t)(erasedEnd - head) < (int32_t)FLASHLOG_SECTOR_PAGES)
+            eraseAhead();
+    }
+
+    /** True when nothing is waiting in RAM or flash */
+    bool empty() {
+        return head == tail && fill == 0 && pendingBuf < 0;
+    }
+
+    /** Pages programmed but not yet drained */
+    uint32_t pending() {
+        return head - tail;
+    }
+
+    /** Sequence of the oldest page not yet drained, see read() */
+    uint32_t oldest() {
+        return tail;
+    }
+
+    /**
+     * @brief Hand the records of the oldest page to a sink
+     *
+     * @param sink Called as sink(type, payload, length) for every record,
+     *             must accept at least one page of data
+     * @return false if there was nothing to drain or the flash is busy
+     */
+    template <class Sink>
+    bool drain(Sink sink) {
+        if (head == tail || _flash.busy())
+            return false;
+
+        uint8_t page[FLASH_PAGE_SIZE];
+        uint32_t addr = pageAddr(tail);
+        if (!loadPage(tail, page)) {
+            badPages++;
+        }
+        else {
+            records(page, sink);
+            // Clearing bits needs no erase
+            uint8_t drained = 0;
+            _flash.writeBytes(addr + offsetof(FlashLogHeader, drained), &drained, 1);
+            drainedPages++;
+        }
+        tail++;
+        return true;
+    }
+
+    /**
+     * @brief Hand the records of a waiting page to a sink, leaving it waiting
+     *
+     * @param sequence From oldest() up to oldest() + pending()
+     * @return false if the page is not waiting, failed its CRC or the
+     *         flash is busy
+     */
+    template <class Sink>
+    bool read(uint32_t sequence, Sink sink) {
+        if (sequence - tail >= head - tail || _flash.busy())
+            return false;
+        uint8_t page[FLASH_PAGE_SIZE];
+        if (!loadPage(sequence, page))
+            return false;
+        records(page, sink);
+        return true;
+    }
+
+    void print(Stream * ui) {
+        char output[96];
+        ui->println();
+        sprintf(output, "Flash log: %lu of %lu pages waiting, %d bytes in RAM",
+            (unsigned long)pending(), (unsigned long)FLASHLOG_PAGES, fill + (pendingBuf >= 0 ? pendingLen : 0));
+        ui->println(output);
+        sprintf(output, "Drained: %lu pages, lost: %lu pages, bad: %lu pages, dropped: %lu records",
+            (unsigned long)drainedPages, (unsigned long)lostPages, (unsigned long)badPages, (unsigned long)droppedRecords);
+        ui->println(output);
+    }
+};
+
+#endif
@@ -0,0 +1,126 @@
+/** @file FocalSweep.h
+ *  @brief Focal sweep stepped by the camera trigger
+ *
+ *  A sweep takes exactly N frames from a start to a stop focal power at
+ *  the trigger rate. The lens first settles at the start power, then the
+ *  trigger interrupt counts each frame after its exposure has closed and
+ *  update() sends the lens to the power of the next frame, one step of
+ *  (stop - start) / (N - 1) per trigger. The serial lens commands stay in
+ *  the main loop, the interrupt only counts.
+ *
+ *  Frames are tagged with the focal power the lens had acknowledged at the
+ *  exposure, so a frame the lens lagged on carries the power it was
+ *  really taken at.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _FOCALSWEEP
+
+#define _FOCALSWEEP
+
+#include <Arduino.h>
+#include "Optotune.h"
+
+#define SWEEP_DEFAULT_FRAMES 101    /**< MAX_FP to MIN_FP in 0.05 dpt steps */
+
+// Sweep states
+#define SWEEP_IDLE 0
+#define SWEEP_SETTLING 1            /**< Lens moving to the start power */
+#define SWEEP_RUNNING 2
+
+class FocalSweep {
+
+    private:
+    volatile uint8_t state;
+    float start;
+    float inc;                      /**< Focal power step per frame */
+    uint32_t frames;
+    volatile uint32_t taken;        /**< Frames of the sweep so far, from the trigger interrupt */
+    uint32_t stepped;               /**< Frames the lens has been sent on from */
+    volatile bool finished;         /**< The last frame was taken, not reported yet */
+
+    public:
+
+    FocalSweep() {
+        state = SWEEP_IDLE;
+        start = 0.0;
+        inc = 0.0;
+        frames = 0;
+        taken = 0;
+        stepped = 0;
+        finished = false;
+    }
+
+    /**
+     * @brief Move the lens to the start power and sweep from the next trigger after it settles
+     *
+     * @param frames At least 2
+     */
+    void begin(Optotune * etl, float start, float stop, uint32_t frames) {
+        state = SWEEP_IDLE;
+        this->start = start;
+        this->frames = frames;
+        inc = (stop - start) / (frames - 1);
+        finished = false;
+        etl->move(start, 0.0);
+        state = SWEEP_SETTLING;
+    }
+
+    /** Abandon the sweep, the lens stays where it is */
+    void stop() {
+        state = SWEEP_IDLE;
+    }
+
+    bool active() {
+        return state != SWEEP_IDLE;
+    }
+
+    /**
+     * @brief Count a frame, called from the trigger interrupt after the exposure
+     *
+     * @return true if the frame is part of the sweep
+     */
+    bool frameTaken() {
+        if (state != SWEEP_RUNNING)
+            return false;
+        if (++taken >= frames) {
+            state = SWEEP_IDLE;
+            finished = true;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Start the sweep once the lens settled and step it after each frame
+     *
+     * @return true once when the last frame was taken
+     */
+    bool update(Optotune * etl) {
+        if (state == SWEEP_SETTLING && !etl->busy()) {
+            taken = 0;
+            stepped = 0;
+            state = SWEEP_RUNNING;
+        }
+        uint32_t n = taken;
+        if (state == SWEEP_RUNNING && stepped < n) {
+            etl->move(start + n * inc, 0.0);
+            stepped = n;
+        }
+        if (finished) {
+            finished = false;
+            return true;
+        }
+        return false;
+    }
+
+    uint32_t getTaken() {
+        return taken;
+    }
+
+    uint32_t getFrames() {
+        return frames;
+    }
+};
+
+#endif
@@ -0,0 +1,212 @@
+/** @file FocusCal.h
+ *  @brief Focus calibration from object distance to lens focal power
+ *
+ *  FOCUSPOS and the sequence MOVE and FOCALSTACK positions are object
+ *  distances in um, the Optotune lens takes a focal power in diopters.
+ *  The table holds up to FOCUSCAL_POINTS measured (distance, focal power)
+ *  pairs at a reference housing temperature and a linear temperature
+ *  coefficient. A distance is mapped by linear interpolation between the
+ *  neighbouring points, clipped to the first and last point, then
+ *  corrected for the difference between the BME280 temperature and the
+ *  reference.
+ *
+ *  The table lives in one SPI flash sector. save() erases it and writes
+ *  the record from later update() calls so the loop never waits on the
+ *  erase.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _FOCUSCAL
+
+#define _FOCUSCAL
+
+#include <Arduino.h>
+#include "FlashLayout.h"
+#include "SystemConfig.h"
+#include "Utils.h"
+
+#define FOCUSCAL_MAGIC 0x46434C31      /**< "FCL1" */
+#define FOCUSCAL_POINTS 16
+
+struct FocusCalPoint {
+    int32_t distance;                   /**< Object distance in um */
+    float power;                        /**< Focal power in diopters at refTemp */
+};
+
+/** Persistent calibration, fits in one flash page */
+struct FocusCalRecord {
+    uint32_t magic;
+    uint8_t count;                      /**< Points in use, sorted by distance */
+    uint8_t reserved[3];
+    int32_t refTemp;                    /**< Temperature of the points in 0.01 C */
+    float tempCoeff;                    /**< Focal power change in diopters per C */
+    FocusCalPoint points[FOCUSCAL_POINTS];
+    uint16_t reserved2;
+    uint16_t crc;                       /**< CRC of all fields above */
+};
+
+static_assert(sizeof(FocusCalRecord) <= FLASH_PAGE_SIZE, "FocusCalRecord does not fit in a flash page");
+
+class FocusCal {
+
+    private:
+    FocusCalRecord rec;
+    int32_t temperature;                /**< Latest housing temperature in 0.01 C */
+    bool haveTemp;
+    bool saving;                        /**< Waiting to erase or write the sector */
+    bool erased;
+
+    uint16_t recordCrc(const FocusCalRecord & r) {
+        return crc16((const uint8_t*)&r, offsetof(FocusCalRecord, crc));
+    }
+
+    /** Temperature correction in diopters */
+    float correction() {
+        if (!haveTemp)
+            return 0.0;
+        return rec.tempCoeff * (temperature - rec.refTemp) / 100.0;
+    }
+
+    public:
+
+    FocusCal() {
+        rec.magic = 0;
+        clear();
+        temperature = 0;
+        haveTemp = false;
+        saving = false;
+        erased = false;
+    }
+
+    /** Load the table from flash, an empty table if there is none */
+    void begin() {
+        FocusCalRecord r;
+        _flash.readBytes(FLASH_FOCUSCAL_ADDR, &r, sizeof(r));
+        if (r.magic == FOCUSCAL_MAGIC && r.crc == recordCrc(r) && r.count <= FOCUSCAL_POINTS)
+            rec = r;
+        else
+            clear();
+    }
+
+    /** Remove all points, the temperature model is kept */
+    void clear() {
+        float coeff = rec.magic == FOCUSCAL_MAGIC ? rec.tempCoeff : 0.0;
+        int32_t ref = rec.magic == FOCUSCAL_MAGIC ? rec.refTemp : 2000;
+        memset(&rec, 0, sizeof(rec));
+        rec.magic = FOCUSCAL_MAGIC;
+        rec.tempCoeff = coeff;
+        rec.refTemp = ref;
+    }
+
+    /** Housing temperature in 0.01 C, from the BME280 */
+    void setTemperature(int32_t temperature) {
+        this->temperature = temperature;
+        haveTemp = true;
+    }
+
+    /**
+     * @param refTemp   Temperature the points are referred to in 0.01 C
+     * @param coeff     Focal power change in diopters per C
+     */
+    void setTempModel(int32_t refTemp, float coeff) {
+        rec.refTemp = refTemp;
+        rec.tempCoeff = coeff;
+    }
+
+    /**
+     * @brief Add a point or replace the one at the same distance
+     *
+     * @param power Focal power measured at the current temperature
+     * @return false if the table is full
+     */
+    bool addPoint(int32_t distance, float power) {
+        power -= correction();
+        int i = 0;
+        while (i < rec.count && rec.points[i].distance < distance)
+            i++;
+        if (i < rec.count && rec.points[i].distance == distance) {
+            rec.points[i].power = power;
+            return true;
+        }
+        if (rec.count >= FOCUSCAL_POINTS)
+            return false;
+        memmove(&rec.points[i + 1], &rec.points[i], (rec.count - i) * sizeof(FocusCalPoint));
+        rec.points[i].distance = distance;
+        rec.points[i].power = power;
+        rec.count++;
+        return true;
+    }
+
+    bool valid() {
+        return rec.count > 0;
+    }
+
+    /**
+     * @brief Focal power that focuses at a distance now
+     *
+     * @return false if the table is empty
+     */
+    bool focalPower(int32_t distance, float * power) {
+        if (rec.count == 0)
+            return false;
+        FocusCalPoint * p = rec.points;
+        int n = rec.count;
+        if (distance <= p[0].distance) {
+            *power = p[0].power;
+        }
+        else if (distance >= p[n - 1].distance) {
+            *power = p[n - 1].power;
+        }
+        else {
+            int i = 1;
+            while (p[i].distance < distance)
+                i++;
+            float f = (float)(distance - p[i - 1].distance) / (p[i].distance - p[i - 1].distance);
+            *power = p[i - 1].power + f * (p[i].power - p[i - 1].power);
+        }
+        *power += correction();
+        return true;
+    }
+
+    /** Write the table to flash from the next update() calls */
+    void save() {
+        saving = true;
+        erased = false;
+    }
+
+    bool isSaving() {
+        return saving;
+    }
+
+    /** Carry out a save, never waits on the flash */
+    void update() {
+        if (!saving || _flash.busy())
+            return;
+        if (!erased) {
+            _flash.blockErase4K(FLASH_FOCUSCAL_ADDR);
+            erased = true;
+            return;
+        }
+        rec.crc = recordCrc(rec);
+        _flash.writeBytes(FLASH_FOCUSCAL_ADDR, &rec, sizeof(rec));
+        saving = false;
+    }
+
+    void print(Stream * ui) {
+        char output[96];
+        sprintf(output, "\r\nFocus calibration, %d points at %0.2f C, %0.4f dpt/C%s",
+            rec.count, rec.refTemp / 100.0, rec.tempCoeff, saving ? ", saving" : "");
+        ui->print(output);
+        if (haveTemp) {
+            sprintf(output, "\r\nHousing %0.2f C, correction %0.4f dpt", temperature / 100.0, correction());
+            ui->print(output);
+        }
+        for (int i = 0; i < rec.count; i++) {
+            sprintf(output, "\r\n%8ld um  %7.3f dpt", (long)rec.points[i].distance, rec.points[i].power);
+            ui->print(output);
+        }
+    }
+};
+
+#endif
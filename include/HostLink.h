@@ -0,0 +1,269 @@
+/** @file HostLink.h
+ *  @brief COBS framed, CRC checked packet link to the Jetson
+ *
+ *  The machine counterpart of the command prompt, on the hardware port
+ *  selected by LINKPORT. The packet format is in HostLinkFormat.h. poll()
+ *  collects bytes into a frame each loop without waiting and returns true
+ *  when a packet with a good CRC is ready, SystemControl then handles it.
+ *
+ *  While the link owns a port the port's command prompt is off and its
+ *  output queue carries frames instead of text lines. Ports without an
+ *  output queue are written directly.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _HOSTLINK
+
+#define _HOSTLINK
+
+#include <Arduino.h>
+#include "HostLinkFormat.h"
+#include "TxQueue.h"
+#include "Utils.h"
+
+class HostLink {
+
+    private:
+    Stream * port;
+    TxQueue * tx;
+    uint8_t frame[HOSTLINK_MAX_ENCODED];    /**< Encoded bytes received so far */
+    uint16_t frameLength;
+    bool frameOverflow;
+    uint8_t packet[HOSTLINK_MAX_PACKET];    /**< Last good packet, decoded */
+    uint16_t packetLength;
+    bool streaming;
+
+    // Statistics
+    uint32_t packetsIn;
+    uint32_t packetsOut;
+    uint32_t badFrames;
+    uint32_t dropped;
+
+    /** Decode the frame received, false if it is not a good packet */
+    bool decodeFrame() {
+        if (frameOverflow || frameLength == 0)
+            return false;
+        packetLength = cobsDecode(frame, frameLength, packet, sizeof(packet));
+        if (packetLength < HOSTLINK_HEADER + HOSTLINK_CRC)
+            return false;
+        uint16_t crc = packet[packetLength - 2] | (packet[packetLength - 1] << 8);
+        if (crc != crc16(packet, packetLength - HOSTLINK_CRC)) {
+            ack(packet[1], HL_BAD_CRC);
+            return false;
+        }
+        return true;
+    }
+
+    public:
+
+    HostLink() {
+        port = NULL;
+        tx = NULL;
+        frameLength = 0;
+        frameOverflow = false;
+        packetLength = 0;
+        streaming = false;
+        resetStats();
+    }
+
+    /** Take over a port, NULL turns the link off */
+    void setPort(Stream * port) {
+        if (port == this->port)
+            return;
+        if (tx != NULL)
+            tx->setFramed(false);
+        this->port = port;
+        tx = getTxQueue(port);
+        if (tx != NULL)
+            tx->setFramed(true);
+        frameLength = 0;
+        frameOverflow = false;
+        streaming = false;
+    }
+
+    Stream * getPort() {
+        return port;
+    }
+
+    bool active() {
+        return port != NULL;
+    }
+
+    /**
+     * @brief Read waiting bytes
+     *
+     * @return true when a packet is ready, call again for the next one
+     */
+    bool poll() {
+        if (port == NULL)
+            return false;
+        while (port->available() > 0) {
+            uint8_t c = port->read();
+            if (c != 0) {
+                if (frameLength < HOSTLINK_MAX_ENCODED)
+                    frame[frameLength++] = c;
+                else
+                    frameOverflow = true;
+                continue;
+            }
+            bool good = decodeFrame();
+            if (frameLength > 0 && !good)
+                badFrames++;
+            frameLength = 0;
+            frameOverflow = false;
+            if (good) {
+                packetsIn++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint8_t type() {
+        return packet[0];
+    }
+
+    uint8_t id() {
+        return packet[1];
+    }
+
+    uint8_t * payload() {
+        return packet + HOSTLINK_HEADER;
+    }
+
+    uint16_t payloadLength() {
+        return packetLength - HOSTLINK_HEADER - HOSTLINK_CRC;
+    }
+
+    /**
+     * @brief Send a packet, the payload may come in two parts
+     *
+     * @return false if the link is off or the output queue dropped it
+     */
+    bool send(uint8_t type, uint8_t id, const void * data, uint16_t length,
+        const void * tail = NULL, uint16_t tailLength = 0) {
+        if (port == NULL)
+            return false;
+        if (length + tailLength > HOSTLINK_MAX_PAYLOAD)
+            tailLength = HOSTLINK_MAX_PAYLOAD - length;
+
+        uint8_t out[HOSTLINK_MAX_PACKET];
+        uint16_t n = 0;
+        out[n++] = type;
+        out[n++] = id;
+        memcpy(out + n, data, length);
+        n += length;
+        if (tail != NULL) {
+            memcpy(out + n, tail, tailLength);
+            n += tailLength;
+        }
+        uint16_t crc = crc16(out, n);
+        out[n++] = crc & 0xFF;
+        out[n++] = crc >> 8;
+
+        uint8_t encoded[HOSTLINK_MAX_FRAME];
+        size_t len = cobsEncode(out, n, encoded);
+        bool sent = tx != NULL ? tx->writeFrame(encoded, len) : port->write(encoded, len) == len;
+        if (sent)
+            packetsOut++;
+        else
+            dropped++;
+        return sent;
+    }
+
+    /** Send a packet, waiting for the output queue to take it instead of dropping */
+    bool sendWait(uint8_t type, uint8_t id, const void * data, uint16_t length) {
+        if (tx != NULL)
+            tx->waitForRoom(HOSTLINK_MAX_FRAME);
+        return send(type, id, data, length);
+    }
+
+    bool ack(uint8_t id, uint8_t status) {
+        return send(HL_ACK, id, &status, 1);
+    }
+
+    void setStreaming(bool streaming) {
+        this->streaming = streaming;
+    }
+
+    /** Stream a binary log record if the host asked for telemetry */
+    void telemetry(uint8_t recordType, const void * record, uint16_t length) {
+        if (streaming)
+            send(HL_TELEMETRY, 0, &recordType, 1, record, length);
+    }
+
+    void event(uint8_t code) {
+        send(HL_EVENT, 0, &code, 1);
+    }
+
+    void resetStats() {
+        packetsIn = 0;
+        packetsOut = 0;
+        badFrames = 0;
+        dropped = 0;
+    }
+
+    void printStats(Stream * ui) {
+        char output[128];
+        sprintf(output, "\r\nHost link %s, packets in: %lu, out: %lu, bad frames: %lu, dropped: %lu, streaming: %d",
+            port == NULL ? "off" : "on", (unsigned long)packetsIn, (unsigned long)packetsOut,
+            (unsigned long)badFrames, (unsigned long)dropped, streaming);
+        ui->print(output);
+    }
+};
+
+/**
+ * @brief Stream that returns command output to the host as HL_TEXT packets
+ *
+ * Handlers print to it as to a port, full packets go out as they fill and
+ * flush() sends the rest. Each packet waits for room in the port queue,
+ * nothing pumps it while a handler runs.
+ */
+class HostLinkText : public Stream {
+
+    private:
+    HostLink * link;
+    uint8_t id;
+    uint8_t buffer[HOSTLINK_MAX_PAYLOAD];
+    uint16_t length;
+
+    public:
+
+    HostLinkText(HostLink * link, uint8_t id) {
+        this->link = link;
+        this->id = id;
+        length = 0;
+    }
+
+    size_t write(uint8_t c) {
+        buffer[length++] = c;
+        if (length == HOSTLINK_MAX_PAYLOAD)
+            flush();
+        return 1;
+    }
+
+    using Print::write;
+
+    void flush() {
+        if (length > 0)
+            link->sendWait(HL_TEXT, id, buffer, length);
+        length = 0;
+    }
+
+    int available() {
+        return 0;
+    }
+
+    int read() {
+        return -1;
+    }
+
+    int peek() {
+        return -1;
+    }
+};
+
+HostLink _hostlink;
+
+#endif
@@ -0,0 +1,149 @@
+/** @file HostLinkFormat.h
+ *  @brief Binary packet protocol between the controller and the Jetson
+ *
+ *  A packet is [type][id][payload][crc], the CRC is CRC-16/CCITT-FALSE
+ *  (poly 0x1021, init 0xFFFF) over type, id and payload, stored little
+ *  endian. Packets are COBS encoded so they contain no 0 byte and each one
+ *  is followed by a 0 delimiter, a receiver resynchronises at the next 0
+ *  after any error.
+ *
+ *  Every request from the host is answered with an HL_ACK carrying the
+ *  request id and a status. Replies with data (HL_TEXT, HL_CFG_VALUE,
+ *  HL_STATUS_DATA) use the same id and come before the HL_ACK. HL_TELEMETRY
+ *  and HL_EVENT packets are unsolicited and have id 0. Commands run without
+ *  confirmation questions, sending the request is the confirmation.
+ *
+ *  All multi byte values are little endian. Only depends on the C standard
+ *  library and BinaryLogFormat.h so a host program can include it.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _HOSTLINKFORMAT
+
+#define _HOSTLINKFORMAT
+
+#include <stdint.h>
+#include <stddef.h>
+#include "BinaryLogFormat.h"
+
+#define HOSTLINK_VERSION 1
+#define HOSTLINK_MAX_PACKET 256     /**< Decoded bytes including header and CRC */
+#define HOSTLINK_HEADER 2           /**< Type and id */
+#define HOSTLINK_CRC 2
+#define HOSTLINK_MAX_PAYLOAD (HOSTLINK_MAX_PACKET - HOSTLINK_HEADER - HOSTLINK_CRC)
+#define HOSTLINK_MAX_ENCODED (HOSTLINK_MAX_PACKET + HOSTLINK_MAX_PACKET / 254 + 1)  /**< COBS overhead, no delimiter */
+#define HOSTLINK_MAX_FRAME (HOSTLINK_MAX_ENCODED + 1)   /**< With the delimiter */
+
+// Requests, host to controller
+#define HL_PING 0x01            /**< No payload, answered with the protocol version */
+#define HL_CFG_GET 0x02         /**< Param name */
+#define HL_CFG_SET 0x03         /**< HostLinkConfigSet, param name */
+#define HL_SEQ_START 0x04       /**< uint8 sequence, clears it for loading */
+#define HL_SEQ_LINE 0x05        /**< uint8 sequence, one sequence command line */
+#define HL_STATUS 0x06          /**< No payload, answered with HL_STATUS_DATA */
+#define HL_COMMAND 0x07         /**< Command line as typed at the prompt, no CMD_CHAR */
+#define HL_STREAM 0x08          /**< uint8 1 to stream HL_TELEMETRY, 0 to stop */
+
+// Replies and unsolicited packets, controller to host
+#define HL_ACK 0x80             /**< uint8 status, uint8 protocol version for HL_PING */
+#define HL_TEXT 0x81            /**< Text output of an HL_COMMAND, may take several packets */
+#define HL_CFG_VALUE 0x82       /**< HostLinkConfigValue, param name */
+#define HL_STATUS_DATA 0x83     /**< HostLinkStatus */
+#define HL_TELEMETRY 0x84       /**< uint8 BINLOG_TYPE_*, then the binary log record */
+#define HL_EVENT 0x85           /**< uint8 HL_EVENT_* */
+
+// HL_ACK status
+#define HL_OK 0
+#define HL_BAD_CRC 1            /**< The id of the reply may be corrupt too */
+#define HL_UNKNOWN_TYPE 2
+#define HL_BAD_PAYLOAD 3
+#define HL_UNKNOWN_PARAM 4
+#define HL_OUT_OF_RANGE 5
+#define HL_UNKNOWN_COMMAND 6
+#define HL_BAD_ARGS 7
+#define HL_FAILED 8
+#define HL_BUSY 9               /**< Another session holds what the request needs */
+
+// HL_EVENT codes
+#define HL_EVENT_SHUTDOWN 1     /**< The camera power is about to be cut, shut down now */
+
+// Config param types
+#define HL_PARAM_INT 1
+#define HL_PARAM_FLOAT 2        /**< Values are IEEE 754 single precision bit patterns */
+
+struct HostLinkConfigValue {
+    uint8_t type;               /**< HL_PARAM_* */
+    int32_t value;
+    int32_t min;
+    int32_t max;
+} __attribute__((packed));
+
+struct HostLinkConfigSet {
+    uint8_t type;               /**< HL_PARAM_*, must match the param */
+    int32_t value;
+} __attribute__((packed));
+
+struct HostLinkStatus {
+    uint32_t epoch;             /**< RTC time in s */
+    uint16_t millis;            /**< ms part of the time */
+    uint8_t powerState;         /**< STATE_* of the controller */
+    uint8_t fault;              /**< FAULT_* power fault, 0 if none */
+    uint32_t frames;            /**< Triggers since boot */
+    BinaryPctlRecord log;       /**< Last completed LOGINT window */
+} __attribute__((packed));
+
+/**
+ * @brief COBS encode a packet and append the 0 delimiter
+ *
+ * @param out At least len + len / 254 + 2 bytes
+ * @return Bytes written including the delimiter
+ */
+inline size_t cobsEncode(const uint8_t * in, size_t len, uint8_t * out) {
+    size_t code = 0;        // position of the current code byte
+    size_t n = 1;
+    uint8_t run = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] == 0) {
+            out[code] = run;
+            code = n++;
+            run = 1;
+            continue;
+        }
+        out[n++] = in[i];
+        if (++run == 0xFF) {
+            out[code] = run;
+            code = n++;
+            run = 1;
+        }
+    }
+    out[code] = run;
+    out[n++] = 0;
+    return n;
+}
+
+/**
+ * @brief Decode a COBS frame without its delimiter
+ *
+ * @param size Bytes available at out
+ * @return Decoded length, 0 if the frame is malformed or does not fit
+ */
+inline size_t cobsDecode(const uint8_t * in, size_t len, uint8_t * out, size_t size) {
+    size_t n = 0;
+    size_t i = 0;
+    while (i < len) {
+        uint8_t code = in[i++];
+        if (code == 0 || i + code - 1 > len || n + code - 1 > size)
+            return 0;
+        for (uint8_t j = 1; j < code; j++)
+            out[n++] = in[i++];
+        if (code < 0xFF && i < len) {
+            if (n >= size)
+                return 0;
+            out[n++] = 0;
+        }
+    }
+    return n;
+}
+
+#endif
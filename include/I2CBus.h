@@ -0,0 +1,42 @@
+/** @file I2CBus.h
+ *  @brief Sharing the I2C bus between the main loop and the trigger interrupt
+ *
+ *  The trigger interrupt starts an INA260 conversion with one I2C write when
+ *  a strobe capture is armed (StrobeMonitor::trigger()). Wire is not
+ *  reentrant, so that write must never land inside a transaction of the
+ *  loop. Every loop path that touches the bus holds an I2CBusLock for the
+ *  length of its transactions and the interrupt leaves the bus alone while
+ *  one is held; the capture stays armed for the next trigger.
+ *
+ *  Only the loop takes and releases locks, the interrupt only reads the
+ *  count, so the count needs no critical section.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _I2CBUS
+
+#define _I2CBUS
+
+#include <Arduino.h>
+
+volatile uint8_t _i2cLoopUsers = 0;     /**< Locks held by the loop, may nest */
+
+/** Holds the bus for the loop while in scope */
+class I2CBusLock {
+    public:
+    I2CBusLock() {
+        _i2cLoopUsers++;
+    }
+
+    ~I2CBusLock() {
+        _i2cLoopUsers--;
+    }
+};
+
+/** True if the interrupt may use the bus */
+bool i2cBusFree() {
+    return _i2cLoopUsers == 0;
+}
+
+#endif
@@ -0,0 +1,466 @@
+/** @file Instrument.h
+ *  @brief Serial instrument driver templated on a compile-time line format
+ *
+ *  An instrument is a line oriented serial device (CTD, oxygen optode,
+ *  fluorometer...) that streams one ASCII record per sample. The layout of
+ *  a record is described by an InstrumentFormat descriptor (see
+ *  InstrumentFormats.h) so a new sensor only needs a new descriptor:
+ *
+ *      typedef InstrumentFormat<',', FIELD_TEMPERATURE, FIELD_OXYGEN> MyOptode;
+ *      Instrument<MyOptode> _optode;
+ *
+ *  Each Instrument owns its line buffer and is bound to one port. Several
+ *  instruments of different types are polled with pollInstruments() without
+ *  any virtual dispatch.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _INSTRUMENT
+
+#define _INSTRUMENT
+
+#include <Arduino.h>
+#include "Config.h"
+#include "TxQueue.h"
+
+#define MAX_BUFFER_LENGTH 256
+
+/** Fields that can appear in an instrument record */
+typedef enum {
+    FIELD_SKIP = 0,             /**< Ignore this field */
+    FIELD_PRESSURE_DBAR,        /**< Pressure in dBar */
+    FIELD_PRESSURE_KPA,         /**< Pressure in kPa, stored as dBar */
+    FIELD_DEPTH_M,              /**< Depth in m, stored as dBar (1 m ~ 1 dBar) */
+    FIELD_TEMPERATURE,          /**< Temperature in C */
+    FIELD_CONDUCTIVITY,         /**< Conductivity in mS/cm */
+    FIELD_OXYGEN,               /**< Dissolved oxygen, instrument units */
+    FIELD_FLUORESCENCE,         /**< Fluorescence, instrument units */
+    FIELD_DATETIME_ISO,         /**< YYYY-MM-DD hh:mm:ss[.sss] */
+    FIELD_DATE_DMY,             /**< DD Mon YYYY, eg. 26 Jul 2015 */
+    FIELD_TIME                  /**< hh:mm:ss[.sss] */
+} InstrumentField;
+
+/** Bit flags marking which fields were present in the last sample */
+#define HAS_PRESSURE        (1 << 0)
+#define HAS_TEMPERATURE     (1 << 1)
+#define HAS_CONDUCTIVITY    (1 << 2)
+#define HAS_OXYGEN          (1 << 3)
+#define HAS_FLUORESCENCE    (1 << 4)
+#define HAS_DATE            (1 << 5)
+#define HAS_TIME            (1 << 6)
+
+/** One parsed instrument record */
+struct InstrumentSample {
+    float dBar;
+    float temp;
+    float cond;
+    float oxygen;
+    float fluor;
+    int year, month, day, hour, minute;
+    float second;
+    uint8_t fields;             /**< HAS_* flags of the fields present */
+    unsigned long micros;       /**< Local micros() when the record arrived */
+};
+
+/**
+ * @brief Convert a three letter month abbreviation to 1-12, 0 if unknown
+ */
+int toDecimalMonth(const char * mon) {
+
+    int decMon = 0;
+
+    if (mon != NULL && strlen(mon) == 3) {
+
+        // Unique by first character
+        if (tolower(mon[0]) == 'f')
+            decMon = 2; // February
+        else if (tolower(mon[0]) == 's')
+            decMon = 9; // September
+        else if (tolower(mon[0]) == 'o')
+            decMon = 10; // October
+        else if (tolower(mon[0]) == 'n')
+            decMon = 11; // November
+        else if (tolower(mon[0]) == 'd')
+            decMon = 12; // December
+
+        // Unique with two chars
+        else if (tolower(mon[0]) == 'j') {
+            if (tolower(mon[1]) == 'a')
+                decMon = 1; // January
+            else if (tolower(mon[2]) == 'n')
+                decMon = 6; // June
+            else
+                decMon = 7; // July
+        }
+        else if (tolower(mon[0]) == 'm') {
+            if (tolower(mon[2]) == 'r')
+                decMon = 3; // March
+            else
+                decMon = 5; // May
+        }
+        else if (tolower(mon[0]) == 'a') {
+            if (tolower(mon[1]) == 'p')
+                decMon = 4; // April
+            else
+                decMon = 8; // Aug
+        }
+    }
+
+    return decMon;
+
+}
+
+/**
+ * @brief Parse a single field starting at data
+ *
+ * The field type is a template argument at every call site so the switch
+ * folds away to the one case that is used.
+ *
+ * @param field The type of field to parse
+ * @param sep   The record field separator
+ * @param data  Start of the field text
+ * @param s     The sample to store the value in
+ *
+ * @return Pointer to the first char after the field, NULL on error
+ */
+const char * parseInstrumentField(InstrumentField field, char sep, const char * data, InstrumentSample * s) {
+
+    char * end = NULL;
+    int n = 0;
+
+    // Skip leading white space
+    while (*data == ' ' || *data == '\t')
+        data++;
+
+    switch (field) {
+        case FIELD_SKIP:
+            end = (char*)data;
+            while (*end != '\0' && *end != sep)
+                end++;
+            return end;
+        case FIELD_PRESSURE_DBAR:
+            s->dBar = strtod(data, &end);
+            s->fields |= HAS_PRESSURE;
+            break;
+        case FIELD_PRESSURE_KPA:
+            s->dBar = strtod(data, &end) / 10.0;
+            s->fields |= HAS_PRESSURE;
+            break;
+        case FIELD_DEPTH_M:
+            s->dBar = strtod(data, &end);
+            s->fields |= HAS_PRESSURE;
+            break;
+        case FIELD_TEMPERATURE:
+            s->temp = strtod(data, &end);
+            s->fields |= HAS_TEMPERATURE;
+            break;
+        case FIELD_CONDUCTIVITY:
+            s->cond = strtod(data, &end);
+            s->fields |= HAS_CONDUCTIVITY;
+            break;
+        case FIELD_OXYGEN:
+            s->oxygen = strtod(data, &end);
+            s->fields |= HAS_OXYGEN;
+            break;
+        case FIELD_FLUORESCENCE:
+            s->fluor = strtod(data, &end);
+            s->fields |= HAS_FLUORESCENCE;
+            break;
+        case FIELD_DATETIME_ISO:
+            if (sscanf(data, "%d-%d-%d %d:%d:%f%n", &s->year, &s->month, &s->day,
+                    &s->hour, &s->minute, &s->second, &n) != 6)
+                return NULL;
+            s->fields |= HAS_DATE | HAS_TIME;
+            return data + n;
+        case FIELD_DATE_DMY:
+            {
+                char mon[4];
+                if (sscanf(data, "%d %3s %d%n", &s->day, mon, &s->year, &n) != 3)
+                    return NULL;
+                s->month = toDecimalMonth(mon);
+                s->fields |= HAS_DATE;
+                return data + n;
+            }
+        case FIELD_TIME:
+            if (sscanf(data, "%d:%d:%f%n", &s->hour, &s->minute, &s->second, &n) != 3)
+                return NULL;
+            s->fields |= HAS_TIME;
+            return data + n;
+    }
+
+    // strtod leaves end == data when nothing was converted
+    if (end == data)
+        return NULL;
+
+    return end;
+}
+
+/**
+ * @brief Recursive field parser, one template level per field in the record
+ */
+template <char Sep, InstrumentField... Fields>
+struct InstrumentParser;
+
+template <char Sep>
+struct InstrumentParser<Sep> {
+    static bool parse(const char * data, InstrumentSample * s) {
+        // Fields past the descriptor are ignored, eg. extra instrument channels
+        while (*data == ' ' || *data == '\t')
+            data++;
+        return *data == '\0' || *data == Sep;
+    }
+};
+
+template <char Sep, InstrumentField Field, InstrumentField... Rest>
+struct InstrumentParser<Sep, Field, Rest...> {
+    static bool parse(const char * data, InstrumentSample * s) {
+        const char * end = parseInstrumentField(Field, Sep, data, s);
+        if (end == NULL)
+            return false;
+        while (*end == ' ' || *end == '\t')
+            end++;
+        if (sizeof...(Rest) > 0) {
+            if (*end != Sep)
+                return false;
+            end++;
+        }
+        return InstrumentParser<Sep, Rest...>::parse(end, s);
+    }
+};
+
+/**
+ * @brief Compile-time description of an instrument record
+ *
+ * @tparam Sep      The field separator
+ * @tparam Fields   The fields in the order they appear in the record
+ */
+template <char Sep, InstrumentField... Fields>
+struct InstrumentFormat {
+    static const char separator = Sep;
+    static const uint8_t nFields = sizeof...(Fields);
+
+    static bool parse(const char * data, InstrumentSample * s) {
+        s->fields = 0;
+        return InstrumentParser<Sep, Fields...>::parse(data, s);
+    }
+};
+
+/** Placeholder for instruments that have a single record layout */
+struct NoFormat {
+    static bool parse(const char * data, InstrumentSample * s) {
+        return false;
+    }
+};
+
+/** Called with every complete line received from an instrument */
+typedef void (*InstrumentLineCallback)(const char * line);
+
+/**
+ * @brief Line buffered serial instrument
+ *
+ * @tparam Format       The primary record layout
+ * @tparam AltFormat    An alternate layout tried when the primary does not
+ *                      match, eg. an instrument with an optional channel
+ */
+template <class Format, class AltFormat = NoFormat>
+class Instrument {
+
+    private:
+    InstrumentSample sample;
+    Stream * port;
+    bool newData;
+    bool echoData;
+    char buffer[MAX_BUFFER_LENGTH];
+    int bufferIndex;
+    volatile bool reading;
+    InstrumentLineCallback lineCallback;
+
+    public:
+
+    Instrument(Stream * port = NULL) {
+        this->port = port;
+        memset(&sample, 0, sizeof(sample));
+        newData = false;
+        echoData = true;
+        bufferIndex = 0;
+        reading = false;
+        lineCallback = NULL;
+    }
+
+    bool parseData(const char * data, unsigned long arrival = micros()) {
+        InstrumentSample s;
+        memset(&s, 0, sizeof(s));
+        s.micros = arrival;
+        if (Format::parse(data, &s) || AltFormat::parse(data, &s)) {
+            // Keep the last value of any channel missing from this record
+            if (s.fields & HAS_PRESSURE)
+                sample.dBar = s.dBar;
+            if (s.fields & HAS_TEMPERATURE)
+                sample.temp = s.temp;
+            if (s.fields & HAS_CONDUCTIVITY)
+                sample.cond = s.cond;
+            if (s.fields & HAS_OXYGEN)
+                sample.oxygen = s.oxygen;
+            if (s.fields & HAS_FLUORESCENCE)
+                sample.fluor = s.fluor;
+            if (s.fields & HAS_DATE) {
+                sample.year = s.year;
+                sample.month = s.month;
+                sample.day = s.day;
+            }
+            if (s.fields & HAS_TIME) {
+                sample.hour = s.hour;
+                sample.minute = s.minute;
+                sample.second = s.second;
+            }
+            sample.fields = s.fields;
+            sample.micros = s.micros;
+            newData = true;
+        }
+        return newData;
+    }
+
+    void readData(Stream * port) {
+
+        if (port != NULL && port->available()) {
+            reading = true;
+            int bytesAvail = port->available();
+            unsigned long arrival = micros();
+            char c;
+            for (int i = 0; i < bytesAvail; i++) {
+                c = port->read();
+                if (c == '\n' || c == '\r') {
+                    if (bufferIndex > 0) {
+                        buffer[bufferIndex++] = '\0';
+                        parseData(buffer, arrival);
+                        bufferIndex = 0;
+                        if (echoData) {
+                            _txUI1.writeLine(buffer);
+                            _txUI2.writeLine(buffer);
+                        }
+                        if (lineCallback != NULL)
+                            lineCallback(buffer);
+                    }
+                }
+                else if (bufferIndex < MAX_BUFFER_LENGTH - 1) { // -1 to give space for null term char
+                    buffer[bufferIndex++] = c;
+                }
+                else {
+                    // Overlong line, drop it and resync on the next terminator
+                    bufferIndex = 0;
+                }
+            }
+            reading = false;
+        }
+    }
+
+    /** Read any pending data from the bound port */
+    void update() {
+        readData(port);
+    }
+
+    void setPort(Stream * port) {
+        this->port = port;
+        bufferIndex = 0;
+    }
+
+    Stream * getPort() {
+        return port;
+    }
+
+    void setEchoData(bool echo) {
+        echoData = echo;
+    }
+
+    void setLineCallback(InstrumentLineCallback callback) {
+        lineCallback = callback;
+    }
+
+    const InstrumentSample & lastSample() {
+        return sample;
+    }
+
+    float temperature() {
+        return sample.temp;
+    }
+
+    float pressure() {
+        return sample.dBar;
+    }
+
+    float conductivity() {
+        return sample.cond;
+    }
+
+    void getTimeString(char * buffer) {
+        sprintf(buffer,"%04d-%02d-%02dT%02d:%02d:%02d",
+            sample.year,
+            sample.month,
+            sample.day,
+            sample.hour,
+            sample.minute,
+            (int)sample.second
+        );
+    }
+
+    bool haveNewData() {
+        return newData;
+    }
+
+    bool isReading() {
+        return reading;
+    }
+
+    void invalidateData() {
+        newData = false;
+    }
+
+    void enableEcho() {
+        echoData = true;
+    }
+
+    void disableEcho() {
+        echoData = false;
+    }
+};
+
+/**
+ * @brief Poll every instrument in the list from its bound port
+ *
+ * Expands at compile time to one update() call per instrument.
+ */
+inline void pollInstruments() {
+}
+
+template <class I, class... Rest>
+inline void pollInstruments(I & instrument, Rest & ... rest) {
+    instrument.update();
+    pollInstruments(rest...);
+}
+
+/**
+ * @brief Set echo on every instrument in the list
+ */
+inline void echoInstruments(bool echo) {
+}
+
+template <class I, class... Rest>
+inline void echoInstruments(bool echo, I & instrument, Rest & ... rest) {
+    instrument.setEchoData(echo);
+    echoInstruments(echo, rest...);
+}
+
+/**
+ * @brief Set the line callback of every instrument in the list
+ */
+inline void setInstrumentsLineCallback(InstrumentLineCallback callback) {
+}
+
+template <class I, class... Rest>
+inline void setInstrumentsLineCallback(InstrumentLineCallback callback, I & instrument, Rest & ... rest) {
+    instrument.setLineCallback(callback);
+    setInstrumentsLineCallback(callback, rest...);
+}
+
+#endif
@@ -0,0 +1,34 @@
+/** @file InstrumentFormats.h
+ *  @brief Record layouts of the supported serial instruments
+ *
+ *  To add a new instrument, describe its record here and instantiate an
+ *  Instrument with it in SystemControl.h. Fields after the last one
+ *  described are ignored, so an instrument set up with extra channels
+ *  still parses. Layouts are tried in order and the first that parses
+ *  wins.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _INSTRUMENTFORMATS
+
+#define _INSTRUMENTFORMATS
+
+#include "Instrument.h"
+
+// RBR CTD
+// Data Example: 2020-12-10 08:50:43.000, 45.1234, 12.3456, 10.1234
+typedef InstrumentFormat<',', FIELD_DATETIME_ISO, FIELD_CONDUCTIVITY, FIELD_TEMPERATURE, FIELD_PRESSURE_DBAR> RBRFormat;
+
+// RBR TD (no conductivity channel)
+// Data Example: 2020-12-10 08:50:43.000, 12.3456, 10.1234
+typedef InstrumentFormat<',', FIELD_DATETIME_ISO, FIELD_TEMPERATURE, FIELD_PRESSURE_DBAR> RBRTDFormat;
+
+// SBE39
+// Data Example: 19.5058, 0.062, 26 Jul 2015, 08:50:43
+typedef InstrumentFormat<',', FIELD_TEMPERATURE, FIELD_PRESSURE_DBAR, FIELD_DATE_DMY, FIELD_TIME> SBE39Format;
+
+typedef Instrument<RBRFormat, RBRTDFormat> RBRInstrument;
+typedef Instrument<SBE39Format> SBE39;
+
+#endif
@@ -0,0 +1,269 @@
+/** @file InstrumentTimebase.h
+ *  @brief Relate instrument timestamps to the local clock
+ *
+ *  Each parsed instrument record carries the instrument's own timestamp and
+ *  the local micros() when it arrived. A short history of these pairs is
+ *  used to fit the instrument clock against the local clock (offset and
+ *  drift) so that depth and temperature can be linearly interpolated at any
+ *  local time, eg. the time of a camera trigger.
+ *
+ *  Interpolating on the instrument timestamps rather than the arrival times
+ *  removes the jitter of the serial link and of the main loop polling.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _INSTRUMENTTIMEBASE
+
+#define _INSTRUMENTTIMEBASE
+
+#include <Arduino.h>
+#include "Instrument.h"
+
+#define TIMEBASE_HISTORY 16     /**< Number of samples kept for the fit and interpolation */
+#define TIMEBASE_MAX_GAP 60     /**< Seconds between samples before the history is reset */
+#define TIMEBASE_DRIFT_WINDOW 600 /**< Seconds between drift estimates, must be well below the micros() wrap */
+
+#define TIMEBASE_OK 1           /**< Interpolated value is valid */
+#define TIMEBASE_PENDING 0      /**< Requested time is newer than the last sample */
+#define TIMEBASE_MISSED -1      /**< Requested time is outside of the history */
+
+/**
+ * @brief Seconds since 1970-01-01 for a civil date and time
+ */
+uint32_t civilToEpoch(int year, int month, int day, int hour, int minute, int second) {
+    // Days from civil, http://howardhinnant.github.io/date_algorithms.html
+    year -= month <= 2;
+    long era = (year >= 0 ? year : year - 399) / 400;
+    unsigned long yoe = (unsigned long)(year - era * 400);
+    unsigned long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = era * 146097 + (long)doe - 719468;
+    return (uint32_t)(days * 86400L + hour * 3600L + minute * 60L + second);
+}
+
+class InstrumentTimebase {
+
+    private:
+
+    /** A single instrument record reduced to what the timebase needs */
+    struct TimebasePoint {
+        unsigned long local;    /**< Local micros() when the record arrived */
+        uint32_t instSec;       /**< Instrument time, whole seconds since epoch */
+        float instFrac;         /**< Instrument time, fraction of second */
+        float dBar;             /**< Pressure */
+        float temp;             /**< Temperature */
+    };
+
+    TimebasePoint history[TIMEBASE_HISTORY];
+    int head;                   /**< Index of the newest point */
+    int count;                  /**< Number of valid points */
+    float slope;                /**< Instrument seconds per local second */
+    float intercept;            /**< Instrument clock at the newest arrival, relative to the newest point */
+    float meanLatency;          /**< Mean time from instrument timestamp to arrival in s */
+    float offset;               /**< Mean instrument minus local RTC time in s */
+    float drift;                /**< Instrument clock rate error relative to local */
+    bool haveDrift;             /**< True after the first drift estimate */
+    bool haveRef;               /**< True when the drift reference below is set */
+    unsigned long refLocal;     /**< Local micros() of the drift reference */
+    uint32_t refInstSec;        /**< Instrument time of the drift reference, whole seconds */
+    float refInstFrac;          /**< Instrument time of the drift reference, fraction */
+    float refEnvelope;          /**< Clock envelope at the drift reference */
+
+    const TimebasePoint & point(int age) {
+        // age 0 is the newest point
+        return history[(head - age + TIMEBASE_HISTORY) % TIMEBASE_HISTORY];
+    }
+
+    /** Instrument time of a point relative to the newest point, in s */
+    float instRel(const TimebasePoint & p) {
+        const TimebasePoint & n = point(0);
+        return (float)(int32_t)(p.instSec - n.instSec) + (p.instFrac - n.instFrac);
+    }
+
+    /** Local time relative to the newest arrival, in s */
+    float localRel(unsigned long t) {
+        return (long)(t - point(0).local) * 1e-6f;
+    }
+
+    /**
+     * Least latency instrument minus local time over the history, relative
+     * to the drift reference. Records can only arrive after they were
+     * stamped, so the record with the least latency bounds the instrument
+     * clock from below and is the least noisy estimate of the offset.
+     */
+    float envelope() {
+        float env = 0.0;
+        for (int i = 0; i < count; i++) {
+            const TimebasePoint & p = point(i);
+            float d = (float)(int32_t)(p.instSec - refInstSec) + (p.instFrac - refInstFrac)
+                - (long)(p.local - refLocal) * 1e-6f;
+            if (i == 0 || d > env)
+                env = d;
+        }
+        return env;
+    }
+
+    void setReference() {
+        const TimebasePoint & n = point(0);
+        refLocal = n.local;
+        refInstSec = n.instSec;
+        refInstFrac = n.instFrac;
+        refEnvelope = envelope();
+        haveRef = true;
+    }
+
+    void updateDrift() {
+        // Wait for a full history so the reference envelope is meaningful
+        if (!haveRef) {
+            if (count == TIMEBASE_HISTORY)
+                setReference();
+            return;
+        }
+
+        // Compare the clock envelope over a long baseline, short term
+        // fits are dominated by the arrival jitter
+        long elapsed = (long)(point(0).local - refLocal);
+        if (elapsed < TIMEBASE_DRIFT_WINDOW * 1000000L)
+            return;
+
+        float d = (envelope() - refEnvelope) / (elapsed * 1e-6f);
+        drift = haveDrift ? drift + (d - drift) / 4 : d;
+        haveDrift = true;
+        setReference();
+    }
+
+    void fit() {
+        slope = 1.0 + drift;
+
+        intercept = 0.0;
+        float sum = 0.0;
+        for (int i = 0; i < count; i++) {
+            float a = instRel(point(i)) - slope * localRel(point(i).local);
+            if (i == 0 || a > intercept)
+                intercept = a;
+            sum += a;
+        }
+
+        meanLatency = intercept - sum / count;
+    }
+
+    public:
+
+    InstrumentTimebase() {
+        reset();
+    }
+
+    void reset() {
+        head = TIMEBASE_HISTORY - 1;
+        count = 0;
+        slope = 1.0;
+        intercept = 0.0;
+        meanLatency = 0.0;
+        offset = 0.0;
+        drift = 0.0;
+        haveDrift = false;
+        haveRef = false;
+    }
+
+    /**
+     * @brief Add a newly parsed instrument record
+     *
+     * @param s         The record, must have date and time fields
+     * @param rtcEpoch  The local RTC time in s when the record arrived
+     */
+    void addSample(const InstrumentSample & s, uint32_t rtcEpoch) {
+
+        if ((s.fields & (HAS_DATE | HAS_TIME)) != (HAS_DATE | HAS_TIME))
+            return;
+
+        int whole = (int)s.second;
+        uint32_t instSec = civilToEpoch(s.year, s.month, s.day, s.hour, s.minute, whole);
+
+        // Restart on a clock step or a long gap in the data
+        if (count > 0) {
+            int32_t step = (int32_t)(instSec - point(0).instSec);
+            if (step < 0 || step > TIMEBASE_MAX_GAP)
+                reset();
+        }
+
+        head = (head + 1) % TIMEBASE_HISTORY;
+        TimebasePoint & p = history[head];
+        p.local = s.micros;
+        p.instSec = instSec;
+        p.instFrac = s.second - whole;
+        p.dBar = s.dBar;
+        p.temp = s.temp;
+        if (count < TIMEBASE_HISTORY)
+            count++;
+
+        float newOffset = (float)(int32_t)(instSec - rtcEpoch) + p.instFrac;
+        if (count == 1)
+            offset = newOffset;
+        else
+            offset += (newOffset - offset) / count;
+
+        updateDrift();
+        fit();
+    }
+
+    /**
+     * @brief Interpolate pressure and temperature at a local time
+     *
+     * @param t     Local micros() of the event, eg. a camera trigger
+     * @param dBar  Interpolated pressure
+     * @param temp  Interpolated temperature
+     *
+     * @return TIMEBASE_OK, TIMEBASE_PENDING when t is newer than the last
+     *         record, or TIMEBASE_MISSED when t is older than the history
+     */
+    int interpolate(unsigned long t, float * dBar, float * temp) {
+
+        if (count == 0)
+            return TIMEBASE_MISSED;
+
+        // Instrument time of the event relative to the newest point
+        float y = intercept + slope * localRel(t);
+
+        if (y > 0.0)
+            return TIMEBASE_PENDING;
+
+        // Walk back from the newest point to find the bracketing pair
+        for (int i = 1; i < count; i++) {
+            const TimebasePoint & a = point(i);
+            const TimebasePoint & b = point(i - 1);
+            float ya = instRel(a);
+            float yb = instRel(b);
+            if (ya <= y) {
+                float w = (yb - ya > 1e-6f) ? (y - ya) / (yb - ya) : 0.5f;
+                *dBar = a.dBar + w * (b.dBar - a.dBar);
+                *temp = a.temp + w * (b.temp - a.temp);
+                return TIMEBASE_OK;
+            }
+        }
+
+        return TIMEBASE_MISSED;
+    }
+
+    /** Number of records in the history */
+    int samples() {
+        return count;
+    }
+
+    /** Instrument minus local RTC time in s */
+    float clockOffset() {
+        return offset;
+    }
+
+    /** Instrument clock drift relative to the local clock in ppm */
+    float clockDrift() {
+        return drift * 1e6;
+    }
+
+    /** Mean latency of the serial link and polling above the minimum in s */
+    float latency() {
+        return meanLatency;
+    }
+};
+
+#endif
@@ -0,0 +1,281 @@
+/** @file LineEditor.h
+ *  @brief Non-blocking command line editor, one per UI port
+ *
+ *  Each call to poll() consumes the bytes that are already waiting on the
+ *  port and returns as soon as a complete line or answer is ready, so the
+ *  main loop keeps running while an operator types. The editor keeps the
+ *  mode, the line, and the time of the last keystroke of its port.
+ *
+ *  Modes:
+ *      LINE_IDLE       waiting for CMD_CHAR or SET_CHAR
+ *      LINE_COMMAND    interactive prompt opened by CMD_CHAR, a second
+ *                      CMD_CHAR closes it
+ *      LINE_SET        a single command after SET_CHAR, no prompt
+ *      LINE_CONFIRM    a y/N question, any key answers
+ *      LINE_LOAD       sequence lines until END
+ *
+ *  Any mode returns to idle after CMDTIMEOUT without input, a question is
+ *  then answered no and a sequence load ends.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _LINEEDITOR
+
+#define _LINEEDITOR
+
+#include <Arduino.h>
+#include "TxQueue.h"
+
+#define CMD_CHAR '!'
+#define SET_CHAR '#'
+#define PROMPT "PCTL > "
+#define LOAD_PROMPT "\rLOAD > "
+#define CMD_BUFFER_SIZE 128
+
+typedef enum {
+    LINE_IDLE,
+    LINE_COMMAND,
+    LINE_SET,
+    LINE_CONFIRM,
+    LINE_LOAD
+} LineMode;
+
+/** Results of LineEditor::poll() */
+typedef enum {
+    EDIT_NONE,          /**< Nothing complete yet */
+    EDIT_LINE,          /**< line() holds a complete line of the current mode */
+    EDIT_ANSWER         /**< A question was answered, see confirmed() */
+} EditEvent;
+
+class LineEditor {
+
+    private:
+    Stream * port;
+    const char * name;
+    int8_t echo;                /**< -1 follows LOCALECHO, else this session's setting */
+    char buffer[CMD_BUFFER_SIZE];
+    int index;
+    LineMode mode;
+    LineMode questionMode;      /**< Mode to return to after a question */
+    unsigned long lastInput;
+    int pending;                /**< Caller value kept over a question or load */
+    bool answer;
+
+    void write(const char * s) {
+        port->write(s);
+    }
+
+    /** Telemetry to the port is held while a session is open */
+    void setMode(LineMode mode) {
+        this->mode = mode;
+        TxQueue * tx = getTxQueue(port);
+        if (tx != NULL)
+            tx->hold(mode != LINE_IDLE);
+    }
+
+    public:
+
+    /**
+     * @param port  Port of the session
+     * @param name  Session name for locks and busy replies
+     */
+    LineEditor(Stream * port, const char * name) {
+        this->port = port;
+        this->name = name;
+        echo = -1;
+        index = 0;
+        mode = LINE_IDLE;
+        questionMode = LINE_IDLE;
+        lastInput = 0;
+        pending = 0;
+        answer = false;
+    }
+
+    Stream * getPort() {
+        return port;
+    }
+
+    const char * getName() {
+        return name;
+    }
+
+    LineMode getMode() {
+        return mode;
+    }
+
+    /** Set this session's echo, -1 to follow LOCALECHO */
+    void setEcho(int echo) {
+        this->echo = echo;
+    }
+
+    int getEcho() {
+        return echo;
+    }
+
+    /** The session is in the middle of an action, a question or a load */
+    bool busy() {
+        return mode == LINE_CONFIRM || mode == LINE_LOAD;
+    }
+
+    bool active() {
+        return mode != LINE_IDLE;
+    }
+
+    /** The completed line, valid after EDIT_LINE until the next poll() */
+    char * line() {
+        return buffer;
+    }
+
+    bool confirmed() {
+        return answer;
+    }
+
+    int getPending() {
+        return pending;
+    }
+
+    /**
+     * @brief Consume waiting input
+     *
+     * @param localEcho Echo typed characters (LOCALECHO) unless the session
+     *                  has its own setting, loads always echo
+     * @param timeout   ms without input before the session closes
+     */
+    EditEvent poll(bool localEcho, unsigned long timeout) {
+
+        bool echo = this->echo < 0 ? localEcho : this->echo == 1;
+
+        if (mode != LINE_IDLE && millis() - lastInput >= timeout) {
+            LineMode timedOut = mode;
+            index = 0;
+            if (timedOut == LINE_LOAD)
+                write("\r\n");
+            setMode(LINE_IDLE);
+            if (timedOut == LINE_CONFIRM) {
+                answer = false;
+                return EDIT_ANSWER;
+            }
+        }
+
+        while (port->available() > 0) {
+            char c = port->read();
+            lastInput = millis();
+
+            switch (mode) {
+                case LINE_IDLE:
+                    if (c == CMD_CHAR) {
+                        open(LINE_COMMAND);
+                    }
+                    else if (c == SET_CHAR) {
+                        open(LINE_SET);
+                    }
+                    continue;
+
+                case LINE_CONFIRM:
+                    answer = c == 'Y' || c == 'y';
+                    setMode(questionMode);
+                    return EDIT_ANSWER;
+
+                default:
+                    break;
+            }
+
+            if (c == CMD_CHAR && mode != LINE_LOAD) {
+                // Closes a prompt, turns a set command into a prompt
+                index = 0;
+                if (mode == LINE_COMMAND)
+                    setMode(LINE_IDLE);
+                else
+                    open(LINE_COMMAND);
+                continue;
+            }
+
+            if (c == '\r' || (c == '\n' && mode == LINE_LOAD)) {
+                buffer[index] = '\0';
+                index = 0;
+                return EDIT_LINE;
+            }
+
+            if (c == '\n' && index == 0)
+                continue;   // second half of a CR LF
+
+            if (c == '\b' || c == 127) {
+                if (index > 0) {
+                    index--;
+                    if (echo || mode == LINE_LOAD)
+                        write("\b \b");
+                }
+                continue;
+            }
+
+            if (index >= CMD_BUFFER_SIZE - 1)
+                continue;   // line full, wait for the end of it
+
+            buffer[index++] = mode == LINE_LOAD ? tolower(c) : c;
+            if (echo || mode == LINE_LOAD)
+                port->write(c);
+        }
+        return EDIT_NONE;
+    }
+
+    /** Open a session in a mode and print its prompt */
+    void open(LineMode mode) {
+        index = 0;
+        lastInput = millis();
+        TxQueue * tx = getTxQueue(port);
+        if (tx != NULL)
+            tx->finishLine();
+        setMode(mode);
+        if (mode == LINE_COMMAND)
+            write(PROMPT);
+        else if (mode == LINE_LOAD)
+            write(LOAD_PROMPT);
+    }
+
+    /** Prompt again after a command's reply */
+    void prompt() {
+        if (mode == LINE_COMMAND) {
+            write("\r\n");
+            write(PROMPT);
+        }
+        else if (mode == LINE_LOAD) {
+            write("\r\n");
+            write(LOAD_PROMPT);
+        }
+    }
+
+    /** Close the session, eg. after a set command */
+    void close() {
+        index = 0;
+        setMode(LINE_IDLE);
+    }
+
+    /**
+     * @brief Ask a y/N question, answered through EDIT_ANSWER
+     *
+     * @param question  Printed on a new line
+     * @param pending   Kept for the caller, eg. the action to confirm
+     */
+    void ask(const char * question, int pending) {
+        this->pending = pending;
+        questionMode = mode;
+        lastInput = millis();
+        write("\r\n");
+        write(question);
+        setMode(LINE_CONFIRM);
+    }
+
+    /**
+     * @brief Read sequence lines until END
+     *
+     * @param pending Kept for the caller, eg. the sequence number
+     */
+    void load(int pending) {
+        this->pending = pending;
+        write("\n");
+        open(LINE_LOAD);
+    }
+};
+
+#endif
@@ -0,0 +1,110 @@
+/** @file LoopIdle.h
+ *  @brief Sleep the core between main loop passes
+ *
+ *  Every deadline of the loop is either a millis() time (log interval,
+ *  sensor conversions, lens timeouts, flash and SD polling) or an
+ *  interrupt (UART and USB receive, the trigger timer, the INA260 ALERT
+ *  pin). So once a pass is done the core can stop in IDLE sleep with WFI:
+ *  the next SysTick, at most 1 ms later, or any interrupt wakes it.
+ *  Input is handled in the pass after the receive interrupt, as before,
+ *  so the latency stays under a tick.
+ *
+ *  STANDBY is not used here: it stops the 48 MHz clock that millis(), the
+ *  UARTs at baud and USB run from, it stays with the low voltage sleep.
+ *
+ *  The awake and asleep time of the loop and the INA260 current per power
+ *  state are kept separately for LOOPIDLE on and off, so the saving can
+ *  be read off LOOPSTATS after running a while in each mode.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _LOOPIDLE
+
+#define _LOOPIDLE
+
+#include <Arduino.h>
+#include "Stats.h"
+#include "Counters.h"
+
+class LoopIdle {
+
+    private:
+    uint32_t loops;
+    uint64_t awakeMicros;
+    uint64_t sleepMicros;
+    unsigned long lastWake;
+    unsigned long since;
+    Welford<float> current[2][N_STATES];   /**< mA by LOOPIDLE and power state */
+
+    public:
+
+    LoopIdle() {
+        clear();
+    }
+
+    /**
+     * @brief End a loop pass, sleeping until the next interrupt if allowed
+     *
+     * @param sleep IDLE sleep, false to spin on as before
+     */
+    void idle(bool sleep) {
+        unsigned long now = micros();
+        awakeMicros += now - lastWake;
+        loops++;
+        if (sleep) {
+            // CPU clock only, SysTick, SERCOM, USB and timers keep running
+            SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+            PM->SLEEP.reg = PM_SLEEP_IDLE_CPU;
+            __DSB();
+            __WFI();
+            unsigned long woke = micros();
+            sleepMicros += woke - now;
+            now = woke;
+        }
+        lastWake = now;
+    }
+
+    /** Fold in a new INA260 current reading */
+    void addCurrent(bool sleeping, int state, float mA) {
+        current[sleeping ? 1 : 0][state].update(mA);
+    }
+
+    void clear() {
+        loops = 0;
+        awakeMicros = 0;
+        sleepMicros = 0;
+        lastWake = micros();
+        since = millis();
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < N_STATES; j++)
+                current[i][j].clear();
+        }
+    }
+
+    void print(Stream * ui) {
+        const char * stateNames[N_STATES] = {"idle", "camera on", "imaging"};
+        char output[128];
+        float seconds = (millis() - since) / 1000.0;
+        float total = awakeMicros + sleepMicros;
+        sprintf(output, "\r\nLoop: %lu passes in %0.1f s, %0.0f per s, awake %0.1f %%, mean pass %0.1f us",
+            (unsigned long)loops, seconds, seconds > 0 ? loops / seconds : 0.0,
+            total > 0 ? 100.0 * awakeMicros / total : 100.0, loops > 0 ? (float)awakeMicros / loops : 0.0);
+        ui->print(output);
+        for (int j = 0; j < N_STATES; j++) {
+            Welford<float> & spin = current[0][j];
+            Welford<float> & wfi = current[1][j];
+            if (spin.count() == 0 && wfi.count() == 0)
+                continue;
+            sprintf(output, "\r\nCurrent %-9s: spin %0.1f mA (%lu), sleep %0.1f mA (%lu)", stateNames[j],
+                spin.mean(), (unsigned long)spin.count(), wfi.mean(), (unsigned long)wfi.count());
+            ui->print(output);
+            if (spin.count() > 0 && wfi.count() > 0) {
+                sprintf(output, ", saving %0.1f mA", spin.mean() - wfi.mean());
+                ui->print(output);
+            }
+        }
+    }
+};
+
+#endif
@@ -1,122 +1,306 @@
+/** @file Optotune.h
+ *  @brief Non-blocking driver for the Optotune electrically tunable lens
+ *
+ *  Commands go into a small queue and update(), called every loop, sends
+ *  them one at a time. A setfp command waits for the lens reply line; with
+ *  no reply within the timeout it is sent again up to the retry count, then
+ *  dropped with the rest of the queue and the move is abandoned where the
+ *  lens last answered. A missing lens costs a few timeouts instead of
+ *  hanging the firmware.
+ *
+ *  move() is either direct, one setfp to the target, or slew limited: one
+ *  step of at most inc diopters per tick, each sent after the reply to the
+ *  previous one. Callers that must not continue until the lens is there,
+ *  eg. a focal stack in a sequence, call wait().
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
 #ifndef _OPTOTUNE
 
 #define _OPTOTUNE
 
 #include <Arduino.h>
-#include <RTCZero.h>
-#include <RTCLib.h>
-#include <WDTZero.h>
+#include <math.h>
 #include "Config.h"
+#include "TaskWatchdog.h"
 
 #define MIN_FP -2.0
 #define MAX_FP 3.0
 
+#define OPTO_QUEUE 8                /**< Commands waiting to be sent */
+#define OPTO_COMMAND_SIZE 32
+#define OPTO_REPLY_SIZE 32
+#define OPTO_START_DELAY 250        /**< ms after power up before the first command, and after start */
+#define OPTO_NO_VALUE -100.0        /**< Queue value of commands that do not set the focal power */
+
 class Optotune
 {
 
 private:
 
+struct OptoCommand {
+    char text[OPTO_COMMAND_SIZE];
+    float value;                    /**< Focal power it sets, OPTO_NO_VALUE for others */
+    uint16_t gap;                   /**< Quiet ms before it is sent */
+};
+
 Stream * port;
-char buffer[64];
-float position;
+OptoCommand queue[OPTO_QUEUE];
+uint8_t head;
+uint8_t count;
 
-public:
+// Command in flight
+bool waiting;
+uint8_t tries;
+unsigned long sentTime;
 
-Optotune() {
+char reply[OPTO_REPLY_SIZE];
+uint8_t replyLength;
+char lastReply[OPTO_REPLY_SIZE];
+
+float position;                     /**< Last focal power the lens acknowledged */
+float commanded;                    /**< Last focal power queued */
+float target;
+float inc;                          /**< Slew step, 0 for a direct move */
+
+unsigned long timeout;
+uint8_t retries;
+unsigned long tick;
 
+// Statistics
+uint32_t sent;
+uint32_t replies;
+uint32_t resent;
+uint32_t failed;
+
+static float roundFp(float fp) {
+    return roundf(fp * 1000) / 1000;
+}
+
+bool push(const char * text, float value, uint16_t gap) {
+    if (count >= OPTO_QUEUE)
+        return false;
+    OptoCommand & c = queue[(head + count) % OPTO_QUEUE];
+    strncpy(c.text, text, OPTO_COMMAND_SIZE - 1);
+    c.text[OPTO_COMMAND_SIZE - 1] = '\0';
+    c.value = value;
+    c.gap = gap;
+    count++;
+    return true;
 }
 
-int sendCommand(char * cmd) {
-    port->flush();
-    port->print(cmd);
+bool pushSet(float fp) {
+    char buffer[OPTO_COMMAND_SIZE];
+    sprintf(buffer, "setfp=%0.3f", fp);
+    if (!push(buffer, fp, 0))
+        return false;
+    commanded = fp;
+    return true;
+}
+
+void pop() {
+    head = (head + 1) % OPTO_QUEUE;
+    count--;
+    waiting = false;
+}
+
+void transmit() {
+    port->print(queue[head].text);
     port->print("\r\n");
-    port->flush();
+    sentTime = millis();
+    tries++;
+    sent++;
+}
+
+void readReplies() {
+    while (port->available() > 0) {
+        char c = port->read();
+        if (c != '\r' && c != '\n') {
+            if (replyLength < OPTO_REPLY_SIZE - 1)
+                reply[replyLength++] = c;
+            continue;
+        }
+        if (replyLength == 0)
+            continue;
+        reply[replyLength] = '\0';
+        replyLength = 0;
+        strcpy(lastReply, reply);
+        replies++;
+        if (waiting) {
+            position = queue[head].value;
+            pop();
+        }
+        else {
+            // Answer to a raw command
+            DEBUGPORT.println(reply);
+        }
+    }
+}
+
+public:
+
+Optotune() {
+    port = NULL;
+    timeout = 200;
+    retries = 2;
+    tick = 20;
+    resetStats();
+    setPort(NULL);
 }
 
+/** Use a port after the lens powered up, NULL when it powered down */
 void setPort(Stream * port) {
     this->port = port;
-    // send the start command to the etl
-    delay(250);
-    sendCommand("start");
-    delay(250);
-    sendCommand("setfp=0.0");
+    head = 0;
+    count = 0;
+    waiting = false;
+    replyLength = 0;
+    lastReply[0] = '\0';
     position = 0.0;
+    commanded = 0.0;
+    target = 0.0;
+    inc = 0.0;
+    sentTime = millis();
+    if (port == NULL)
+        return;
+    // send the start command to the etl
+    push("start", OPTO_NO_VALUE, OPTO_START_DELAY);
+    push("setfp=0.000", 0.0, OPTO_START_DELAY);
+}
+
+Stream * getPort() {
+    return port;
+}
+
+/**
+ * @param timeout   ms to wait for a setfp reply
+ * @param retries   Sends after the first before a command is dropped
+ * @param tick      Least ms between the steps of a slewed move
+ */
+void setTiming(unsigned long timeout, uint8_t retries, unsigned long tick) {
+    this->timeout = timeout;
+    this->retries = retries;
+    this->tick = tick;
+}
 
+/** Queue a raw command, its reply is printed to the debug port */
+bool sendCommand(const char * cmd) {
+    if (port == NULL)
+        return false;
+    return push(cmd, OPTO_NO_VALUE, 0);
 }
 
+/**
+ * @brief Start a move, update() carries it out
+ *
+ * @param newPosition   Focal power, clipped to MIN_FP..MAX_FP
+ * @param inc           Step per tick, 0 to go in one command
+ */
 void move(float newPosition, float inc = 0.05) {
+    if (newPosition < MIN_FP)
+        newPosition = MIN_FP;
+    if (newPosition > MAX_FP)
+        newPosition = MAX_FP;
+    target = roundFp(newPosition);
+    this->inc = inc > 0 ? inc : 0.0;
+}
 
-    char buffer[32];
+void step(float inc) {
+    float newPosition = target + inc;
+    if (newPosition > MIN_FP && newPosition < MAX_FP)
+        move(newPosition, 0.0);
+}
 
-    if (newPosition < position) {
-        while (position > MIN_FP && position > newPosition) { 
-            position -= inc;
-            sprintf(buffer,"setfp=%0.3f",position);
-            sendCommand(buffer);
-            //wait for reply
-            while (!port->available()) {};
-            while (port->available()) {
-                DEBUGPORT.write(port->read());
-            };
-            delay(20);
+/** Service the lens, never blocks */
+void update() {
+    if (port == NULL)
+        return;
+    readReplies();
 
+    if (waiting) {
+        if (millis() - sentTime < timeout)
+            return;
+        if (tries <= retries) {
+            resent++;
+            transmit();
+            return;
         }
+        // No answer, the lens is where it was, stop the move there
+        failed++;
+        pop();
+        count = 0;
+        commanded = position;
+        target = position;
+        return;
     }
 
-    if (newPosition > position) {
-        while (position < MAX_FP && position < newPosition) { 
-            position += inc;
-            sprintf(buffer,"setfp=%0.3f",position);
-            sendCommand(buffer);
-            //wait for reply
-            while (!port->available()) {};
-            while (port->available()) {
-                DEBUGPORT.write(port->read());
-            };
-            delay(20);
-            
-        }
+    if (count == 0 && fabs(target - commanded) >= 0.0005 && millis() - sentTime >= tick) {
+        float next = target;
+        if (inc > 0 && fabs(target - commanded) > inc)
+            next = roundFp(target > commanded ? commanded + inc : commanded - inc);
+        pushSet(next);
+    }
+
+    if (count > 0 && millis() - sentTime >= queue[head].gap) {
+        tries = 0;
+        transmit();
+        if (queue[head].value == OPTO_NO_VALUE)
+            pop();
+        else
+            waiting = true;
     }
-    
 }
 
-void step(float inc) {
+/** Nothing queued, in flight or left of a move */
+bool busy() {
+    return port != NULL && (count > 0 || waiting || fabs(target - commanded) >= 0.0005);
+}
 
-    char buffer[32];
-
-    float newPosition = position + inc;
-    if (newPosition > MIN_FP && newPosition < MAX_FP) {
-        position += inc;
-        sprintf(buffer,"setfp=%0.3f",position);
-        sendCommand(buffer);
-        //wait for reply
-        while (!port->available()) {};
-        while (port->available()) {
-                DEBUGPORT.write(port->read());
-        };
-        delay(20);
-    }
-    
-}
-
-void focalSweep() {
-
-    char buffer[32];
-    sprintf(buffer,"setfp=%0.3f",MAX_FP);
-    sendCommand(buffer);
-    position = 3.0;
-    while (position > -2.0) { 
-        position -= 0.05;
-        sprintf(buffer,"setfp=%0.3f",position);
-        sendCommand(buffer);
-        //wait for reply
-        while (!port->available()) {};
-        delay(50);
-            
+/**
+ * @brief Service the lens until the move is done
+ *
+ * Bounded by the number of steps left times the timeout and retries, a
+ * failed command ends the move. Runs as the lens watchdog task, each reply
+ * or given up command checks in.
+ */
+void wait() {
+    _taskWatchdog.enter(TASK_LENS);
+    uint32_t done = replies + failed;
+    while (busy()) {
+        update();
+        if (replies + failed != done) {
+            done = replies + failed;
+            _taskWatchdog.checkIn();
+        }
+        yield();
     }
+    _taskWatchdog.leave();
+}
+
+float getPosition() {
+    return position;
+}
+
+float getTarget() {
+    return target;
 }
 
+void resetStats() {
+    sent = 0;
+    replies = 0;
+    resent = 0;
+    failed = 0;
+}
+
+void print(Stream * ui) {
+    char output[192];
+    sprintf(output, "\r\nLens %s, fp: %0.3f, target: %0.3f, queued: %u, sent: %lu, replies: %lu, resent: %lu, failed: %lu, last reply: %s",
+        port == NULL ? "off" : "on", position, target, count, (unsigned long)sent, (unsigned long)replies,
+        (unsigned long)resent, (unsigned long)failed, lastReply);
+    ui->print(output);
+}
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,109 +1,407 @@
+/** @file SDLogger.h
+ *  @brief Buffered, sector aligned logging to an SD card
+ *
+ *  Lines are copied into one of two 512 byte buffers. A full buffer is
+ *  written to the card as a single sector from update(), at most one card
+ *  operation per call, so a slow card only ever delays one loop pass and
+ *  never the trigger interrupt. If the card stalls long enough for both
+ *  buffers to fill, new lines are dropped and counted.
+ *
+ *  Files are preallocated so writes land in contiguous clusters, and are
+ *  truncated to their real length when closed. Partial buffers are written
+ *  and the file synced every SD_SYNC_INTERVAL; the next buffer is then cut
+ *  short so later writes are sector aligned again. The day directory is
+ *  only checked when the day changes.
+ *
+ *  In binary mode every file starts with the BinaryLogFormat header and
+ *  text lines are wrapped in BINLOG_TYPE_TEXT records.
+ *
+ *  A file rolls over before the record that would take it past
+ *  SD_PREALLOCATE, so every line or record is whole in one file: the
+ *  buffer holding the end of the old file is sealed and the next one is
+ *  marked to start a new file when it is written.
+ *
+ *  Your SD must be formatted FAT16/FAT32 or exFAT.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
 #ifndef _SDLOGGER
 
 #define _SDLOGGER
 
 #include "RTCZero.h"
 #include "Config.h"
-
-// A simple read/write example for SD.h.
-// Mostly from the SD.h ReadWrite example.
-//
-// Your SD must be formatted FAT16/FAT32.
-//
-// Set USE_SD_H nonzero to use SD.h.
-// Set USE_SD_H zero to use SdFat.h.
-//
-#define USE_SD_H 0
-//
-#if USE_SD_H
-#include <SD.h>
-#else  // USE_SD_H
 #include "SdFat.h"
-SdFat _SD;
-#endif  // USE_SD_H
+#include "BinaryLogFormat.h"
 
-// Modify SD_CS_PIN for your board.
-#define SD_CS_PIN 13
+SdFat _SD;
 
+#define SD_SECTOR_SIZE 512
+#define SD_PREALLOCATE (16UL * 1024 * 1024)  /**< Bytes per file before rolling over */
+#define SD_SYNC_INTERVAL 5000                /**< ms between syncs of a partial buffer */
+#define SD_SPI_MHZ 12
+#define SD_SLOW_WRITE 10000                  /**< us, writes slower than this are counted */
 
 class SDLogger {
 
+    private:
+    bool detected;
+    bool initialized;
+    RTCZero * rtc;
+    FsFile myFile;
+    uint32_t filePos;           /**< Bytes written to the open file */
+    uint32_t fileBytes;         /**< Bytes queued for the current file, without the header */
+    long currentDay;            /**< yyyymmdd of the last directory check */
+
+    uint8_t buffers[2][SD_SECTOR_SIZE] __attribute__((aligned(4)));
+    int active;                 /**< Buffer lines are copied into */
+    int fill;                   /**< Bytes in the active buffer */
+    int pendingBuf;             /**< Buffer waiting to be written, -1 for none */
+    int pendingLen;
+    bool newFile[2];            /**< The buffer starts a new file */
+    bool syncDue;
+    unsigned long lastSync;
+    bool binary;                /**< Write BinaryLogFormat files */
+
+    // Statistics
+    uint32_t bytesWritten;
+    uint32_t sectorWrites;
+    uint32_t slowWrites;
+    uint32_t droppedLines;
+    uint32_t writeErrors;
+    uint32_t filesOpened;
+    unsigned long writeTime;    /**< Total us spent in write() */
+    unsigned long maxWriteLatency;
+    unsigned long maxSyncLatency;
+    unsigned long startTime;
+
+    /** Bytes the active buffer can take before it ends on a sector boundary */
+    int chunk() {
+        uint32_t pos = filePos;
+        if (newFile[active])
+            pos = headerBytes();
+        else if (pendingBuf >= 0)
+            pos = (newFile[pendingBuf] ? headerBytes() : filePos) + pendingLen;
+        return SD_SECTOR_SIZE - pos % SD_SECTOR_SIZE;
+    }
+
+    uint32_t headerBytes() {
+        return binary ? binlogHeaderSize() : 0;
+    }
+
+    /** Queue from the start of a new file */
+    void restart() {
+        fileBytes = 0;
+        newFile[0] = false;
+        newFile[1] = false;
+    }
+
+    void seal() {
+        pendingBuf = active;
+        pendingLen = fill;
+        active ^= 1;
+        fill = 0;
+    }
+
+    void append(const char * data, int len) {
+        while (len > 0) {
+            int n = chunk() - fill;
+            if (n > len)
+                n = len;
+            memcpy(&buffers[active][fill], data, n);
+            fill += n;
+            data += n;
+            len -= n;
+            if (fill >= chunk() && pendingBuf < 0)
+                seal();
+        }
+    }
+
+    void closeFile() {
+        if (myFile) {
+            // Release the unused part of the preallocation
+            myFile.truncate();
+            myFile.close();
+        }
+    }
+
+    bool openFile() {
+        closeFile();
+        filePos = 0;
+
+        long day = rtc->getYear() * 10000L + rtc->getMonth() * 100 + rtc->getDay();
+        char dirPath[16];
+        sprintf(dirPath,"/%04d/%02d/%02d", rtc->getYear(), rtc->getMonth(), rtc->getDay());
+
+        // Create the directory path in the format: /YYYY/MM/DD
+        if (day != currentDay) {
+            if (!_SD.exists(dirPath) && !_SD.mkdir(dirPath, true))
+                return false;
+            currentDay = day;
+        }
+
+        char filePath[32];
+        sprintf(filePath,"%s/%02d%02d%02d.%s", dirPath, rtc->getHours(), rtc->getMinutes(), rtc->getSeconds(),
+            binary ? "bin" : "log");
+        myFile = _SD.open(filePath, O_RDWR | O_CREAT | O_TRUNC);
+        if (!myFile)
+            return false;
+
+        // Not fatal, eg. no contiguous space left, the file just fragments
+        myFile.preAllocate(SD_PREALLOCATE);
+        filesOpened++;
+
+        if (binary) {
+            uint8_t header[binlogHeaderSize()];
+            filePos = myFile.write(header, binlogWriteHeader(header));
+        }
+        return true;
+    }
+
+    /** Write out everything buffered and close the file, blocking */
+    void flush() {
+        while (pendingBuf >= 0 || fill > 0) {
+            if (pendingBuf < 0)
+                seal();
+            writePending();
+        }
+        closeFile();
+        restart();
+    }
+
+    /**
+     * @brief Copy a record into the buffers if all of it fits
+     *
+     * The two parts go to the same file, a new one if the record would
+     * not fit in the preallocation of the current one.
+     */
+    bool queue(const void * data, int len, const void * data2 = NULL, int len2 = 0) {
+        uint32_t total = len + len2;
+        if (fileBytes > 0 && fileBytes + total > SD_PREALLOCATE - headerBytes()) {
+            if (fill > 0) {
+                // Both buffers taken, the end of the old file has to wait
+                if (pendingBuf >= 0) {
+                    droppedLines++;
+                    return false;
+                }
+                seal();
+            }
+            fileBytes = 0;
+            newFile[active] = true;
+        }
+        if ((int)total > capacity()) {
+            droppedLines++;
+            return false;
+        }
+        append((const char *)data, len);
+        if (len2 > 0)
+            append((const char *)data2, len2);
+        fileBytes += total;
+        return true;
+    }
+
+    void writePending() {
+        if (!myFile || newFile[pendingBuf]) {
+            newFile[pendingBuf] = false;
+            if (!openFile()) {
+                writeErrors++;
+                pendingBuf = -1;
+                return;
+            }
+        }
+
+        unsigned long start = micros();
+        size_t n = myFile.write(buffers[pendingBuf], pendingLen);
+        unsigned long elapsed = micros() - start;
+
+        writeTime += elapsed;
+        if (elapsed > maxWriteLatency)
+            maxWriteLatency = elapsed;
+        if (elapsed > SD_SLOW_WRITE)
+            slowWrites++;
+        if (n != (size_t)pendingLen)
+            writeErrors++;
+
+        filePos += n;
+        bytesWritten += n;
+        sectorWrites++;
+        pendingBuf = -1;
+
+        // The active buffer may have filled while this one was pending
+        if (fill >= chunk())
+            seal();
+    }
+
     public:
-    SDLogger(unsigned int maxLinesPerFile=10000) {
 
-        this->maxLinesPerFile=maxLinesPerFile;
-        linesWritten = 0;
+    SDLogger() {
         detected = false;
         initialized = false;
-
+        binary = false;
+        rtc = NULL;
+        active = 0;
+        restart();
+        resetStats();
     }
 
     bool SDCardPresent() {
+        pinMode(SDCARD_DETECT, INPUT_PULLUP);
         detected = digitalRead(SDCARD_DETECT);
         return detected;
     }
 
-    bool SdCardInit() {
-        initialized = !_SD.begin(SD_CS_PIN);
+    /**
+     * @brief Mount the card and start a new file on the next write
+     *
+     * @param rtc Clock used to name directories and files
+     */
+    bool SdCardInit(RTCZero * rtc) {
+        this->rtc = rtc;
+        if (!SDCardPresent()) {
+            initialized = false;
+            return false;
+        }
+        initialized = _SD.begin(SD_CS_PIN, SD_SCK_MHZ(SD_SPI_MHZ));
+        currentDay = -1;
+        filePos = 0;
+        restart();
+        active = 0;
+        fill = 0;
+        pendingBuf = -1;
+        syncDue = false;
+        lastSync = millis();
+        return initialized;
     }
 
-    bool createNewFile(RTCZero * rtc) {
-        if (initialized) {
-            
-            // Create the directory path in the format: /YYYY/MM/DD
-            char dirPath[16];
-            sprintf(dirPath,"/%04d/%02d/%02d", rtc->getYear(), rtc->getMonth(), rtc->getDay());
-            
-            // If it does not exist, create it and chdir to it
-            if (!_SD.exists(dirPath)) {
-                // Create the dir and chdir to it if succesfull
-                if (_SD.mkdir(dirPath, true)) {
-                    _SD.chdir(dirPath);
-                }
-            }
+    /** Write out everything buffered, close the file and stop logging */
+    void end() {
+        if (initialized)
+            flush();
+        initialized = false;
+    }
 
-            // Check again that dir exists before opening file
-            if (_SD.exists(dirPath)) {
-                char fileName[16];
-                sprintf(fileName,"%02d%02d%02d.log", rtc->getHours(), rtc->getMinutes(), rtc->getSeconds());
-                myFile = _SD.open(fileName, FILE_WRITE);
-                linesWritten = 0;
-                return true;
-            }
-        }
+    /** Select text or binary files, a change starts a new file */
+    void setBinary(bool binary) {
+        if (binary == this->binary)
+            return;
+        if (initialized)
+            flush();
+        this->binary = binary;
+    }
 
-        return false;
+    bool isBinary() {
+        return binary;
     }
 
-    bool writeString(RTCZero * rtc, const char * data) {
-        if (initialized) {
+    /** Bytes that can be queued right now */
+    int capacity() {
+        if (!initialized)
+            return 0;
+        return chunk() - fill + (pendingBuf < 0 ? SD_SECTOR_SIZE : 0);
+    }
 
-            // Create a new file/dir if needed
-            if (!myFile || linesWritten >= maxLinesPerFile) {
-                if (myFile) {
-                    myFile.close(); // close open file if needed
-                }
-                createNewFile(rtc);
-            }
+    bool isInitialized() {
+        return initialized;
+    }
+
+    /**
+     * @brief Queue a line, never touches the card
+     *
+     * @return false if the logger is not running or the buffers are full
+     */
+    bool writeLine(const char * data) {
+        if (!initialized)
+            return false;
+
+        int len = strlen(data);
+        if (binary)
+            return writeRecord(BINLOG_TYPE_TEXT, data, len > 255 ? 255 : len);
+        return queue(data, len, "\r\n", 2);
+    }
+
+    /**
+     * @brief Queue a binary record, ignored in text mode
+     *
+     * @param type      BINLOG_TYPE_*
+     * @param payload   Packed record
+     * @param len       Payload size, at most 255
+     */
+    bool writeRecord(uint8_t type, const void * payload, int len) {
+        if (!initialized || !binary)
+            return false;
+        uint8_t frame[BINLOG_FRAME_SIZE] = {type, (uint8_t)len};
+        return queue(frame, BINLOG_FRAME_SIZE, payload, len);
+    }
+
+    /**
+     * @brief Perform at most one card operation, call every loop
+     */
+    void update() {
+        if (!initialized)
+            return;
+
+        if (startTime == 0)
+            startTime = millis();
 
-            // If file is valid write to it
-            if (myFile) {
-                myFile.write(data, strlen(data));
-                linesWritten++;
-                return true;
+        // Flush a partial buffer periodically so little is lost on power loss
+        if (pendingBuf < 0 && millis() - lastSync >= SD_SYNC_INTERVAL) {
+            if (fill > 0) {
+                seal();
+                syncDue = true;
             }
+            lastSync = millis();
         }
 
-        return false;
+        if (pendingBuf >= 0) {
+            writePending();
+            return;
+        }
+
+        if (syncDue && myFile) {
+            unsigned long start = micros();
+            myFile.sync();
+            unsigned long elapsed = micros() - start;
+            if (elapsed > maxSyncLatency)
+                maxSyncLatency = elapsed;
+            syncDue = false;
+        }
     }
 
-    private:
-    bool detected;
-    bool initialized;
-    unsigned int linesWritten;
-    unsigned int maxLinesPerFile;
-    File myFile;
+    void resetStats() {
+        bytesWritten = 0;
+        sectorWrites = 0;
+        slowWrites = 0;
+        droppedLines = 0;
+        writeErrors = 0;
+        filesOpened = 0;
+        writeTime = 0;
+        maxWriteLatency = 0;
+        maxSyncLatency = 0;
+        startTime = 0;
+    }
 
+    void print(Stream * ui) {
+        char output[96];
+        ui->println();
+        if (!initialized) {
+            ui->println("SD logging off or no card");
+        }
+        unsigned long elapsed = startTime > 0 ? millis() - startTime : 0;
+        sprintf(output, "Written: %lu bytes in %lu sectors, %lu files",
+            (unsigned long)bytesWritten, (unsigned long)sectorWrites, (unsigned long)filesOpened);
+        ui->println(output);
+        sprintf(output, "Log rate: %0.1f B/s, card throughput: %0.1f kB/s",
+            elapsed > 0 ? bytesWritten * 1000.0 / elapsed : 0.0,
+            writeTime > 0 ? bytesWritten * 1000.0 / writeTime : 0.0);
+        ui->println(output);
+        sprintf(output, "Worst write: %lu us, worst sync: %lu us, writes over %d us: %lu",
+            maxWriteLatency, maxSyncLatency, SD_SLOW_WRITE, (unsigned long)slowWrites);
+        ui->println(output);
+        sprintf(output, "Dropped lines: %lu, write errors: %lu",
+            (unsigned long)droppedLines, (unsigned long)writeErrors);
+        ui->println(output);
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -4,23 +4,247 @@
 
 #define INA260_SYS_ADDR 0x40
 
+#define BME280_SAMPLE_INTERVAL 100     /**< ms between BME280 forced conversions */
+#define BME280_MEASURE_TIME 10         /**< ms, max conversion time at x1 oversampling is 9.3 ms */
+#define BME280_CTRL_MEAS_FORCED 0x25   /**< osrs_t = x1, osrs_p = x1, mode = forced */
+
+#define INA260_CONVERSION_TIME 301     /**< ms per result, (588 us + 588 us) * 256 samples */
+#define INA260_REG_CONFIG 0x00
+#define INA260_REG_CURRENT 0x01
+#define INA260_REG_BUSVOLTAGE 0x02
+#define INA260_REG_POWER 0x03
+#define INA260_REG_ALERTLIMIT 0x07
+#define INA260_CONFIG_BASE 0x6000      /**< Fixed bits of the configuration register */
+#define INA260_MODE_CURRENT_TRIGGERED 0x01
+#define INA260_LSB 1.25                /**< mV or mA per bit of the voltage, current and limit registers */
+#define INA260_POWER_LSB 10            /**< mW per bit of the power register */
+
+#define I2C_CLOCK 400000
 
 #include <Arduino.h>
+#include <Wire.h>
 #include <Adafruit_Sensor.h>
 #include <Adafruit_BME280.h>
 #include <Adafruit_INA260.h>
 
 #include "Config.h"
+#include "I2CBus.h"
+#include "FixedFormat.h"
+#include "TxQueue.h"
 
-Adafruit_BME280 _bme; // I2C
-Adafruit_INA260 _ina260_sys = Adafruit_INA260();
+/**
+ * @brief BME280 driven in forced mode with split start/read transactions
+ *
+ * The Adafruit driver blocks while a forced conversion runs and issues one
+ * transaction per quantity (plus a temperature read for each compensation).
+ * This starts a conversion, lets the caller come back once it is done and
+ * reads all three results in a single burst.
+ */
+class BME280Async : public Adafruit_BME280 {
+
+    public:
+
+    /** Put the sensor in sleep mode with x1 oversampling and no filter */
+    void configureForced() {
+        setSampling(MODE_FORCED, SAMPLING_X1, SAMPLING_X1, SAMPLING_X1, FILTER_OFF);
+    }
+
+    /** Start a single forced conversion */
+    void startConversion() {
+        write8(BME280_REGISTER_CONTROL, BME280_CTRL_MEAS_FORCED);
+    }
+
+    /**
+     * @brief Burst read and compensate the last conversion
+     *
+     * @param temp  Temperature in 0.01 C
+     * @param pres  Pressure in Pa, Q24.8
+     * @param hum   Relative humidity in %, Q22.10
+     *
+     * @return true if the read succeeded and the data is valid
+     */
+    bool readConversion(int32_t * temp, uint32_t * pres, uint32_t * hum) {
+
+        uint8_t reg = BME280_REGISTER_PRESSUREDATA;
+        uint8_t buf[8];
+        if (i2c_dev == NULL || !i2c_dev->write_then_read(&reg, 1, buf, 8))
+            return false;
+
+        int32_t adc_P = ((uint32_t)buf[0] << 12) | ((uint32_t)buf[1] << 4) | (buf[2] >> 4);
+        int32_t adc_T = ((uint32_t)buf[3] << 12) | ((uint32_t)buf[4] << 4) | (buf[5] >> 4);
+        int32_t adc_H = ((uint32_t)buf[6] << 8) | buf[7];
 
+        // Value in case temperature measurement was disabled
+        if (adc_T == 0x80000)
+            return false;
+
+        bme280_calib_data & c = _bme280_calib;
+
+        // Compensation from the BME280 datasheet, section 4.2.3
+        int32_t var1 = ((((adc_T >> 3) - ((int32_t)c.dig_T1 << 1))) * ((int32_t)c.dig_T2)) >> 11;
+        int32_t var2 = (((((adc_T >> 4) - ((int32_t)c.dig_T1)) * ((adc_T >> 4) - ((int32_t)c.dig_T1))) >> 12) *
+            ((int32_t)c.dig_T3)) >> 14;
+        t_fine = var1 + var2 + t_fine_adjust;
+        *temp = (t_fine * 5 + 128) >> 8;
+
+        int64_t p1 = ((int64_t)t_fine) - 128000;
+        int64_t p2 = p1 * p1 * (int64_t)c.dig_P6;
+        p2 = p2 + ((p1 * (int64_t)c.dig_P5) << 17);
+        p2 = p2 + (((int64_t)c.dig_P4) << 35);
+        p1 = ((p1 * p1 * (int64_t)c.dig_P3) >> 8) + ((p1 * (int64_t)c.dig_P2) << 12);
+        p1 = (((((int64_t)1) << 47) + p1)) * ((int64_t)c.dig_P1) >> 33;
+        if (p1 == 0) {
+            *pres = 0; // avoid exception caused by division by zero
+        }
+        else {
+            int64_t p = 1048576 - adc_P;
+            p = (((p << 31) - p2) * 3125) / p1;
+            p1 = (((int64_t)c.dig_P9) * (p >> 13) * (p >> 13)) >> 25;
+            p2 = (((int64_t)c.dig_P8) * p) >> 19;
+            *pres = (uint32_t)(((p + p1 + p2) >> 8) + (((int64_t)c.dig_P7) << 4));
+        }
+
+        int32_t h = (t_fine - ((int32_t)76800));
+        h = (((((adc_H << 14) - (((int32_t)c.dig_H4) << 20) - (((int32_t)c.dig_H5) * h)) +
+            ((int32_t)16384)) >> 15) * (((((((h * ((int32_t)c.dig_H6)) >> 10) *
+            (((h * ((int32_t)c.dig_H3)) >> 11) + ((int32_t)32768))) >> 10) +
+            ((int32_t)2097152)) * ((int32_t)c.dig_H2) + 8192) >> 14));
+        h = (h - (((((h >> 15) * (h >> 15)) >> 7) * ((int32_t)c.dig_H1)) >> 4));
+        h = (h < 0 ? 0 : h);
+        h = (h > 419430400 ? 419430400 : h);
+        *hum = (uint32_t)(h >> 12);
+
+        return true;
+    }
+};
+
+BME280Async _bme; // I2C
+Adafruit_INA260 _ina260_sys = Adafruit_INA260();
 
+/**
+ * @brief Environmental and power sensors sampled without blocking
+ *
+ * update() is called every loop and performs at most one I2C transaction
+ * per sensor, and only when the sensor has new data:
+ *
+ *  - BME280: start a forced conversion every BME280_SAMPLE_INTERVAL, come
+ *    back BME280_MEASURE_TIME later and burst read all three channels.
+ *  - INA260: wait for most of a conversion period, then poll the
+ *    conversion ready flag, then read current, voltage and power on
+ *    successive calls.
+ */
 class Sensors {
 
     private:
         bool sensorsValid;
-   
+
+        /** BME280 state */
+        typedef enum {
+            BME_IDLE,           /**< Waiting for the next sample interval */
+            BME_CONVERTING      /**< Forced conversion in progress */
+        } BMEState;
+
+        /** INA260 state */
+        typedef enum {
+            INA_WAIT,           /**< Waiting for the next conversion to complete */
+            INA_POLL,           /**< Polling the conversion ready flag */
+            INA_READ_CURRENT,   /**< Next step reads current */
+            INA_READ_VOLTAGE,   /**< Next step reads bus voltage */
+            INA_READ_POWER      /**< Next step reads power */
+        } INAState;
+
+        BMEState bmeState;
+        INAState inaState;
+        unsigned long bmeTimer;
+        unsigned long inaTimer;
+        bool bmeOkay;
+        bool inaOkay;
+        bool paused;
+
+        void updateBME() {
+            unsigned long now = millis();
+            switch (bmeState) {
+                case BME_IDLE:
+                    if (now - bmeTimer >= BME280_SAMPLE_INTERVAL) {
+                        _bme.startConversion();
+                        bmeTimer = now;
+                        bmeState = BME_CONVERTING;
+                    }
+                    break;
+                case BME_CONVERTING:
+                    if (now - bmeTimer >= BME280_MEASURE_TIME) {
+                        int32_t t;
+                        uint32_t p, h;
+                        if (_bme.readConversion(&t, &p, &h)) {
+                            tempRaw = t;
+                            pressureRaw = p;
+                            humidityRaw = h;
+                            temperature = t / 100.0;
+                            pressure = p / 256.0;
+                            humidity = h / 1024.0;
+                            newEnv = true;
+                            newLogEnv = true;
+                        }
+                        bmeState = BME_IDLE;
+                    }
+                    break;
+            }
+        }
+
+        /** Read a 16 bit INA260 register */
+        bool readRegister(uint8_t reg, uint16_t * value) {
+            Wire.beginTransmission(INA260_SYS_ADDR);
+            Wire.write(reg);
+            if (Wire.endTransmission(false) != 0)
+                return false;
+            if (Wire.requestFrom((uint8_t)INA260_SYS_ADDR, (size_t)2) != 2)
+                return false;
+            uint8_t msb = Wire.read();
+            uint8_t lsb = Wire.read();
+            *value = (uint16_t)((msb << 8) | lsb);
+            return true;
+        }
+
+        void updateINA() {
+            uint16_t raw;
+            switch (inaState) {
+                case INA_WAIT:
+                    // Don't poll the ready flag until a result is nearly due
+                    if (millis() - inaTimer >= INA260_CONVERSION_TIME - INA260_CONVERSION_TIME / 8)
+                        inaState = INA_POLL;
+                    break;
+                case INA_POLL:
+                    if (_ina260_sys.conversionReady()) {
+                        inaTimer = millis();
+                        inaState = INA_READ_CURRENT;
+                    }
+                    break;
+                case INA_READ_CURRENT:
+                    if (readRegister(INA260_REG_CURRENT, &raw)) {
+                        currentRaw[0] = (int16_t)raw;
+                        current[0] = currentRaw[0] * INA260_LSB;
+                    }
+                    inaState = INA_READ_VOLTAGE;
+                    break;
+                case INA_READ_VOLTAGE:
+                    if (readRegister(INA260_REG_BUSVOLTAGE, &raw)) {
+                        voltageRaw[0] = raw;
+                        voltage[0] = raw * INA260_LSB;
+                    }
+                    inaState = INA_READ_POWER;
+                    break;
+                case INA_READ_POWER:
+                    if (readRegister(INA260_REG_POWER, &raw)) {
+                        powerRaw[0] = raw;
+                        power[0] = (float)raw * INA260_POWER_LSB;
+                    }
+                    newPower = true;
+                    newLogPower = true;
+                    inaState = INA_WAIT;
+                    break;
+            }
+        }
+
     public:
 
         float voltage[1];
@@ -30,35 +254,68 @@ class Sensors {
         float pressure;
         float humidity;
 
+        // The same results unconverted, for fixed point logging
+        int32_t tempRaw;            /**< Temperature in 0.01 C */
+        uint32_t pressureRaw;       /**< Pressure in Pa, Q24.8 */
+        uint32_t humidityRaw;       /**< Relative humidity in %, Q22.10 */
+        int16_t currentRaw[1];      /**< INA260_LSB mA per bit */
+        uint16_t voltageRaw[1];     /**< INA260_LSB mV per bit */
+        uint16_t powerRaw[1];       /**< INA260_POWER_LSB mW per bit */
+
+        bool newEnv;        /**< Set when a new BME280 result is available, cleared by the caller */
+        bool newPower;      /**< Set when a new INA260 result is available, cleared by the caller */
+        bool newLogEnv;     /**< The same for the log window, which has its own consumer */
+        bool newLogPower;
+
         Sensors() {
             sensorsValid = false;
-
+            bmeOkay = false;
+            inaOkay = false;
+            paused = false;
+            bmeState = BME_IDLE;
+            inaState = INA_WAIT;
+            bmeTimer = 0;
+            inaTimer = 0;
+            newEnv = false;
+            newPower = false;
+            newLogEnv = false;
+            newLogPower = false;
+            voltage[0] = 0.0;
+            current[0] = 0.0;
+            power[0] = 0.0;
+            temperature = 0.0;
+            pressure = 0.0;
+            humidity = 0.0;
+            tempRaw = 0;
+            pressureRaw = 0;
+            humidityRaw = 0;
+            currentRaw[0] = 0;
+            voltageRaw[0] = 0;
+            powerRaw[0] = 0;
         }
 
         bool begin() {
+            I2CBusLock lock;
 
             sensorsValid = true;
-            
+
+            inaOkay = true;
             if (!_ina260_sys.begin(INA260_SYS_ADDR)) {
                 DEBUGPORT.println("Couldn't find INA260 A chip");
                 sensorsValid = false;
+                inaOkay = false;
             }
             else {
                 DEBUGPORT.println("System INA260 OK");
             }
 
-            // set the number of samples to average
-            _ina260_sys.setAveragingCount(INA260_COUNT_256);
-            // set the time over which to measure the current and bus voltage
-            _ina260_sys.setVoltageConversionTime(INA260_TIME_558_us);
-            _ina260_sys.setCurrentConversionTime(INA260_TIME_558_us);
-            
-            
+            configureContinuous();
+
             // default settings
-            int status = _bme.begin(0x76, &Wire);  
+            bmeOkay = _bme.begin(0x76, &Wire);
             // You can also pass in a Wire library object like &Wire2
             // status = bme.begin(0x76, &Wire2)
-            if (!status) {
+            if (!bmeOkay) {
                 DEBUGPORT.println("Could not find a valid BME280 sensor, check wiring, address, sensor ID!");
                 DEBUGPORT.print("SensorID was: 0x"); Serial.println(_bme.sensorID(),16);
                 DEBUGPORT.print("        ID of 0xFF probably means a bad address, a BMP 180 or BMP 085\n");
@@ -68,46 +325,194 @@ class Sensors {
                 // while (1) delay(10);
                 sensorsValid = false;
             }
+            else {
+                // Sleep between forced conversions
+                _bme.configureForced();
+            }
+
+            // All devices on the bus support fast mode
+            Wire.setClock(I2C_CLOCK);
+
+            // Start the first conversion right away
+            bmeTimer = millis() - BME280_SAMPLE_INTERVAL;
+            inaTimer = millis() - INA260_CONVERSION_TIME;
 
             return sensorsValid;
 
         }
 
-        void update() {
-            if (!sensorsValid)
-                return;
-            temperature = _bme.readTemperature();
-            pressure = _bme.readPressure();
-            humidity = _bme.readHumidity();
-            current[0] = _ina260_sys.readCurrent();
-            voltage[0] = _ina260_sys.readBusVoltage();
-            power[0] = _ina260_sys.readPower();
+        /**
+         * @brief Advance the sensor state machines by one step
+         *
+         * @return true if any new data was read
+         */
+        bool update() {
+            if (paused)
+                return false;
+            I2CBusLock lock;
+            if (bmeOkay)
+                updateBME();
+            if (inaOkay)
+                updateINA();
+            return newEnv || newPower;
+        }
+
+        /**
+         * @brief Program the INA260 ALERT pin
+         *
+         * The INA260 has a single limit register so only one alert function
+         * can be active. The alert is latched, active low, and is cleared
+         * by reading the Mask/Enable register (clearAlert()).
+         *
+         * @param type  INA260_ALERT_UNDERVOLTAGE or INA260_ALERT_OVERCURRENT
+         * @param limit Limit in mV or mA
+         */
+        bool configureAlert(INA260_AlertType type, float limit) {
+            if (!inaOkay)
+                return false;
 
+            I2CBusLock lock;
+            uint16_t raw = (uint16_t)(limit / INA260_LSB);
+            Wire.beginTransmission(INA260_SYS_ADDR);
+            Wire.write(INA260_REG_ALERTLIMIT);
+            Wire.write((uint8_t)(raw >> 8));
+            Wire.write((uint8_t)(raw & 0xFF));
+            if (Wire.endTransmission() != 0)
+                return false;
+
+            _ina260_sys.setAlertPolarity(INA260_ALERT_POLARITY_NORMAL);
+            _ina260_sys.setAlertLatch(INA260_ALERT_LATCH_ENABLED);
+            _ina260_sys.setAlertType(type);
+            clearAlert();
+            return true;
+        }
+
+        /** Release a latched alert, returns true if the alert flag was set */
+        bool clearAlert() {
+            if (!inaOkay)
+                return false;
+            I2CBusLock lock;
+            return _ina260_sys.alertFunctionFlag();
+        }
+
+        /** Heavily averaged continuous conversions used for the power log */
+        void configureContinuous() {
+            I2CBusLock lock;
+            // set the number of samples to average
+            _ina260_sys.setAveragingCount(INA260_COUNT_256);
+            // set the time over which to measure the current and bus voltage
+            _ina260_sys.setVoltageConversionTime(INA260_TIME_558_us);
+            _ina260_sys.setCurrentConversionTime(INA260_TIME_558_us);
+            _ina260_sys.setMode(INA260_MODE_CONTINUOUS);
+        }
+
+        /**
+         * @brief Stop all I2C traffic from update()
+         *
+         * Used while another user (eg. the trigger interrupt) needs the bus
+         * or the INA260 in a different mode.
+         */
+        void pause() {
+            paused = true;
+        }
+
+        /** Restore continuous INA260 conversions and restart update() */
+        void resume() {
+            if (inaOkay)
+                configureContinuous();
+            inaState = INA_WAIT;
+            inaTimer = millis();
+            paused = false;
+        }
+
+        bool isPaused() {
+            return paused;
+        }
+
+        /** Stop update(), shut the INA260 down and release the I2C bus before standby */
+        void powerDown() {
+            pause();
+            I2CBusLock lock;
+            // The BME280 already sleeps between forced conversions
+            if (inaOkay)
+                _ina260_sys.setMode(INA260_MODE_SHUTDOWN);
+            Wire.end();
+        }
+
+        /** Undo powerDown() */
+        void powerUp() {
+            I2CBusLock lock;
+            Wire.begin();
+            Wire.setClock(I2C_CLOCK);
+            resume();
+            bmeState = BME_IDLE;
+            bmeTimer = millis() - BME280_SAMPLE_INTERVAL;
+        }
+
+        bool powerOkay() {
+            return inaOkay;
+        }
+
+        /**
+         * @brief Start a single, unaveraged current conversion
+         *
+         * The conversion starts when the write completes. Short enough to
+         * call from an interrupt (one 4 byte I2C write), which must check
+         * i2cBusFree() first. Callers in the loop hold an I2CBusLock.
+         *
+         * @param conversionTime INA260_TIME_140_us ... INA260_TIME_8_244_ms
+         */
+        bool startCurrentConversion(INA260_ConversionTime conversionTime) {
+            uint16_t config = INA260_CONFIG_BASE | ((uint16_t)conversionTime << 3) | INA260_MODE_CURRENT_TRIGGERED;
+            Wire.beginTransmission(INA260_SYS_ADDR);
+            Wire.write((uint8_t)INA260_REG_CONFIG);
+            Wire.write((uint8_t)(config >> 8));
+            Wire.write((uint8_t)(config & 0xFF));
+            return Wire.endTransmission() == 0;
+        }
+
+        /** Read the current register in mA without touching the configuration */
+        bool readCurrentRegister(float * current) {
+            I2CBusLock lock;
+            uint16_t raw;
+            if (!readRegister(INA260_REG_CURRENT, &raw))
+                return false;
+            *current = (int16_t)raw * INA260_LSB;
+            return true;
+        }
+
+        /** Blocking read of the bus voltage in mV, for setup only */
+        float readBusVoltage() {
+            if (!inaOkay)
+                return 0.0;
+            I2CBusLock lock;
+            return _ina260_sys.readBusVoltage();
         }
 
         void printEnv() {
             if (!sensorsValid)
                 return;
-            temperature = _bme.readTemperature();
-            pressure = _bme.readPressure();
-            humidity = _bme.readHumidity();
-            String output = "$BME280," + String(temperature) + "," + String(pressure) + "," + String(humidity);
-            UI1.println(output);
-            UI2.println(output);
+            char output[64];
+            FixedFormat f(output, sizeof(output));
+            f.str("$BME280,").fixed(tempRaw, 2);
+            f.sep().fixed(fixedRoundQ(pressureRaw, 8, 2), 2);
+            f.sep().fixed(fixedRoundQ(humidityRaw, 10, 2), 2);
+            _txUI1.writeLine(output);
+            _txUI2.writeLine(output);
         }
 
         void printPower() {
             if (!sensorsValid)
                 return;
-            current[0] = _ina260_sys.readCurrent();
-            voltage[0] = _ina260_sys.readBusVoltage();
-            power[0] = _ina260_sys.readPower();
-
-            String output = "$PWR_SYS," + String(current[0]) + "," + String(voltage[0]) + "," + String(power[0]);
-            UI1.println(output);
-            UI2.println(output);
-            
+            // The registers are whole multiples of 0.01 mA, mV and mW
+            char output[64];
+            FixedFormat f(output, sizeof(output));
+            f.str("$PWR_SYS,").fixed(currentRaw[0] * 125L, 2);
+            f.sep().fixed(voltageRaw[0] * 125L, 2);
+            f.sep().fixed(powerRaw[0] * (INA260_POWER_LSB * 100L), 2);
+            _txUI1.writeLine(output);
+            _txUI2.writeLine(output);
         }
 };
 
-#endif
\ No newline at end of file
+#endif
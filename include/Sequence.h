@@ -28,6 +28,7 @@
 #include "Utils.h"
 #include "Strobe.h"
 #include "Optotune.h"
+#include "FocusCal.h"
 
 #define MAX_STRING_LEN 128  /**< Maximum length of string for pritning status */
 #define MAX_COMMANDS 64    /**< Maximum number of commands in a sequence */
@@ -62,6 +63,7 @@ private:
 
     SystemConfig * cfg;                /**< Pointer to the system config object */
     Optotune * etl;                     /**< Pointer to the optotune ETL object */
+    FocusCal * cal;                     /**< Focus calibration, NULL for none */
     bool end;                           /**< True when sequence should end */
     int idx;                            /**< Index of mos recent command */
     int startIdx;                       /**< Index of most recent start command */
@@ -79,14 +81,34 @@ public:
     }
 
 
+    /**
+     * @brief Move the lens to focus at a position
+     *
+     * Without a focus calibration the position goes to the lens as is.
+     *
+     * @param pos Object distance in um
+     * @param wait Return once the lens is there
+     */
+    void focus(int pos, bool wait = true) {
+        float power;
+        if (cal != NULL && cal->focalPower(pos, &power))
+            etl->move(power, 0.0);
+        else
+            etl->move(pos);
+        if (wait)
+            etl->wait();
+    }
+
     /**
      * @brief Inititalizes the object with sys and etl pointers
      * 
      * @param cfg The already instantiated system config object
+     * @param cal Focus calibration mapping positions in um to focal power
     */
-    void init(SystemConfig * cfg, Optotune * etl) {
+    void init(SystemConfig * cfg, Optotune * etl, FocusCal * cal = NULL) {
         this->cfg = cfg;
         this->etl = etl;
+        this->cal = cal;
     }
 
     /**
@@ -213,6 +235,7 @@ public:
         for (int i = startIndex; i < endIndex; i++) {
 
             int nextStart = -1;
+            _taskWatchdog.checkIn();
             sprintf(output,"%d : ", i);
             printAllPorts(output);
             print_sequence_command(this->commands[i]);
@@ -273,14 +296,14 @@ public:
                         recordAmbient(this->commands[i].dur);
                         break;
                     case CMD_MOVE:
-                        etl->move(this->commands[i].start);
+                        focus(this->commands[i].start);
                         break;
                     case CMD_FOCALSTACK:
                         {
                             int start = this->commands[i].start;
                             int stop = this->commands[i].stop;
                             int inc = this->commands[i].inc;
-                            etl->move(start);
+                            focus(start);
 
                             if (this->startIdx > 0) {
                                 nextStart = this->startIndexList[this->startIdx-- - 1]; // Pop right
@@ -296,7 +319,7 @@ public:
                                     return true;
                                 }							
                                 start += inc;
-                                etl->move(start);
+                                focus(start);
                                 // delay for the frame rate
                                 int frameRate = cfg->getInt(FRAMERATE);
                                 if (frameRate > 0) {
@@ -394,7 +417,7 @@ public:
                 okay = true;
 
                 if (okay && online) {
-                    etl->move(pos);
+                    focus(pos, false);
                 }
             }
         }
@@ -476,7 +499,7 @@ public:
                         break;
                     triggerSystem();			
                     start += inc;
-                    etl->move(start);
+                    focus(start);
                     int frameRate = cfg->getInt(FRAMERATE);
                     if (frameRate > 0) {
                         delayMicroseconds(1000000/frameRate);
@@ -497,53 +520,31 @@ public:
     }
 
     /**
-     * @brief Load sequence commands from UI_PORT but don't execute them
+     * @brief Clear the sequence before loading new commands
      */
-    bool load_sequence(Stream * in) {
-        char buf[256];
-        // Disable camera timer triggered images
-        //int lastTriggerState = SP.triggerEnabled;
-        //SP.triggerEnabled = 0;
-        //cameraTriggerTimer.end();
-
+    void start_load() {
         // clear out any old sequence values:
         this->idx = 0;
         this->startIdx = 0;
         this->end = false;
+    }
 
-        // read commands, with 60 second timeout
-        MillisTimer uiTimer;
-
-        while (uiTimer.elapsed() < (unsigned int)(cfg->getInt("CMDTIMEOUT"))) {
-
-            in->print("\rLOAD > ");
-
-            bool haveCmd = false;
-
-            if (!haveCmd)
-                haveCmd = readUIInput(in, buf, 256);
-
-            if (haveCmd) {
-                
-                // end the sequence when we get the "END" command
-                if (strncmp_ci(buf, "end", 3) == 0)
-                    break;
-
-                parse_cmd(buf);
-
-                // reset timer
-                uiTimer.reset();
-                uiTimer.start();
-                in->print("\r\n");
-
-            }
-            else {
-                delay(250);
-            }
-        }
+    /**
+     * @brief Add one line of a sequence being loaded, but don't execute it
+     *
+     * @param buf The NULL terminated line, modified by parsing
+     *
+     * @return False when the line is the "END" command and the load is complete
+     */
+    bool load_line(char * buf) {
+        if (buf[0] == '\0')
+            return true;
 
-        in->print("\r\n");
+        // end the sequence when we get the "END" command
+        if (strncmp_ci(buf, "end", 3) == 0)
+            return false;
 
+        parse_cmd(buf);
         return true;
     }
 
@@ -0,0 +1,196 @@
+/** @file SerialBridge.h
+ *  @brief Background passthrough between a UI port and a hardware port
+ *
+ *  PORTPASS used to loop forever moving one byte per pass until the break
+ *  character, with the watchdog, sensors, logging and protection stopped.
+ *  The bridge is serviced once per loop instead: update() moves whatever
+ *  both sides can take in blocks of up to BRIDGE_CHUNK bytes, without
+ *  waiting, so the rest of the system keeps running during the session.
+ *
+ *  The session ends on PORT_BREAK_CHAR from the user, after an optional
+ *  idle time without traffic in either direction, or after an optional
+ *  number of bytes sent to the device.
+ *
+ *  While it runs the output queues of both ports are held so telemetry is
+ *  not mixed into the conversation.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _SERIALBRIDGE
+
+#define _SERIALBRIDGE
+
+#include <Arduino.h>
+#include "TxQueue.h"
+
+#define PORT_BREAK_CHAR 5       /**< Ctrl-E ends a passthrough session */
+#define BRIDGE_CHUNK 64         /**< Most bytes moved per direction per update */
+
+class SerialBridge {
+
+    private:
+    Stream * user;
+    Stream * device;
+    const char * session;
+    bool echo;
+    unsigned long idleTimeout;
+    uint32_t byteLimit;
+    unsigned long lastActivity;
+    unsigned long started;
+    uint32_t bytesToDevice;
+    uint32_t bytesFromDevice;
+
+    void hold(Stream * port, bool held) {
+        TxQueue * tx = getTxQueue(port);
+        if (tx != NULL)
+            tx->hold(held);
+    }
+
+    /** Bytes the port takes without blocking */
+    static int room(Stream * port) {
+        int n = port->availableForWrite();
+        return n > 0 ? n : 0;
+    }
+
+    /**
+     * @brief Move up to a chunk from one port to another
+     *
+     * @param limit     Most bytes to move, 0 for a chunk
+     * @param sawBreak  Set when PORT_BREAK_CHAR was read, NULL to pass it on
+     * @return Bytes moved, the ones before a break character included
+     */
+    int move(Stream * from, Stream * to, bool echoBack, uint32_t limit, bool * sawBreak) {
+        int n = from->available();
+        int space = room(to);
+        if (echoBack && room(from) < space)
+            space = room(from);
+        if (n > space)
+            n = space;
+        if (n > BRIDGE_CHUNK)
+            n = BRIDGE_CHUNK;
+        if (limit > 0 && (uint32_t)n > limit)
+            n = limit;
+
+        uint8_t buffer[BRIDGE_CHUNK];
+        int count = 0;
+        while (count < n) {
+            int c = from->read();
+            if (c < 0)
+                break;
+            if (sawBreak != NULL && c == PORT_BREAK_CHAR) {
+                *sawBreak = true;
+                break;
+            }
+            buffer[count++] = c;
+        }
+        if (count > 0) {
+            to->write(buffer, count);
+            if (echoBack)
+                from->write(buffer, count);
+        }
+        return count;
+    }
+
+    public:
+
+    SerialBridge() {
+        user = NULL;
+        device = NULL;
+        session = NULL;
+    }
+
+    /**
+     * @brief Start bridging two ports
+     *
+     * @param user          Port of the session that asked for it
+     * @param device        Hardware port to talk to
+     * @param session       Session name for busy replies
+     * @param echo          Echo the user's bytes back to the user
+     * @param idleTimeout   ms without traffic before the session ends, 0 for none
+     * @param byteLimit     Bytes to the device before the session ends, 0 for none
+     */
+    void start(Stream * user, Stream * device, const char * session, bool echo,
+        unsigned long idleTimeout, uint32_t byteLimit) {
+        this->user = user;
+        this->device = device;
+        this->session = session;
+        this->echo = echo;
+        this->idleTimeout = idleTimeout;
+        this->byteLimit = byteLimit;
+        bytesToDevice = 0;
+        bytesFromDevice = 0;
+        started = millis();
+        lastActivity = started;
+        hold(device, true);
+        hold(user, true);
+    }
+
+    bool active() {
+        return user != NULL;
+    }
+
+    /** The port is one end of the running session */
+    bool owns(Stream * port) {
+        return port != NULL && active() && (port == user || port == device);
+    }
+
+    Stream * getUser() {
+        return user;
+    }
+
+    const char * getSession() {
+        return session;
+    }
+
+    /**
+     * @brief Move the waiting bytes in both directions, never blocks
+     *
+     * @return false when the session ended in this update
+     */
+    bool update() {
+        if (!active())
+            return true;
+
+        bool sawBreak = false;
+        int up = move(user, device, echo, byteLimit > 0 ? byteLimit - bytesToDevice : 0, &sawBreak);
+        int down = move(device, user, false, 0, NULL);
+
+        if (up > 0 || down > 0)
+            lastActivity = millis();
+        bytesToDevice += up;
+        bytesFromDevice += down;
+
+        if (sawBreak) {
+            stop("break");
+            return false;
+        }
+
+        if (byteLimit > 0 && bytesToDevice >= byteLimit) {
+            stop("byte limit");
+            return false;
+        }
+        if (idleTimeout > 0 && millis() - lastActivity >= idleTimeout) {
+            stop("idle");
+            return false;
+        }
+        return true;
+    }
+
+    /** End the session and report it to the user */
+    void stop(const char * reason) {
+        if (!active())
+            return;
+        char output[128];
+        sprintf(output, "\r\nPassthrough ended (%s) after %lu s, %lu bytes to port, %lu bytes from port\r\n",
+            reason, (millis() - started) / 1000, (unsigned long)bytesToDevice, (unsigned long)bytesFromDevice);
+        user->print(output);
+        hold(device, false);
+        hold(user, false);
+        user = NULL;
+        device = NULL;
+        session = NULL;
+    }
+};
+
+#endif
@@ -0,0 +1,78 @@
+/** @file SessionLock.h
+ *  @brief Lock arbitrating actions between command sessions
+ *
+ *  The USB, UI1 and UI2 prompts and the host link run at the same time.
+ *  Actions that would conflict, eg. loading a sequence on one port while
+ *  another runs it, take a lock named after what they use. A session that
+ *  finds it held gets a busy reply naming the holder instead of waiting.
+ *
+ *  A lock is a lease: the holder renews it by acquiring it again and it
+ *  frees itself after a lease time without renewal, so a session that
+ *  goes away (cable pulled, host restarted) cannot keep it.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _SESSIONLOCK
+
+#define _SESSIONLOCK
+
+#include <Arduino.h>
+
+class SessionLock {
+
+    private:
+    const char * name;
+    const char * owner;
+    unsigned long touched;
+
+    public:
+
+    /** @param name What the lock protects, for busy replies */
+    SessionLock(const char * name) {
+        this->name = name;
+        owner = NULL;
+        touched = 0;
+    }
+
+    /**
+     * @brief Take or renew the lock
+     *
+     * @param session   Name of the session asking
+     * @param lease     ms after the last renewal when the lock frees itself
+     * @return false if another session holds it
+     */
+    bool acquire(const char * session, unsigned long lease) {
+        if (holder(lease) != NULL && strcmp(owner, session) != 0)
+            return false;
+        owner = session;
+        touched = millis();
+        return true;
+    }
+
+    void release(const char * session) {
+        if (owner != NULL && strcmp(owner, session) == 0)
+            owner = NULL;
+    }
+
+    /** Session holding the lock, NULL if it is free */
+    const char * holder(unsigned long lease) {
+        if (owner != NULL && millis() - touched >= lease)
+            owner = NULL;
+        return owner;
+    }
+
+    const char * getName() {
+        return name;
+    }
+
+    /** Print the busy reply for a session that did not get the lock */
+    void printBusy(Stream * out) {
+        out->print("\r\nBUSY: ");
+        out->print(name);
+        out->print(" in use by ");
+        out->print(owner != NULL ? owner : "none");
+    }
+};
+
+#endif
@@ -1,58 +1,329 @@
+/** @file Stats.h
+ *  @brief Streaming statistics with O(1) updates
+ *
+ *  All classes take their capacity or weight as a template parameter so
+ *  nothing is allocated and the buffers are sized at compile time. Integer
+ *  storage types hold values in fixed point, multiplied by Scale, which
+ *  halves or quarters the RAM of a float buffer and keeps running sums
+ *  exact. No Arduino dependencies.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
 #ifndef _STATS
 
 #define _STATS
 
-#include "Arduino.h"
-#include "config.h"
+#include <stdint.h>
+#include <math.h>
 
-#define MAX_BUFFER_SIZE 128
-
-template <class T>
-class MovingAverage {
+/**
+ * @brief Mean of the last N samples using a ring buffer and a running sum
+ *
+ * @tparam T     Storage type of a sample, float or an integer for fixed point
+ * @tparam N     Number of samples in the window
+ * @tparam Acc   Type of the running sum, must hold N * the largest sample
+ * @tparam Scale Fixed point scale, samples are stored as round(x * Scale)
+ */
+template <class T, int N, class Acc = T, long Scale = 1>
+class RingMean {
 
     private:
-    T buffer[MAX_BUFFER_SIZE];
-    int index;
+    T buffer[N];
+    Acc sum;
+    int head;
     int samples;
 
+    // Floating point sums pick up rounding error as samples are removed
+    static const bool exact = (Acc)0.5 == 0;
+
+    T toStorage(float x) {
+        if (exact)
+            return (T)(x * Scale + (x >= 0 ? 0.5f : -0.5f));
+        return (T)(x * Scale);
+    }
+
     public:
 
-    MovingAverage(int samples=64) {
-        this->samples = samples;
-        if (this->samples >= MAX_BUFFER_SIZE) {
-            DEBUGPORT.println("Samples exceed max buffer size, setting to max buffer size.");
-            this->samples = MAX_BUFFER_SIZE;
-        }
-        this->index = 0;
+    RingMean() {
+        clear();
     }
 
-    float update(T newSample) {
-        if (index < samples) {
-            buffer[index++] = newSample;
+    /**
+     * @brief Add a sample
+     *
+     * @return The mean of the window including the new sample
+     */
+    float update(float x) {
+        T v = toStorage(x);
+        if (samples == N)
+            sum -= buffer[head];
+        else
+            samples++;
+        buffer[head] = v;
+        sum += v;
+        head = (head + 1) % N;
+
+        // Resum once per lap to cancel floating point error, O(1) amortized
+        if (!exact && head == 0) {
+            sum = 0;
+            for (int i = 0; i < N; i++)
+                sum += buffer[i];
         }
-        else {
-            for (int i = 1; i < index; i++) {
-                buffer[i-1] = buffer[i];
-            }
-            buffer[samples-1] = newSample;
+        return mean();
+    }
+
+    float mean() {
+        if (samples == 0)
+            return 0.0;
+        return (float)sum / samples / Scale;
+    }
+
+    /** Mean times Scale, rounded for integer storage, for fixed point output */
+    Acc fixedMean() {
+        if (samples == 0)
+            return 0;
+        if (exact)
+            return sum < 0 ? (sum - samples / 2) / samples : (sum + samples / 2) / samples;
+        return sum / samples;
+    }
+
+    int count() {
+        return samples;
+    }
+
+    bool full() {
+        return samples == N;
+    }
+
+    void clear() {
+        sum = 0;
+        head = 0;
+        samples = 0;
+    }
+};
+
+/**
+ * @brief Exponentially weighted moving average
+ *
+ * Each sample moves the average by 1 / 2^Shift of the difference. Integer
+ * types keep the average times 2^Shift so the fraction a step would lose
+ * stays in the state: the rounded average settles exactly on a constant
+ * input instead of stopping up to 2^Shift - 1 steps short. The first
+ * sample initializes it.
+ *
+ * @tparam T     Storage type, float or an integer for fixed point, an
+ *               integer must hold 2^Shift * the largest sample
+ * @tparam Shift Weight of a new sample is 1 / 2^Shift
+ * @tparam Scale Fixed point scale of integer storage
+ */
+template <class T, int Shift, long Scale = 1>
+class Ewma {
+
+    private:
+    T value;
+    bool valid;
+
+    static const bool exact = (T)0.5 == 0;
+    static const long weight = 1L << Shift;
+
+    T toStorage(float x) {
+        if (exact)
+            return (T)(x * Scale + (x >= 0 ? 0.5f : -0.5f));
+        return (T)(x * Scale);
+    }
+
+    public:
+
+    Ewma() {
+        clear();
+    }
+
+    float update(float x) {
+        T v = toStorage(x);
+        if (!valid) {
+            value = exact ? v * (T)weight : v;
+            valid = true;
         }
-        if (index == 0) {
-            return newSample;
+        else if (exact) {
+            value += v - fixedMean();
         }
         else {
-            float avg = 0.0;
-            for (int i = 0; i < index; i++) {
-                avg += buffer[i];
-            }
-            avg /= index;
-            return avg;
-        } 
+            value += (v - value) / (T)weight;
+        }
+        return mean();
+    }
+
+    float mean() {
+        if (exact)
+            return (float)value / weight / Scale;
+        return (float)value / Scale;
+    }
+
+    /** Average times Scale, rounded for integer storage, for fixed point output */
+    T fixedMean() {
+        if (!exact)
+            return value;
+        return value < 0 ? (value - (T)(weight / 2)) / (T)weight : (value + (T)(weight / 2)) / (T)weight;
+    }
+
+    bool ready() {
+        return valid;
     }
 
     void clear() {
-        index -= 0;
+        value = 0;
+        valid = false;
+    }
+};
+
+/**
+ * @brief Minimum and maximum since the last clear()
+ */
+template <class T>
+class MinMax {
+
+    private:
+    T lo;
+    T hi;
+    uint32_t samples;
+
+    public:
+
+    MinMax() {
+        clear();
     }
 
+    void update(T x) {
+        if (samples == 0 || x < lo)
+            lo = x;
+        if (samples == 0 || x > hi)
+            hi = x;
+        samples++;
+    }
+
+    T min() {
+        return lo;
+    }
+
+    T max() {
+        return hi;
+    }
+
+    uint32_t count() {
+        return samples;
+    }
+
+    void clear() {
+        lo = 0;
+        hi = 0;
+        samples = 0;
+    }
+};
+
+/**
+ * @brief Minimum, maximum and mean of the samples in a reporting window
+ *
+ * Samples are added at the sensor rate and the window is read and
+ * cleared at the output rate. With an integer type the mean is rounded
+ * to the nearest step of the fixed point value instead of truncated.
+ */
+template <class T = float>
+class WindowStats {
+
+    private:
+    MinMax<T> range;
+    T sum;
+
+    static const bool exact = (T)0.5 == 0;
+
+    public:
+
+    WindowStats() {
+        clear();
+    }
+
+    void update(T x) {
+        range.update(x);
+        sum += x;
+    }
+
+    T min() {
+        return range.min();
+    }
+
+    T max() {
+        return range.max();
+    }
+
+    T mean() {
+        T n = (T)range.count();
+        if (n == 0)
+            return 0;
+        if (exact)
+            return sum < 0 ? (sum - n / 2) / n : (sum + n / 2) / n;
+        return sum / n;
+    }
+
+    uint32_t count() {
+        return range.count();
+    }
+
+    void clear() {
+        range.clear();
+        sum = 0;
+    }
+};
+
+/**
+ * @brief Running mean and variance, Welford's algorithm
+ *
+ * Numerically stable for long runs where the naive sum of squares loses
+ * all precision in single precision floats.
+ */
+template <class T = float>
+class Welford {
+
+    private:
+    uint32_t samples;
+    T m;
+    T m2;
+
+    public:
+
+    Welford() {
+        clear();
+    }
+
+    void update(T x) {
+        samples++;
+        T delta = x - m;
+        m += delta / samples;
+        m2 += delta * (x - m);
+    }
+
+    T mean() {
+        return m;
+    }
+
+    /** Sample variance, 0 with fewer than 2 samples */
+    T variance() {
+        return samples > 1 ? m2 / (samples - 1) : 0;
+    }
+
+    T stddev() {
+        return sqrt(variance());
+    }
+
+    uint32_t count() {
+        return samples;
+    }
+
+    void clear() {
+        samples = 0;
+        m = 0;
+        m2 = 0;
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
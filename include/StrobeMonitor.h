@@ -0,0 +1,288 @@
+/** @file StrobeMonitor.h
+ *  @brief Detect failed strobe strings from the current of single flashes
+ *
+ *  The power log averages the INA260 over hundreds of ms so a flash of a
+ *  few us is invisible in it. Every Nth trigger the monitor instead has the
+ *  trigger interrupt start a single, unaveraged INA260 current conversion
+ *  just before the flash, sized so the conversion window contains the whole
+ *  pulse. The window average above the idle current, times the window
+ *  length, is the charge of the pulse and with the bus voltage its energy.
+ *  A second conversion without a flash right after gives the idle current.
+ *
+ *  Per channel statistics are kept and after STROBE_LEARN_COUNT captures the
+ *  mean energy becomes the baseline. An alarm is raised when the recent
+ *  average falls below a configured fraction of the baseline.
+ *
+ *  While a capture is armed or running the Sensors state machines are
+ *  paused. The interrupt still skips a trigger while any other loop code
+ *  holds the bus (I2CBus.h) and stays armed for the next one.
+ *
+ *  An idle current conversion that a flash lands in is restarted, so the
+ *  frame period must be longer than twice the conversion window.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _STROBEMONITOR
+
+#define _STROBEMONITOR
+
+#include <Arduino.h>
+#include "Config.h"
+#include "Sensors.h"
+#include "Counters.h"
+#include "FixedFormat.h"
+#include "TxQueue.h"
+
+#define STROBE_PRE_DELAY 300        /**< us from camera trigger to flash, see triggerImage() */
+#define STROBE_SETTLE 200           /**< us added to the conversion window before reading */
+#define STROBE_ARM_TIMEOUT 2000     /**< ms to wait for a matching trigger */
+#define STROBE_LEARN_COUNT 8        /**< Captures averaged into the initial baseline */
+#define STROBE_RECENT_WEIGHT 4      /**< EWMA divisor of the recent energy */
+#define STROBE_BASELINE_WEIGHT 64   /**< EWMA divisor of the baseline while healthy */
+#define STROBE_IDLE_RETRIES 3       /**< Idle conversions restarted because a flash overlapped */
+
+/** INA260 conversion times in us, indexed by INA260_ConversionTime */
+const uint16_t strobeWindows[] = {140, 204, 332, 588, 1100, 2116, 4156, 8244};
+
+/** Pulse energy statistics of one strobe channel */
+struct StrobeStats {
+    uint32_t count;
+    float mean;         /**< Mean pulse energy in uJ */
+    float m2;           /**< Sum of squared deviations, for the variance */
+    float minimum;
+    float maximum;
+    float baseline;     /**< Learned healthy pulse energy in uJ */
+    float recent;       /**< EWMA of the latest pulse energies in uJ */
+    float current;      /**< Last pulse current above idle, window average in mA */
+    bool alarm;
+};
+
+class StrobeMonitor {
+
+    private:
+
+    typedef enum {
+        STROBE_IDLE,        /**< Counting triggers until the next capture */
+        STROBE_ARMED,       /**< Next matching trigger starts a conversion */
+        STROBE_CAPTURING,   /**< Conversion containing the flash is running */
+        STROBE_IDLE_CURRENT /**< Conversion without a flash is running */
+    } StrobeState;
+
+    volatile StrobeState state;
+    volatile uint32_t frames;           /**< Triggers seen, from the interrupt */
+    volatile unsigned long startMicros; /**< When the current conversion started */
+    volatile int captureChannel;
+    volatile int wantChannel;           /**< Channel to capture, -1 for any */
+    volatile int window;                /**< INA260_ConversionTime of the capture */
+
+    uint32_t lastCaptureFrame;
+    uint32_t idleFrame;                 /**< frames when the idle conversion started */
+    int idleRetries;
+    unsigned long armTime;
+    int nextChannel;
+    float pulseCurrent;
+
+    StrobeStats stats[N_CHANNELS];
+    Sensors * sensors;
+
+    bool startIdleConversion() {
+        idleFrame = frames;
+        I2CBusLock lock;
+        if (!sensors->startCurrentConversion((INA260_ConversionTime)window))
+            return false;
+        startMicros = micros();
+        state = STROBE_IDLE_CURRENT;
+        return true;
+    }
+
+    void finish() {
+        sensors->resume();
+        lastCaptureFrame = frames;
+        state = STROBE_IDLE;
+    }
+
+    void printAlarm(int channel) {
+        const char * names[N_CHANNELS] = {"WHITE", "UV"};
+        StrobeStats & s = stats[channel];
+        char output[96];
+        FixedFormat f(output, sizeof(output));
+        f.str("$STROBE,").str(s.alarm ? "ALARM" : "OK").sep().str(names[channel]);
+        f.sep().fixedf(s.recent, 1).sep().fixedf(s.baseline, 1);
+        _txUI1.writeLine(output);
+        _txUI2.writeLine(output);
+    }
+
+    void addCapture(int channel, float energy, int alarmPercent) {
+        StrobeStats & s = stats[channel];
+
+        s.count++;
+        float delta = energy - s.mean;
+        s.mean += delta / s.count;
+        s.m2 += delta * (energy - s.mean);
+        if (s.count == 1 || energy < s.minimum)
+            s.minimum = energy;
+        if (s.count == 1 || energy > s.maximum)
+            s.maximum = energy;
+
+        if (s.count <= STROBE_LEARN_COUNT) {
+            s.baseline = s.mean;
+            s.recent = s.mean;
+            return;
+        }
+
+        s.recent += (energy - s.recent) / STROBE_RECENT_WEIGHT;
+
+        bool low = s.recent < s.baseline * alarmPercent / 100.0;
+        if (!low)
+            s.baseline += (energy - s.baseline) / STROBE_BASELINE_WEIGHT;
+
+        if (low != s.alarm) {
+            s.alarm = low;
+            printAlarm(channel);
+        }
+    }
+
+    public:
+
+    StrobeMonitor(Sensors * sensors) {
+        this->sensors = sensors;
+        state = STROBE_IDLE;
+        frames = 0;
+        lastCaptureFrame = 0;
+        nextChannel = CHANNEL_WHITE;
+        wantChannel = -1;
+        window = INA260_TIME_140_us;
+        reset();
+    }
+
+    /** Forget all statistics and learn a new baseline */
+    void reset() {
+        memset(stats, 0, sizeof(stats));
+    }
+
+    /**
+     * @brief Called from the trigger interrupt before the flash
+     *
+     * Must return well within STROBE_PRE_DELAY, the only work is a single
+     * I2C write when a capture is armed and the loop is not using the bus.
+     *
+     * @param channel   CHANNEL_WHITE or CHANNEL_UV
+     * @param duration  Flash duration in us
+     */
+    void trigger(int channel, int duration) {
+        frames++;
+        if (state != STROBE_ARMED || (wantChannel >= 0 && channel != wantChannel))
+            return;
+        if (!i2cBusFree())
+            return;
+
+        int w = INA260_TIME_140_us;
+        while (w < INA260_TIME_8_244_ms && strobeWindows[w] < STROBE_PRE_DELAY + duration)
+            w++;
+
+        if (sensors->startCurrentConversion((INA260_ConversionTime)w)) {
+            startMicros = micros();
+            captureChannel = channel;
+            window = w;
+            state = STROBE_CAPTURING;
+        }
+    }
+
+    /**
+     * @brief Advance the capture, call every loop
+     *
+     * @param imaging       True when the camera is on and triggers enabled
+     * @param interval      Triggers between captures, 0 disables
+     * @param alarmPercent  Alarm below this percentage of the baseline
+     * @param imagingMode   IMAGINGMODE, 2 alternates the captured channel
+     * @param busVoltage    Bus voltage in mV
+     */
+    void update(bool imaging, int interval, int alarmPercent, int imagingMode, float busVoltage) {
+
+        switch (state) {
+            case STROBE_IDLE:
+                if (!imaging || interval <= 0 || !sensors->powerOkay())
+                    break;
+                if (frames - lastCaptureFrame < (uint32_t)interval)
+                    break;
+                // Hand the bus to the trigger interrupt
+                sensors->pause();
+                wantChannel = imagingMode == 2 ? nextChannel : -1;
+                armTime = millis();
+                state = STROBE_ARMED;
+                break;
+
+            case STROBE_ARMED:
+                if (millis() - armTime < STROBE_ARM_TIMEOUT)
+                    break;
+                noInterrupts();
+                if (state == STROBE_ARMED) {
+                    interrupts();
+                    finish();
+                    break;
+                }
+                interrupts();
+                break;
+
+            case STROBE_CAPTURING:
+                if (micros() - startMicros < (unsigned long)strobeWindows[window] + STROBE_SETTLE)
+                    break;
+                // Measure the idle current with the same window
+                idleRetries = 0;
+                if (!sensors->readCurrentRegister(&pulseCurrent) || !startIdleConversion())
+                    finish();
+                break;
+
+            case STROBE_IDLE_CURRENT:
+                if (micros() - startMicros < (unsigned long)strobeWindows[window] + STROBE_SETTLE)
+                    break;
+                if (frames != idleFrame) {
+                    // A flash landed in the idle window
+                    if (++idleRetries > STROBE_IDLE_RETRIES || !startIdleConversion())
+                        finish();
+                    break;
+                }
+                float idleCurrent;
+                if (sensors->readCurrentRegister(&idleCurrent)) {
+                    float current = pulseCurrent - idleCurrent;
+                    // mA * mV * us = pJ
+                    float energy = current * busVoltage * strobeWindows[window] * 1e-6;
+                    stats[captureChannel].current = current;
+                    addCapture(captureChannel, energy, alarmPercent);
+                    nextChannel = (captureChannel + 1) % N_CHANNELS;
+                }
+                finish();
+                break;
+        }
+    }
+
+    /** True if any channel is below its baseline */
+    bool alarm() {
+        for (int i = 0; i < N_CHANNELS; i++) {
+            if (stats[i].alarm)
+                return true;
+        }
+        return false;
+    }
+
+    void print(Stream * ui) {
+        const char * names[N_CHANNELS] = {"white", "uv"};
+        char output[128];
+        ui->println();
+        for (int i = 0; i < N_CHANNELS; i++) {
+            StrobeStats & s = stats[i];
+            float sd = s.count > 1 ? sqrt(s.m2 / (s.count - 1)) : 0.0;
+            sprintf(output, "Strobe %-5s: %lu captures, %0.1f mA, %0.1f uJ (sd %0.1f, min %0.1f, max %0.1f)",
+                names[i], (unsigned long)s.count, s.current, s.mean, sd, s.minimum, s.maximum);
+            ui->println(output);
+            if (s.count <= STROBE_LEARN_COUNT)
+                sprintf(output, "    learning baseline, %d of %d captures", (int)s.count, STROBE_LEARN_COUNT);
+            else
+                sprintf(output, "    recent %0.1f uJ, baseline %0.1f uJ, %s", s.recent, s.baseline, s.alarm ? "ALARM" : "OK");
+            ui->println(output);
+        }
+    }
+};
+
+#endif
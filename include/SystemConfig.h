@@ -5,6 +5,7 @@
 #include <Arduino.h>
 #include "Config.h"
 #include "Utils.h"
+#include "FlashLayout.h"
 
 #define MAX_PARAMS 256
 
@@ -122,7 +123,7 @@ class ConfigParam {
                         if (bufferIndex < 0) {
                             bufferIndex = 0;
                         }
-                        else if ( index >= 0) {
+                        else if (bufferIndex >= 0) {
                            in->write("\b \b");
                         }
                     }
@@ -306,6 +307,26 @@ class SystemConfig {
             return 0.0;
         }
 
+        /** Integer param by name, NULL if there is none */
+        ConfigParam<int> * findInt(const char * name) {
+            for (int i = 0; i < nIntParams; i++) {
+                if (strncmp_ci(intParams[i]->name, name, strlen(name)) == 0) {
+                    return intParams[i];
+                }
+            }
+            return NULL;
+        }
+
+        /** Float param by name, NULL if there is none */
+        ConfigParam<float> * findFloat(const char * name) {
+            for (int i = 0; i < nFloatParams; i++) {
+                if (strncmp_ci(floatParams[i]->name, name, strlen(name)) == 0) {
+                    return floatParams[i];
+                }
+            }
+            return NULL;
+        }
+
         int getIntMin(const char * name) {
             // Check int params
             for (int i = 0; i < nIntParams; i++) {
@@ -413,7 +434,7 @@ class SystemConfig {
         void writeConfig() {
 
             // erase block first so we can write to it
-            _flash.blockErase4K(0);
+            _flash.blockErase4K(FLASH_CONFIG_ADDR);
 
             for (int i = 0; i < nIntParams; i++) {
                 intParams[i]->writeToFlash();
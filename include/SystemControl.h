@@ -5,40 +5,64 @@
 #include <Arduino.h>
 #include <RTCZero.h>
 #include <RTCLib.h>
-#include <WDTZero.h>
 #include "Config.h"
 #include "DeepSleep.h"
 #include "SPIFlash.h"
 #include "Sensors.h"
 #include "Stats.h"
+#include "FixedFormat.h"
+#include "TimeService.h"
+#include "LineEditor.h"
+#include "CommandTable.h"
+#include "HostLink.h"
+#include "SessionLock.h"
+#include "SerialBridge.h"
 #include "SystemConfig.h"
 #include "SystemTrigger.h"
-#include "RBRInstrument.h"
-#include "SBE39.h"
+#include "InstrumentFormats.h"
+#include "InstrumentTimebase.h"
 #include "Utils.h"
 #include "Optotune.h"
+#include "FocusCal.h"
+#include "FocalSweep.h"
+#include "LoopIdle.h"
+#include "TaskWatchdog.h"
 #include "Sequence.h"
+#include "Counters.h"
+#include "StrobeMonitor.h"
+#include "SDLogger.h"
+#include "FlashLog.h"
 
-#define CMD_CHAR '!'
-#define SET_CHAR '#'
-#define PROMPT "PCTL > "
 #define LOG_PROMPT "$PCTL"
-#define CMD_BUFFER_SIZE 128
+#define FRAME_PROMPT "$FRAME"
+#define FRAME_QUEUE_SIZE 32     /**< Triggers waiting for CTD data to tag them, power of 2 */
+#define FRAME_TAG_TIMEOUT 2000000 /**< Give up on tagging a frame after this many us */
+#define FRAME_NO_FOCUS BINLOG_NULL_I16  /**< Focal power of frames taken with the lens off */
 
 #define STROBE_POWER 7
 #define CAMERA_POWER 6
 
+#define USB_POWER_VOLTAGE 6000.0    /**< Below this (mV) we are likely on USB power */
+
+// Power fault sources
+#define FAULT_NONE 0
+#define FAULT_UNDERVOLTAGE 1
+#define FAULT_OVERCURRENT 2
+
 // Global Sensors
 Sensors _sensors;
 
 // Global RTCZero
 RTCZero _zerortc;
 
+// Standby until an RTC alarm
+DeepSleep _deepSleep;
+
 //Global RTCLib
 RTC_DS3231 _ds3231;
 
-// Global watchdog timer with 8 second hardware timeout
-WDTZero _watchdog;
+// Sub-second time from the DS3231 second edges and micros()
+TimeService _timeService;
 
 // RBR instrument
 RBRInstrument _rbr;
@@ -46,12 +70,92 @@ RBRInstrument _rbr;
 // SBE39 CTD
 SBE39 _sbe39;
 
+// All serial instruments, polled in this order every update
+#define INSTRUMENTS _rbr, _sbe39
+
+// CTD clock model used to tag frames with depth
+InstrumentTimebase _ctdTime;
+
+// Lifetime energy and usage counters
+Counters _counters;
+
+// Strobe current capture
+StrobeMonitor _strobe(&_sensors);
+
+// SD card log of the $PCTL, CTD and frame streams
+SDLogger _sdlog;
+
+#define SD_DETECT_INTERVAL 1000 /**< ms between card detect checks */
+
+// LOGFORMAT values
+#define LOGFORMAT_TEXT 0            /**< $PCTL text to the UIs and the SD card */
+#define LOGFORMAT_BINARY 1          /**< $PCTL text to the UIs, binary records to the SD card */
+#define LOGFORMAT_BINARY_ONLY 2     /**< Binary records to the SD card only, no $PCTL text */
+
+// SPI flash log used while the SD card is missing
+FlashLog _flashlog;
+bool _flashLogEnabled = false;
+
+// Command session of each UI port
+LineEditor _debugEditor(&DEBUGPORT, "USB");
+LineEditor _ui1Editor(&UI1, "UI1");
+LineEditor _ui2Editor(&UI2, "UI2");
+
+// Session name of the host link
+#define LINK_SESSION "LINK"
+
+// Arbitration of actions between sessions
+SessionLock _sequenceLock("sequences");
+SessionLock _cameraLock("camera power");
+
+// PORTPASS session, one at a time
+SerialBridge _bridge;
+
+/**
+ * @brief Send a log line to the SD card, or to the flash log without a card
+ *
+ * Lines keep going to the flash log until it has drained so the SD log
+ * stays in order.
+ */
+bool logLine(const char * line) {
+    if (_sdlog.isInitialized() && (_flashlog.empty() || !_flashLogEnabled))
+        return _sdlog.writeLine(line);
+    if (_flashLogEnabled)
+        return _flashlog.write(BINLOG_TYPE_TEXT, line, strlen(line));
+    return false;
+}
+
+/** Binary record version of logLine() */
+bool logRecord(uint8_t type, const void * payload, int len) {
+    if (_sdlog.isInitialized() && (_flashlog.empty() || !_flashLogEnabled))
+        return _sdlog.writeRecord(type, payload, len);
+    if (_flashLogEnabled)
+        return _flashlog.write(type, payload, len);
+    return false;
+}
+
+void logInstrumentLine(const char * line) {
+    logLine(line);
+}
+
 // Optotune lens
 Optotune _etl;
 
+// Object distance to focal power map of the lens
+FocusCal _focusCal;
+
+// Focal sweep stepped by the trigger
+FocalSweep _sweep;
+
+// Core sleep between loop passes
+LoopIdle _loopIdle;
+
 // Sequence processors
 Sequence _seq[MAX_MACROS];
 
+// INA260 ALERT interrupt wrapper, defined in main.cpp
+void powerFaultCallback();
+
 class SystemControl
 {
     private:
@@ -64,7 +168,6 @@ class SystemControl
     bool pendingPowerOn;
     bool lowVoltage;
     bool badEnv;
-    char cmdBuffer[CMD_BUFFER_SIZE];
     bool rbrData;
     int state;
     unsigned long timestamp;
@@ -74,319 +177,735 @@ class SystemControl
     unsigned long lastPowerOffTime;
     unsigned long pendingPowerOffTimer;
     unsigned long pendingPowerOnTimer;
-    unsigned long clockSyncTimer;
     unsigned long envTimer;
     unsigned long voltageTimer;
+    unsigned long logTimer;
+    unsigned long sdDetectTimer;
+
+    // Sensor statistics over the current LOGINT window, in fixed point
+    WindowStats<int32_t> logTemp;       // 0.001 C
+    WindowStats<int32_t> logPressure;   // Pa
+    WindowStats<int32_t> logHum;        // 0.01 %
+    WindowStats<int32_t> logVoltage;    // mV
+    WindowStats<int32_t> logPower;      // mW
 
     unsigned long imageCounter;
 
+    // Trigger times waiting to be tagged with CTD data, filled by triggerImage()
+    volatile unsigned long frameMicros[FRAME_QUEUE_SIZE];
+    volatile unsigned long frameNumber[FRAME_QUEUE_SIZE];
+    volatile int16_t frameFocus[FRAME_QUEUE_SIZE];      // 0.001 dpt
+    volatile bool frameSwept[FRAME_QUEUE_SIZE];         // part of a focal sweep
+    volatile unsigned int frameHead;
+    unsigned int frameTail;
+
+    // Power protection, powerFault is set from the INA260 ALERT interrupt
+    volatile bool powerFault;
+    volatile int powerFaultType;
+    bool powerFaultHandled;
+    int faultTrigEnabled;       // TRIGENABLED before the fault stopped triggers
+    bool alertArmed;
+    int alertType;
+
     int lastFlashType;
 
-    MovingAverage<float> avgVoltage;
-    MovingAverage<float> avgTemp;
-    MovingAverage<float> avgHum;
-    MovingAverage<float> avgDepth;
+    // FLASHDUMP or FLASHDRAIN to a session, one page per loop pass
+    LineEditor * dumpEditor;    // NULL when no dump runs
+    bool dumpDrain;             // mark pages drained once written
+    uint32_t dumpPage;          // next page of a read only dump
+    uint32_t dumpPages;
+
+    // Fixed point, mV, 0.01 C and 0.01 %
+    RingMean<int32_t, 64> avgVoltage;
+    RingMean<int16_t, 64, int32_t, 100> avgTemp;
+    RingMean<int16_t, 64, int32_t, 100> avgHum;
+    float latestTemp;
+    float latestHum;
+    float latestVoltage;
+
+    // Commands of the CMD_CHAR and SET_CHAR prompts
+    CommandTable<SystemControl> commands;
+
+    // Last completed log window, for host link status requests
+    BinaryPctlRecord lastStatus;
     
-    void readInput(Stream *in) {
-      
-        if (in != NULL && in->available() > 0) {
-            char c = in->read();
-
-            if (c == SET_CHAR) {
-                unsigned long startTimer = millis();
-                int index = 0;
-                while (startTimer <= millis() && millis() - startTimer < (unsigned int)(cfg.getInt("CMDTIMEOUT"))) {
-
-                    if (cfg.getInt(WATCHDOG) > 0) {
-                        _watchdog.clear();
-                    }
-
-                    // Break if we have exceed the buffer size
-                    if (index >= CMD_BUFFER_SIZE)
-                        break;
+    /**
+     * @brief Feed waiting input on a port to its line editor
+     *
+     * Never waits for the operator, complete lines are dispatched as they
+     * arrive and the loop carries on in between.
+     */
+    void readInput(LineEditor & ed) {
+
+        Stream * in = ed.getPort();
+
+        // The host link and a passthrough session own their ports
+        if (in == _hostlink.getPort() || _bridge.owns(in))
+            return;
+        if (dumpEditor != NULL && dumpEditor->getPort() == in)
+            return;
 
-                    // Wait on user input
-                    if (in->available()) {
-                        // Read the next char and reset timer          
-                        c = in->read();
-                        startTimer = millis();
-                    }
-                    else {
-                        continue;
-                    }
+        if (in != &DEBUGPORT && in->available() > 0)
+            echoInstruments(false, INSTRUMENTS);
 
-                    // Exit command loop on repeat command char
-                    if (c == CMD_CHAR) {
+        EditEvent event;
+        while ((event = ed.poll(cfg.getInt(LOCALECHO), cfg.getInt(CMDTIMEOUT))) != EDIT_NONE) {
+            if (event == EDIT_ANSWER) {
+                runConfirmed(ed);
+                continue;
+            }
+            switch (ed.getMode()) {
+                case LINE_LOAD:
+                    // Renew the lock, another session may have taken it after a pause
+                    if (!_sequenceLock.acquire(ed.getName(), cfg.getInt(CMDTIMEOUT))) {
+                        _sequenceLock.printBusy(in);
+                        in->print("\r\n");
+                        ed.open(LINE_COMMAND);
                         break;
                     }
-                    
-                    if (c == '\r') {
-                        // Command ended try to 
-                        if (index <= CMD_BUFFER_SIZE)
-                            cmdBuffer[index++] = '\0';
-                        else
-                            cmdBuffer[CMD_BUFFER_SIZE-1] = '\0';
-                        
-                        // Parse Command menus
-                        char * rest;
-                        char * cmd = strtok_r(cmdBuffer,",",&rest);
-
-                        // CFG (configuration commands)
-                        if (cmd != NULL && strncmp_ci(cmd,SET, 3) == 0) {
-                            if (rest != NULL) {
-                                cfg.parseConfigCommand(rest, in);
-                            }
-                            else {
-                                char timeString[64];
-                                getTimeString(timeString);
-                                cfg.printConfig(in, timeString);
-
-                            }
-                            
-                        }
-
-                        else if (cmd != NULL && strncmp_ci(cmd,STEPLENS,8) == 0) {
-                            float num;
-                            sscanf(rest,"%f",&num);
-                            if (num >= -2.0 && num < 3.0) {
-                                _etl.step(num);
-                            }
-                            
-                        }
-
-                        else if (cmd != NULL && strncmp_ci(cmd,MOVELENS,8) == 0) {
-                            float num, inc;
-                            sscanf(rest,"%f,%f",&num,&inc);
-                            if (num >= -2.0 && num < 3.0) {
-                                _etl.move(num, inc);
-                            }
-                            
-                        }
-
-                        // Break from loop in set command since there is no CLI
+                    if (!_seq[ed.getPending()].load_line(ed.line())) {
+                        in->print("\r\n");
+                        ed.open(LINE_COMMAND);
                         break;
                     }
-                    // Handle backspace
-                    if (c == '\b') {
-                        index -= 1;
-                        if (index < 0) {
-                            index = 0;
-                        }
-                        else if ( index >= 0 && cfg.getInt(LOCALECHO)) {
-                           in->write("\b \b");
-                        }
-                    }
-                    else {
-                        cmdBuffer[index++] = c;
-                        if (cfg.getInt(LOCALECHO))
-                            in->write(c);
-                    }
-                }
+                    ed.prompt();
+                    break;
+                default:
+                    runCommand(ed);
+                    break;
             }
+        }
 
-            if (c == CMD_CHAR) {
+        // Locks last as long as the action that took them
+        if (!ed.busy())
+            releaseLocks(ed.getName());
+    }
 
-                // Don't echo the command char
-                //if (cfg.getInt("LOCALECHO"))
-                //    in->write(c);
-              
-                // Print the prompt
-                in->write(PROMPT);
+    /** Act on the answer to a question asked by runCommand() */
+    void runConfirmed(LineEditor & ed) {
+        if (ed.confirmed()) {
+            // The question left the line in the editor
+            runCommand(ed, true);
+        }
+        else if (ed.getMode() == LINE_SET) {
+            ed.close();
+        }
+        else {
+            ed.prompt();
+        }
+    }
 
+    /**
+     * @brief Look up, check and run a command line
+     *
+     * @param line      Command and arguments, not modified
+     * @param out       Where the command prints its reply
+     * @param session   Name of the session running it, for locks
+     * @param editor    Prompt the line came from, NULL from the host link
+     * @param confirmed Run commands that ask a question without asking
+     * @param entry     Set to the command found, NULL if none
+     */
+    CommandStatus execute(const char * line, Stream * out, const char * session, LineEditor * editor,
+        bool confirmed, const CommandEntry<SystemControl> ** entry = NULL) {
+
+        CommandArgs args;
+        args.editor = editor;
+        char * name = args.split(line);
+        if (entry != NULL)
+            *entry = NULL;
+        if (name[0] == '\0')
+            return CMD_EMPTY;
+
+        const CommandEntry<SystemControl> * command = commands.find(name);
+        if (entry != NULL)
+            *entry = command;
+        if (command == NULL) {
+            out->print("\r\nUnknown command: ");
+            out->print(name);
+            return CMD_UNKNOWN;
+        }
+        if (!args.bind(command->schema)) {
+            out->print("\r\nUsage: ");
+            commands.printUsage(out, command);
+            return CMD_BAD_ARGS;
+        }
+        if (command->lock != NULL && !command->lock->acquire(session, cfg.getInt(CMDTIMEOUT))) {
+            command->lock->printBusy(out);
+            return CMD_BUSY;
+        }
+        if (command->question != NULL && !confirmed)
+            return CMD_ASK;
 
-                unsigned long startTimer = millis();
-                int index = 0;
-                while (startTimer <= millis() && millis() - startTimer < (unsigned int)(cfg.getInt("CMDTIMEOUT"))) {
+        (this->*command->handler)(args, out);
+        return CMD_DONE;
+    }
 
-                    if (cfg.getInt(WATCHDOG) > 0) {
-                        _watchdog.clear();
-                    }
+    /**
+     * @brief Run a line typed after CMD_CHAR or SET_CHAR
+     *
+     * @param confirmed The command's question was answered yes
+     */
+    void runCommand(LineEditor & ed, bool confirmed = false) {
+        LineMode mode = ed.getMode();
+
+        const CommandEntry<SystemControl> * command;
+        if (execute(ed.line(), ed.getPort(), ed.getName(), &ed, confirmed, &command) == CMD_ASK) {
+            ed.ask(command->question, commands.indexOf(command));
+            return;
+        }
 
-                    // Break if we have exceed the buffer size
-                    if (index >= CMD_BUFFER_SIZE)
-                        break;
+        // Set commands have no CLI, the session ends here
+        if (ed.getMode() == LINE_SET)
+            ed.close();
+        else if (ed.getMode() == mode)
+            ed.prompt();
+    }
 
-                    // Wait on user input
-                    if (in->available()) {
-                        // Read the next char and reset timer          
-                        c = in->read();
-                        startTimer = millis();
-                    }
-                    else {
-                        continue;
-                    }
+    /** Handle the packet received by the host link */
+    void runPacket() {
+        uint8_t id = _hostlink.id();
+        uint8_t * payload = _hostlink.payload();
+        uint16_t length = _hostlink.payloadLength();
+
+        // Text payloads as a string, packets are never longer than a command line
+        char text[CMD_BUFFER_SIZE];
+        uint16_t textLength = length < CMD_BUFFER_SIZE ? length : CMD_BUFFER_SIZE - 1;
+
+        switch (_hostlink.type()) {
+            case HL_PING: {
+                uint8_t reply[2] = {HL_OK, HOSTLINK_VERSION};
+                _hostlink.send(HL_ACK, id, reply, sizeof(reply));
+                return;
+            }
 
-                    // Exit command loop on repeat command char
-                    if (c == CMD_CHAR) {
+            case HL_CFG_GET: {
+                memcpy(text, payload, textLength);
+                text[textLength] = '\0';
+                HostLinkConfigValue v;
+                ConfigParam<int> * ip = cfg.findInt(text);
+                ConfigParam<float> * fp = cfg.findFloat(text);
+                if (ip != NULL) {
+                    v.type = HL_PARAM_INT;
+                    v.value = ip->val;
+                    v.min = ip->minVal;
+                    v.max = ip->maxVal;
+                }
+                else if (fp != NULL) {
+                    v.type = HL_PARAM_FLOAT;
+                    memcpy(&v.value, &fp->val, 4);
+                    memcpy(&v.min, &fp->minVal, 4);
+                    memcpy(&v.max, &fp->maxVal, 4);
+                }
+                else {
+                    _hostlink.ack(id, HL_UNKNOWN_PARAM);
+                    return;
+                }
+                _hostlink.send(HL_CFG_VALUE, id, &v, sizeof(v), text, strlen(text));
+                _hostlink.ack(id, HL_OK);
+                return;
+            }
+
+            case HL_CFG_SET: {
+                HostLinkConfigSet set;
+                if (length <= sizeof(set)) {
+                    _hostlink.ack(id, HL_BAD_PAYLOAD);
+                    return;
+                }
+                memcpy(&set, payload, sizeof(set));
+                textLength = length - sizeof(set) < CMD_BUFFER_SIZE ? length - sizeof(set) : CMD_BUFFER_SIZE - 1;
+                memcpy(text, payload + sizeof(set), textLength);
+                text[textLength] = '\0';
+                ConfigParam<int> * ip = cfg.findInt(text);
+                ConfigParam<float> * fp = cfg.findFloat(text);
+                bool updated;
+                if (ip != NULL && set.type == HL_PARAM_INT) {
+                    updated = ip->setVal(set.value);
+                }
+                else if (fp != NULL && set.type == HL_PARAM_FLOAT) {
+                    float value;
+                    memcpy(&value, &set.value, 4);
+                    updated = fp->setVal(value);
+                }
+                else {
+                    _hostlink.ack(id, ip == NULL && fp == NULL ? HL_UNKNOWN_PARAM : HL_BAD_PAYLOAD);
+                    return;
+                }
+                _hostlink.ack(id, updated ? HL_OK : HL_OUT_OF_RANGE);
+                return;
+            }
+
+            case HL_SEQ_START:
+            case HL_SEQ_LINE: {
+                if (length < 1 || payload[0] >= MAX_MACROS) {
+                    _hostlink.ack(id, HL_BAD_PAYLOAD);
+                    return;
+                }
+                // Held from the start to the END line, or for CMDTIMEOUT after the last line
+                if (!_sequenceLock.acquire(LINK_SESSION, cfg.getInt(CMDTIMEOUT))) {
+                    _hostlink.ack(id, HL_BUSY);
+                    return;
+                }
+                if (_hostlink.type() == HL_SEQ_START) {
+                    _seq[payload[0]].start_load();
+                }
+                else {
+                    textLength = length - 1 < CMD_BUFFER_SIZE ? length - 1 : CMD_BUFFER_SIZE - 1;
+                    memcpy(text, payload + 1, textLength);
+                    text[textLength] = '\0';
+                    if (!_seq[payload[0]].load_line(text))
+                        _sequenceLock.release(LINK_SESSION);
+                }
+                _hostlink.ack(id, HL_OK);
+                return;
+            }
+
+            case HL_STATUS: {
+                HostLinkStatus status;
+                uint32_t epoch, us;
+                _timeService.now(&epoch, &us);
+                status.epoch = epoch;
+                status.millis = us / 1000;
+                status.powerState = powerState();
+                status.fault = powerFault ? powerFaultType : FAULT_NONE;
+                status.frames = imageCounter;
+                status.log = lastStatus;
+                _hostlink.send(HL_STATUS_DATA, id, &status, sizeof(status));
+                _hostlink.ack(id, HL_OK);
+                return;
+            }
+
+            case HL_COMMAND: {
+                memcpy(text, payload, textLength);
+                text[textLength] = '\0';
+                HostLinkText reply(&_hostlink, id);
+                CommandStatus result = execute(text, &reply, LINK_SESSION, NULL, true);
+                reply.flush();
+                releaseLocks(LINK_SESSION);
+                switch (result) {
+                    case CMD_DONE:
+                    case CMD_EMPTY:
+                        _hostlink.ack(id, HL_OK);
+                        break;
+                    case CMD_UNKNOWN:
+                        _hostlink.ack(id, HL_UNKNOWN_COMMAND);
+                        break;
+                    case CMD_BUSY:
+                        _hostlink.ack(id, HL_BUSY);
+                        break;
+                    default:
+                        _hostlink.ack(id, HL_BAD_ARGS);
                         break;
-                    }
-                    
-                    if (c == '\r') {
-                        // Command ended try to 
-                        if (index <= CMD_BUFFER_SIZE)
-                            cmdBuffer[index++] = '\0';
-                        else
-                            cmdBuffer[CMD_BUFFER_SIZE-1] = '\0';
-                        
-                        // Parse Command menus
-                        char * rest;
-                        char * cmd = strtok_r(cmdBuffer,",",&rest);
-
-                        // CFG (configuration commands)
-                        if (cmd != NULL && strncmp_ci(cmd,CFG, 3) == 0) {
-                            if (rest != NULL) {
-                                cfg.parseConfigCommand(rest, in);
-                            }
-                            else {
-                                char timeString[64];
-                                getTimeString(timeString);
-                                cfg.printConfig(in, timeString);
-
-                            }
-                            
-                        }
-
-                        // PORTPASS (pass through to other serial ports)
-                        if (cmd != NULL && strncmp_ci(cmd,PORTPASS, 8) == 0) {
-                            doPortPass(in, rest);
-                        }
-
-                        //LOADSEQ,num
-                        else if (cmd != NULL && strncmp_ci(cmd,LOADSEQ, 7) == 0) {
-                            int num;
-                            sscanf(rest,"%d",&num);
-                            in->print("\n");
-                            if (num >= 0 && num < MAX_MACROS) {
-                                _seq[num].load_sequence(in);
-                            }
-                        }
-
-                        //RUNSEQ,num
-                        else if (cmd != NULL && strncmp_ci(cmd,RUNSEQ, 6) == 0) {
-                            int num;
-                            sscanf(rest,"%d",&num);
-                            if (num >= 0 && num < MAX_MACROS) {
-                                _seq[num].run_sequence(0,_seq[num].getIdx());
-                            }
-                        }
-
-                        // SETTIME (set time from string)
-                        else if (cmd != NULL && strncmp_ci(cmd,SETTIME, 7) == 0) {
-                            setTime(rest, in);
-                        }
-
-                        // WRITECONFIG (save the current config to EEPROM)
-                        else if (cmd != NULL && strncmp_ci(cmd,WRITECONFIG, 11) == 0) {
-                            writeConfig();
-                        }
-
-                        // READCONFIG (read the current config to EEPROM)
-                        else if (cmd != NULL && strncmp_ci(cmd,READCONFIG, 10) == 0) {
-                            readConfig();
-                        }
-
-                        else if (cmd != NULL && strncmp_ci(cmd,CAMERAON,8) == 0) {
-                            if (confirm(in, "Are you sure you want to power ON camera ? [y/N]: ", cfg.getInt(CMDTIMEOUT)))
-                                turnOnCamera();
-                        }
-
-                        else if (cmd != NULL && strncmp_ci(cmd,CAMERAOFF,9) == 0) {
-                            if (confirm(in, "Are you sure you want to power OFF camera ? [y/N]: ", cfg.getInt(CMDTIMEOUT)))
-                                turnOffCamera();
-                        }
-
-                        else if (cmd != NULL && strncmp_ci(cmd,TESTFLASH,9) == 0) {
-                            testFlash();
-                        } 
-
-                        else if (cmd != NULL && strncmp_ci(cmd,GOTOSLEEP,9) == 0) {
-                            goToSleep();
-                        }
-
-                        else if (cmd != NULL && strncmp_ci(cmd,OPTOTUNE,8) == 0) {
-                            _etl.sendCommand(rest);
-                        }
-
-						else if (cmd != NULL && strncmp_ci(cmd,FOCALSWEEP,8) == 0) {
-                            _etl.focalSweep();
-                        }
-                        else if (cmd != NULL && strncmp_ci(cmd,MOVELENS,8) == 0) {
-                            float num;
-                            sscanf(rest,"%f",&num);
-                            if (num >= -2.0 && num < 3.0) {
-                                _etl.move(num, 0.05);
-                            }
-                            
-                        }
-						
-						else if (cmd != NULL && strncmp_ci(cmd,STEPLENS,8) == 0) {
-                            float num;
-                            sscanf(rest,"%f",&num);
-                            if (num >= -2.0 && num < 3.0) {
-                                _etl.step(num);
-                            }
-                            
-                        }
-
-                        else if (cmd != NULL && strncmp_ci(cmd,"resetopto",9) == 0) {
-                            sendBreak();
-                        }
-                        // Reset the buffer and print out the prompt
-                        if (c == '\n')
-                            in->write('\r');
-                        else
-                            in->write("\r\n");
-
-                        in->write(PROMPT);
-
-                        index = 0;                       
-                        startTimer = millis();
-                        continue;
-                    }
-                    
-                    // Handle backspace
-                    if (c == '\b') {
-                        index -= 1;
-                        if (index < 0) {
-                            index = 0;
-                        }
-                        else if ( index >= 0 && cfg.getInt(LOCALECHO)) {
-                           in->write("\b \b");
-                        }
-                    }
-                    else {
-                        cmdBuffer[index++] = c;
-                        if (cfg.getInt(LOCALECHO))
-                            in->write(c);
-                    }
                 }
+                return;
             }
+
+            case HL_STREAM:
+                if (length < 1) {
+                    _hostlink.ack(id, HL_BAD_PAYLOAD);
+                    return;
+                }
+                _hostlink.setStreaming(payload[0] != 0);
+                _hostlink.ack(id, HL_OK);
+                return;
+
+            default:
+                _hostlink.ack(id, HL_UNKNOWN_TYPE);
+                return;
+        }
+    }
+
+    /** Build the lookup of the commands accepted at both prompts */
+    void buildCommands() {
+        static const CommandEntry<SystemControl> list[] = {
+            {CFG,           &SystemControl::cmdConfig,      "[*",   NULL, NULL},
+            {SET,           &SystemControl::cmdConfig,      "[*",   NULL, NULL},
+            {PORTPASS,      &SystemControl::cmdPortPass,    "i[ii", NULL, NULL},
+            {LOADSEQ,       &SystemControl::cmdLoadSeq,     "i",    NULL, &_sequenceLock},
+            {RUNSEQ,        &SystemControl::cmdRunSeq,      "i",    NULL, &_sequenceLock},
+            {SETTIME,       &SystemControl::cmdSetTime,     "*",    NULL, NULL},
+            {WRITECONFIG,   &SystemControl::cmdWriteConfig, "",     NULL, NULL},
+            {READCONFIG,    &SystemControl::cmdReadConfig,  "",     NULL, NULL},
+            {CAMERAON,      &SystemControl::cmdCameraOn,    "",     "Are you sure you want to power ON camera ? [y/N]: ", &_cameraLock},
+            {CAMERAOFF,     &SystemControl::cmdCameraOff,   "",     "Are you sure you want to power OFF camera ? [y/N]: ", &_cameraLock},
+            {TESTFLASH,     &SystemControl::cmdTestFlash,   "",     NULL, NULL},
+            {GOTOSLEEP,     &SystemControl::cmdGoToSleep,   "[i",   NULL, NULL},
+            {OPTOTUNE,      &SystemControl::cmdOptotune,    "*",    NULL, NULL},
+            {FOCALSWEEP,    &SystemControl::cmdFocalSweep,  "[ffi", NULL, NULL},
+            {MOVELENS,      &SystemControl::cmdMoveLens,    "f[f",  NULL, NULL},
+            {STEPLENS,      &SystemControl::cmdStepLens,    "f",    NULL, NULL},
+            {COUNTERS,      &SystemControl::cmdCounters,    "",     NULL, NULL},
+            {STROBESTATS,   &SystemControl::cmdStrobeStats, "",     NULL, NULL},
+            {STROBERESET,   &SystemControl::cmdStrobeReset, "",     NULL, NULL},
+            {SDSTATS,       &SystemControl::cmdSDStats,     "",     NULL, NULL},
+            {FLASHSTATS,    &SystemControl::cmdFlashStats,  "",     NULL, NULL},
+            {FLASHDUMP,     &SystemControl::cmdFlashDump,   "",     NULL, NULL},
+            {FLASHDRAIN,    &SystemControl::cmdFlashDrain,  "",     "Are you sure you want to drain the flash log to this port ? [y/N]: ", NULL},
+            {TIMESTATS,     &SystemControl::cmdTimeStats,   "",     NULL, NULL},
+            {TXSTATS,       &SystemControl::cmdTxStats,     "",     NULL, NULL},
+            {CLEARFAULT,    &SystemControl::cmdClearFault,  "",     NULL, NULL},
+            {CTDCLOCK,      &SystemControl::cmdCTDClock,    "",     NULL, NULL},
+            {RESETOPTO,     &SystemControl::cmdResetOpto,   "",     NULL, NULL},
+            {LINKSTATS,     &SystemControl::cmdLinkStats,   "",     NULL, NULL},
+            {ECHO,          &SystemControl::cmdEcho,        "[i",   NULL, NULL},
+            {SESSIONS,      &SystemControl::cmdSessions,    "",     NULL, NULL},
+            {OPTOSTATS,     &SystemControl::cmdOptoStats,   "",     NULL, NULL},
+            {FOCUS,         &SystemControl::cmdFocus,       "[i",   NULL, NULL},
+            {FOCUSCAL,      &SystemControl::cmdFocusCal,    "",     NULL, NULL},
+            {FOCUSPOINT,    &SystemControl::cmdFocusPoint,  "i[f",  NULL, NULL},
+            {FOCUSTEMP,     &SystemControl::cmdFocusTemp,   "ff",   NULL, NULL},
+            {FOCUSCLEAR,    &SystemControl::cmdFocusClear,  "",     "Are you sure you want to clear the focus calibration ? [y/N]: ", NULL},
+            {FOCUSSAVE,     &SystemControl::cmdFocusSave,   "",     NULL, NULL},
+            {LOOPSTATS,     &SystemControl::cmdLoopStats,   "[i",   NULL, NULL},
+            {SLEEPUNTIL,    &SystemControl::cmdSleepUntil,  "s",    NULL, NULL},
+            {SLEEPSTATS,    &SystemControl::cmdSleepStats,  "",     NULL, NULL},
+            {WDTSTATS,      &SystemControl::cmdWdtStats,    "[i",   NULL, NULL},
+            {HELP,          &SystemControl::cmdHelp,        "",     NULL, NULL}
+        };
+        if (!commands.build(list, sizeof(list) / sizeof(list[0])))
+            DEBUGPORT.println("No perfect hash for the command table, using a linear search.");
+    }
+
+    // Command handlers, arguments are checked against the table schema
+
+    void cmdConfig(CommandArgs & args, Stream * in) {
+        if (args.has(0)) {
+            cfg.parseConfigCommand(args.getString(0), in);
+        }
+        else {
+            char timeString[64];
+            getTimeString(timeString);
+            cfg.printConfig(in, timeString);
+        }
+    }
+
+    /** PORTPASS,port[,idle s[,bytes]], 0 for no limit */
+    void cmdPortPass(CommandArgs & args, Stream * in) {
+        if (args.editor == NULL) {
+            in->print("\r\nPORTPASS needs a command prompt");
+            return;
+        }
+        doPortPass(args.editor, args.getInt(0), args.getInt(1) * 1000, args.getInt(2));
+    }
+
+    void cmdLoadSeq(CommandArgs & args, Stream * in) {
+        int num = args.getInt(0);
+        if (args.editor == NULL) {
+            in->print("\r\nLOADSEQ needs a command prompt");
+            return;
+        }
+        if (num >= 0 && num < MAX_MACROS) {
+            _seq[num].start_load();
+            args.editor->load(num);
+        }
+    }
+
+    void cmdRunSeq(CommandArgs & args, Stream * in) {
+        int num = args.getInt(0);
+        if (num >= 0 && num < MAX_MACROS) {
+            _taskWatchdog.enter(TASK_SEQUENCE);
+            _seq[num].run_sequence(0,_seq[num].getIdx());
+            _taskWatchdog.leave();
+        }
+    }
+
+    void cmdSetTime(CommandArgs & args, Stream * in) {
+        setTime(args.getString(0), in);
+    }
+
+    void cmdWriteConfig(CommandArgs & args, Stream * in) {
+        writeConfig();
+    }
+
+    void cmdReadConfig(CommandArgs & args, Stream * in) {
+        readConfig();
+    }
+
+    void cmdCameraOn(CommandArgs & args, Stream * in) {
+        turnOnCamera();
+    }
+
+    void cmdCameraOff(CommandArgs & args, Stream * in) {
+        turnOffCamera();
+    }
+
+    void cmdTestFlash(CommandArgs & args, Stream * in) {
+        if (args.editor == NULL) {
+            in->print("\r\nTESTFLASH needs a command prompt");
+            return;
         }
+        testFlash();
+    }
+
+    /** GOTOSLEEP[,s], a minute or an hour per CHECKHOURLY by default */
+    void cmdGoToSleep(CommandArgs & args, Stream * in) {
+        long seconds = args.getInt(0, cfg.getInt(CHECKHOURLY) == 1 ? 3600 : 60);
+        if (seconds < 1 || !sleepFor(seconds))
+            in->print("\r\nCannot sleep with the camera on or for less than 1 s");
+    }
+
+    /** SLEEPUNTIL,YYYY-MM-DDThh:mm:ss */
+    void cmdSleepUntil(CommandArgs & args, Stream * in) {
+        DateTime dt(args.getString(0));
+        if (!dt.isValid() || !sleepUntil(dt.unixtime()))
+            in->print("\r\nNeed a future time and the camera off");
+    }
+
+    void cmdSleepStats(CommandArgs & args, Stream * in) {
+        _deepSleep.print(in);
+    }
+
+    void cmdOptotune(CommandArgs & args, Stream * in) {
+        _etl.sendCommand(args.getString(0));
     }
 
-    void doPortPass(Stream * in, char * cmd) {
-        char * rest;
-        char * num = strtok_r(cmd,",",&rest);
-        in->print("Passing through to hardware port ");
-        in->println(num);
+    /** FOCALSWEEP[,start fp,stop fp,frames], without arguments stops a running sweep */
+    void cmdFocalSweep(CommandArgs & args, Stream * in) {
+        if (!args.has(0) && _sweep.active()) {
+            _sweep.stop();
+            in->print("\r\nFocal sweep stopped after ");
+            in->print(_sweep.getTaken());
+            in->print(" frames");
+            return;
+        }
+        if (args.size() != 0 && args.size() != 3) {
+            in->print("\r\nGive start, stop and frames, or nothing for the full range");
+            return;
+        }
+        float start = args.getFloat(0, MAX_FP);
+        float stop = args.getFloat(1, MIN_FP);
+        long frames = args.getInt(2, SWEEP_DEFAULT_FRAMES);
+        if (start < MIN_FP || start > MAX_FP || stop < MIN_FP || stop > MAX_FP || frames < 2) {
+            in->print("\r\nFocal power out of range or fewer than 2 frames");
+            return;
+        }
+        if (_etl.getPort() == NULL) {
+            in->print("\r\nLens is off");
+            return;
+        }
+        _sweep.begin(&_etl, start, stop, frames);
+        char output[96];
+        sprintf(output, "\r\nFocal sweep %0.3f to %0.3f dpt in %ld frames, %0.1f s at FRAMERATE",
+            start, stop, frames, (float)frames / cfg.getInt(FRAMERATE));
+        in->print(output);
+    }
+
+    /** MOVELENS,fp[,inc], inc 0 moves in one command */
+    void cmdMoveLens(CommandArgs & args, Stream * in) {
+        _sweep.stop();
+        float num = args.getFloat(0);
+        if (num >= -2.0 && num < 3.0) {
+            _etl.move(num, args.getFloat(1, 0.05));
+        }
+    }
+
+    void cmdStepLens(CommandArgs & args, Stream * in) {
+        _sweep.stop();
+        float num = args.getFloat(0);
+        if (num >= -2.0 && num < 3.0) {
+            _etl.step(num);
+        }
+    }
+
+    void cmdCounters(CommandArgs & args, Stream * in) {
+        _counters.print(in);
+    }
+
+    void cmdStrobeStats(CommandArgs & args, Stream * in) {
+        _strobe.print(in);
+    }
+
+    void cmdStrobeReset(CommandArgs & args, Stream * in) {
+        _strobe.reset();
+    }
+
+    void cmdSDStats(CommandArgs & args, Stream * in) {
+        _sdlog.print(in);
+    }
+
+    void cmdFlashStats(CommandArgs & args, Stream * in) {
+        _flashlog.print(in);
+    }
+
+    void cmdFlashDump(CommandArgs & args, Stream * in) {
+        if (args.editor == NULL) {
+            in->print("\r\nFLASHDUMP needs a command prompt");
+            return;
+        }
+        startFlashDump(args.editor, false);
+    }
+
+    void cmdFlashDrain(CommandArgs & args, Stream * in) {
+        if (args.editor == NULL) {
+            in->print("\r\nFLASHDRAIN needs a command prompt");
+            return;
+        }
+        startFlashDump(args.editor, true);
+    }
+
+    void cmdTimeStats(CommandArgs & args, Stream * in) {
+        _timeService.print(in);
+    }
+
+    void cmdTxStats(CommandArgs & args, Stream * in) {
         in->println();
-        if (num != NULL) {
-            char portNum = *num;
-            switch (portNum) {
-                case '0':
-                    portpass(in, &HWPORT0, cfg.getInt(LOCALECHO) == 1);
-                    break;
-                case '1':
-                    portpass(in, &HWPORT1, cfg.getInt(LOCALECHO) == 1);
-                    break;
-                case '2':
-                    portpass(in, &HWPORT2, cfg.getInt(LOCALECHO) == 1);
-                    break;
-                case '3':
-                    portpass(in, &HWPORT3, cfg.getInt(LOCALECHO) == 1);
-                    break;
+        _txUI1.printStats(in);
+        _txUI2.printStats(in);
+        _txDebug.printStats(in);
+    }
+
+    void cmdClearFault(CommandArgs & args, Stream * in) {
+        clearPowerFault();
+    }
+
+    void cmdCTDClock(CommandArgs & args, Stream * in) {
+        printCTDClock(in);
+    }
+
+    void cmdResetOpto(CommandArgs & args, Stream * in) {
+        sendBreak();
+    }
+
+    void cmdOptoStats(CommandArgs & args, Stream * in) {
+        _etl.print(in);
+    }
+
+    /** FOCUS[,um], FOCUSPOS when no distance is given */
+    void cmdFocus(CommandArgs & args, Stream * in) {
+        _sweep.stop();
+        if (!focusLens(args.getInt(0, cfg.getInt(FOCUSPOS))))
+            in->print("\r\nNo focus calibration, add points with FOCUSPOINT");
+    }
+
+    void cmdFocusCal(CommandArgs & args, Stream * in) {
+        _focusCal.print(in);
+    }
+
+    /** FOCUSPOINT,um[,fp], without fp the lens is at the sharp focus for um */
+    void cmdFocusPoint(CommandArgs & args, Stream * in) {
+        long distance = args.getInt(0);
+        if (distance < cfg.getIntMin(FOCUSPOS) || distance > cfg.getIntMax(FOCUSPOS)) {
+            in->print("\r\nDistance out of the FOCUSPOS range");
+            return;
+        }
+        float power = args.getFloat(1, _etl.getPosition());
+        if (!args.has(1) && (_etl.getPort() == NULL || _etl.busy())) {
+            in->print("\r\nLens is off or moving");
+            return;
+        }
+        if (power < MIN_FP || power > MAX_FP) {
+            in->print("\r\nFocal power out of range");
+            return;
+        }
+        if (!_focusCal.addPoint(distance, power))
+            in->print("\r\nFocus calibration is full");
+        _focusCal.print(in);
+    }
+
+    /** FOCUSTEMP,reference C,dpt per C */
+    void cmdFocusTemp(CommandArgs & args, Stream * in) {
+        _focusCal.setTempModel(lround(args.getFloat(0) * 100), args.getFloat(1));
+        _focusCal.print(in);
+    }
+
+    void cmdFocusClear(CommandArgs & args, Stream * in) {
+        _focusCal.clear();
+    }
+
+    void cmdFocusSave(CommandArgs & args, Stream * in) {
+        _focusCal.save();
+        in->print("\r\nSaving focus calibration");
+    }
+
+    /** LOOPSTATS[,1], 1 clears the statistics after printing them */
+    void cmdLoopStats(CommandArgs & args, Stream * in) {
+        _loopIdle.print(in);
+        if (args.getInt(0) == 1)
+            _loopIdle.clear();
+    }
+
+    /** WDTSTATS[,1], 1 clears the task statistics after printing them */
+    void cmdWdtStats(CommandArgs & args, Stream * in) {
+        _taskWatchdog.print(in);
+        if (args.getInt(0) == 1)
+            _taskWatchdog.clearStats();
+    }
+
+    void cmdLinkStats(CommandArgs & args, Stream * in) {
+        _hostlink.printStats(in);
+    }
+
+    void cmdEcho(CommandArgs & args, Stream * in) {
+        if (args.editor == NULL) {
+            in->print("\r\nECHO needs a command prompt");
+            return;
+        }
+        if (args.has(0))
+            args.editor->setEcho(args.getInt(0) > 0 ? 1 : 0);
+        in->print("\r\nEcho: ");
+        printEcho(in, args.editor->getEcho());
+    }
+
+    void cmdSessions(CommandArgs & args, Stream * in) {
+        const char * modes[] = {"idle", "prompt", "set", "question", "load"};
+        LineEditor * editors[] = {&_debugEditor, &_ui1Editor, &_ui2Editor};
+        for (int i = 0; i < 3; i++) {
+            in->print("\r\n");
+            in->print(editors[i]->getName());
+            in->print(": ");
+            if (editors[i]->getPort() == _hostlink.getPort()) {
+                in->print("host link");
+                continue;
             }
+            in->print(modes[editors[i]->getMode()]);
+            in->print(", echo ");
+            printEcho(in, editors[i]->getEcho());
+        }
+        SessionLock * locks[] = {&_sequenceLock, &_cameraLock};
+        for (int i = 0; i < 2; i++) {
+            const char * holder = locks[i]->holder(cfg.getInt(CMDTIMEOUT));
+            in->print("\r\nLock ");
+            in->print(locks[i]->getName());
+            in->print(": ");
+            in->print(holder != NULL ? holder : "free");
+        }
+        in->print("\r\nPassthrough: ");
+        in->print(_bridge.active() ? _bridge.getSession() : "none");
+    }
+
+    void printEcho(Stream * in, int echo) {
+        if (echo < 0)
+            in->print(cfg.getInt(LOCALECHO) ? "on (LOCALECHO)" : "off (LOCALECHO)");
+        else
+            in->print(echo ? "on" : "off");
+    }
+
+    /** Release every lock a session holds */
+    void releaseLocks(const char * session) {
+        _sequenceLock.release(session);
+        _cameraLock.release(session);
+    }
+
+    void cmdHelp(CommandArgs & args, Stream * in) {
+        commands.print(in);
+    }
+
+    void doPortPass(LineEditor * ed, int num, unsigned long idleTimeout, uint32_t byteLimit) {
+        Stream * in = ed->getPort();
+        Stream * port = getHwPort(num);
+        if (port == NULL || port == in || port == _hostlink.getPort()) {
+            in->print("\r\nInvalid port for passthrough");
+            return;
+        }
+        if (_bridge.active()) {
+            in->print("\r\nBUSY: passthrough in use by ");
+            in->print(_bridge.getSession());
+            return;
         }
+        in->print("\r\nPassing through to hardware port ");
+        in->print(num);
+        in->print(", Ctrl-E to end\r\n");
+        _bridge.start(in, port, ed->getName(), ed->getEcho() < 0 ? cfg.getInt(LOCALECHO) > 0 : ed->getEcho() == 1,
+            idleTimeout, byteLimit);
     }
 
     void setTime(char * timeString, Stream * ui) {
@@ -396,9 +915,11 @@ class SystemControl
             if (dt.isValid()) {
                 ui->println("\nUpdating clock...\n");
                 if (ds3231Okay) {
+                    I2CBusLock lock;
                     _ds3231.adjust(dt.unixtime());
                 }
                 _zerortc.setEpoch(dt.unixtime());
+                _timeService.reset();
             }
         }
     }
@@ -423,6 +944,21 @@ class SystemControl
         lowVoltage = false;
         badEnv = false;
         imageCounter = 0;
+        latestTemp = 0.0;
+        latestHum = 0.0;
+        latestVoltage = 0.0;
+        powerFault = false;
+        powerFaultType = FAULT_NONE;
+        powerFaultHandled = false;
+        faultTrigEnabled = 0;
+        dumpEditor = NULL;
+        dumpDrain = false;
+        dumpPage = 0;
+        dumpPages = 0;
+        alertArmed = false;
+        alertType = FAULT_NONE;
+        frameHead = 0;
+        frameTail = 0;
     }
 
     void configurePins() {
@@ -457,8 +993,15 @@ class SystemControl
 
     bool begin() {
 
+        // Report a watchdog reset and the task it caught
+        if (_taskWatchdog.begin()) {
+            _taskWatchdog.printReset(&DEBUGPORT);
+            DEBUGPORT.println();
+        }
+
         // Start RTC
         _zerortc.begin();
+        _deepSleep.begin(&_zerortc);
 
         // Start DS3231
         ds3231Okay = true;
@@ -471,6 +1014,9 @@ class SystemControl
             _zerortc.setEpoch(_ds3231.now().unixtime());
         }
 
+        // Latch the first second edge, blocks for up to a second
+        _timeService.begin(ds3231Okay ? &_ds3231 : NULL, &_zerortc);
+
         // set the startup timer
         startupTimer = _zerortc.getEpoch();
         lastPowerOffTime = _zerortc.getEpoch();
@@ -478,9 +1024,10 @@ class SystemControl
         lastDepthCheck = _zerortc.getEpoch();
         voltageTimer = _zerortc.getEpoch();
         envTimer = _zerortc.getEpoch();
-        clockSyncTimer = _zerortc.getEpoch();
+        logTimer = millis();
 
         lastDepth = -10.0;
+        memset(&lastStatus, 0, sizeof(lastStatus));
 
         systemOkay = true;
         if (_flash.initialize()) {
@@ -494,30 +1041,38 @@ class SystemControl
             DEBUGPORT.println(_flash.readDeviceId(), HEX);
         }
 
+        // Restore lifetime counters
+        _counters.begin();
+
+        // Load the focus calibration
+        _focusCal.begin();
+
+        // Find the flash log read and write pointers
+        _flashlog.begin();
+
         // Start sensors
         _sensors.begin();
 
         // Initialize sequences
         for (int i = 0; i < MAX_MACROS; i++) {
-            _seq[i].init(&cfg, &_etl);
+            _seq[i].init(&cfg, &_etl, &_focusCal);
         }
+
+        buildCommands();
             
         return true;
 
     }
 
     void configWatchdog() {
-        // enable hardware watchdog if requested
-        if (cfg.getInt(WATCHDOG) > 0) {
-            _watchdog.setup(WDT_HARDCYCLE8S);
-        }
+        // enable hardware watchdog if requested, tasks are timed either way
+        _taskWatchdog.start(cfg.getInt(WATCHDOG) > 0);
     }
 
-    void clearWatchdog() {
-        // clear watchdog timer if requested
-        if (cfg.getInt(WATCHDOG) > 0) {
-            _watchdog.clear();
-        }
+    /** Start of a loop pass, the hardware watchdog is cleared if no task is overdue */
+    void feedWatchdog() {
+        _taskWatchdog.run(TASK_LOOP);
+        _taskWatchdog.feed();
     }
 
     bool turnOnCamera() {
@@ -532,6 +1087,9 @@ class SystemControl
             // Setup ETL after opening hardware serial port
             _etl.setPort(&HWPORT3);
 
+            // Straight to the working distance, no sweep
+            focusLens(cfg.getInt(FOCUSPOS));
+
             lastPowerOnTime = _zerortc.getEpoch();
             return true;
         }
@@ -540,10 +1098,18 @@ class SystemControl
         }
     }
 
-    bool turnOffCamera() {
-        if (_zerortc.getEpoch() - lastPowerOnTime > (unsigned int)cfg.getInt(CAMGUARD) && cameraOn) {
+    /**
+     * @brief Cut camera and strobe power
+     *
+     * @param force Skip the CAMGUARD time since power on, after a shutdown
+     */
+    bool turnOffCamera(bool force = false) {
+        if ((force || _zerortc.getEpoch() - lastPowerOnTime > (unsigned int)cfg.getInt(CAMGUARD)) && cameraOn) {
             DEBUGPORT.println("Turning OFF camera power...");
             cameraOn = false;
+            pendingPowerOff = false;
+            _sweep.stop();
+            _etl.setPort(NULL);
             digitalWrite(LED1_EN, LOW);
             digitalWrite(LED2_EN, LOW);
             lastPowerOffTime = _zerortc.getEpoch();
@@ -554,60 +1120,394 @@ class SystemControl
         }
     }
 
+    void configureInstruments() {
+        // Bind the selected instrument type to the CTD port, unbind the rest
+        Stream * port = getHwPort(cfg.getInt(CTDPORT));
+        int ctdType = cfg.getInt(CTDTYPE);
+        _rbr.setPort(ctdType == 0 ? port : NULL);
+        _sbe39.setPort(ctdType == 1 ? port : NULL);
+    }
+
+    /** YYYY-MM-DD hh:mm:ss.mmm from the cached time base, no I2C */
     void getTimeString(char * timeString) {
-        
-        sprintf(timeString,"%s","YYYY-MM-DD hh:mm:ss");
-        if (ds3231Okay) {
-            DateTime now = _ds3231.now();
-            now.toString(timeString);
-        }
-        else {
-            sprintf(timeString, "%04d-%02d-%02d %02d:%02d:%02d", 
-                _zerortc.getYear(),
-                _zerortc.getMonth(),
-                _zerortc.getDay(),
-                _zerortc.getHours(),
-                _zerortc.getMinutes(),
-                _zerortc.getSeconds()
-            );
-        }
+        _timeService.timeString(timeString);
+    }
+
+    /** Fold the latest sensor results into the log window */
+    void addLogEnv() {
+        logTemp.update(_sensors.tempRaw * 10);
+        logPressure.update(fixedRoundQ(_sensors.pressureRaw, 8, 0));
+        logHum.update(fixedRoundQ(_sensors.humidityRaw, 10, 2));
+    }
+
+    void addLogPower() {
+        // INA260_LSB is 5/4 mV
+        logVoltage.update(fixedDivRound(_sensors.voltageRaw[0] * 5, 4));
+        logPower.update(_sensors.powerRaw[0] * INA260_POWER_LSB);
     }
 
     bool update() {
 
         // Run updates and check for new data
+        pumpTxQueues();
+        _timeService.update(cfg.getInt(TIMESYNC), !_sensors.isPaused());
+        // Each subsystem runs as its own watchdog task
+        _taskWatchdog.run(TASK_SENSORS);
         _sensors.update();
+        _strobe.update(powerState() == STATE_IMAGING, cfg.getInt(STROBECHECK), cfg.getInt(STROBEALARM),
+            cfg.getInt(IMAGINGMODE), _sensors.voltage[0]);
+        // A passthrough session to the CTD talks to it directly
+        _taskWatchdog.run(TASK_CTD);
+        if (!_bridge.owns(getHwPort(cfg.getInt(CTDPORT))))
+            pollInstruments(INSTRUMENTS);
+        updateCTDTime(_rbr);
+        updateCTDTime(_sbe39);
+        tagFrames();
+        _taskWatchdog.run(TASK_LENS);
+        if (_sweep.update(&_etl))
+            DEBUGPORT.println("Focal sweep done");
+        if (!_bridge.owns(_etl.getPort()))
+            _etl.update();
+        _taskWatchdog.run(TASK_STORAGE);
+        _focusCal.update();
+        _counters.update(cfg.getInt(COUNTERINTERVAL));
+        updateSDLog();
+        updateFlashDump();
+        _taskWatchdog.run(TASK_LOOP);
+
+        // Fold every new sensor result into the log window
+        if (_sensors.newLogEnv) {
+            _sensors.newLogEnv = false;
+            addLogEnv();
+            _focusCal.setTemperature(_sensors.tempRaw);
+        }
+        if (_sensors.newLogPower) {
+            _sensors.newLogPower = false;
+            addLogPower();
+            _loopIdle.addCurrent(cfg.getInt(LOOPIDLE) == 1, powerState(), _sensors.current[0]);
+        }
 
-        // Build log string and send to UIs
-        char output[256];
+        unsigned long logInt = cfg.getInt(LOGINT);
+        if (millis() - logTimer < logInt)
+            return false;
 
-        char timeString[64];
-        getTimeString(timeString);
+        // Keep the cadence unless we fell more than a whole interval behind
+        logTimer += logInt;
+        if (millis() - logTimer >= logInt)
+            logTimer = millis();
 
+        // With an interval shorter than a conversion report the last values
+        if (logTemp.count() == 0)
+            addLogEnv();
+        if (logVoltage.count() == 0)
+            addLogPower();
 
+        int logFormat = cfg.getInt(LOGFORMAT);
 
-        // The system log string, note this requires enabling printf_float build
-        // option work show any output for floating point values
-        sprintf(output, "%s,%s.%03u,%0.3f,%0.3f,%0.2f,%0.2f,%0.2f,%d",
+        if (logFormat != LOGFORMAT_BINARY_ONLY) {
+            // Build log string and send to UIs
+            char output[256];
 
-            LOG_PROMPT,
-            timeString,
-            ((unsigned int) millis()) % 1000,
-            _sensors.temperature, // In C
-            _sensors.pressure / 1000.0, // in kPa
-            _sensors.humidity, // in %
-            _sensors.voltage[0] / 1000.0, // In Volts
-            _sensors.power[0] / 1000.0, // in W
-            int(cameraOn)
-            
-        );
+            char timeString[64];
+            getTimeString(timeString);
+
+            // The system log string. Window means are in the original fields,
+            // the min/max pairs are appended so existing parsers keep working.
+            // Voltage and power keep the two decimals of the old float format.
+            FixedFormat f(output, sizeof(output));
+            f.str(LOG_PROMPT).sep().str(timeString);
+            f.sep().fixed(logTemp.mean(), 3);           // in C
+            f.sep().fixed(logPressure.mean(), 3);       // in kPa
+            f.sep().fixed(logHum.mean(), 2);            // in %
+            f.sep().fixed(fixedDivRound(logVoltage.mean(), 10), 2);  // in V
+            f.sep().fixed(fixedDivRound(logPower.mean(), 10), 2);    // in W
+            f.sep().i32(cameraOn);
+            f.sep().fixed(logTemp.min(), 3).sep().fixed(logTemp.max(), 3);
+            f.sep().fixed(logPressure.min(), 3).sep().fixed(logPressure.max(), 3);
+            f.sep().fixed(logHum.min(), 2).sep().fixed(logHum.max(), 2);
+            f.sep().fixed(fixedDivRound(logVoltage.min(), 10), 2).sep().fixed(fixedDivRound(logVoltage.max(), 10), 2);
+            f.sep().fixed(fixedDivRound(logPower.min(), 10), 2).sep().fixed(fixedDivRound(logPower.max(), 10), 2);
+
+            // Send output
+            printAllPorts(output);
+            if (logFormat == LOGFORMAT_TEXT)
+                logLine(output);
+        }
 
-        // Send output
-        printAllPorts(output);
+        fillStatusRecord(lastStatus);
+        if (logFormat != LOGFORMAT_TEXT)
+            logRecord(BINLOG_TYPE_PCTL, &lastStatus, sizeof(lastStatus));
+        _hostlink.telemetry(BINLOG_TYPE_PCTL, &lastStatus, sizeof(lastStatus));
+
+        logTemp.clear();
+        logPressure.clear();
+        logHum.clear();
+        logVoltage.clear();
+        logPower.clear();
 
         return true;
     }
 
+    /** Binary form of the current log window */
+    void fillStatusRecord(BinaryPctlRecord & r) {
+        uint32_t epoch, us;
+        _timeService.now(&epoch, &us);
+        r.epoch = epoch;
+        r.millis = us / 1000;
+        r.flags = (cameraOn ? BINLOG_FLAG_CAMERA : 0)
+            | (powerFault ? BINLOG_FLAG_POWERFAULT : 0)
+            | (_strobe.alarm() ? BINLOG_FLAG_STROBEALARM : 0);
+
+        // The windows already hold the record units, except 0.001 C and mW
+        int32_t temp[3] = {logTemp.mean(), logTemp.min(), logTemp.max()};
+        int32_t pressure[3] = {logPressure.mean(), logPressure.min(), logPressure.max()};
+        int32_t hum[3] = {logHum.mean(), logHum.min(), logHum.max()};
+        int32_t voltage[3] = {logVoltage.mean(), logVoltage.min(), logVoltage.max()};
+        int32_t power[3] = {logPower.mean(), logPower.min(), logPower.max()};
+        for (int i = 0; i < 3; i++) {
+            r.temp[i] = binlogClamp(fixedDivRound(temp[i], 10), BINLOG_NULL_I16 + 1, INT16_MAX);
+            r.pressure[i] = binlogClamp(pressure[i], 0, INT32_MAX);
+            r.humidity[i] = binlogClamp(hum[i], 0, UINT16_MAX);
+            r.voltage[i] = binlogClamp(voltage[i], 0, UINT16_MAX);
+            r.power[i] = binlogClamp(fixedDivRound(power[i], 10), 0, UINT16_MAX);
+        }
+    }
+
+    /** Sleep until the next tick or interrupt, unless input already came in */
+    void idle() {
+        _loopIdle.idle(cfg.getInt(LOOPIDLE) == 1 && !inputWaiting());
+    }
+
+    bool inputWaiting() {
+        if (DEBUGPORT.available() > 0 || UI1.available() > 0 || UI2.available() > 0)
+            return true;
+        for (int i = 0; i < 4; i++) {
+            Stream * port = getHwPort(i);
+            if (port != NULL && port->available() > 0)
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Jump the lens to the focal power that focuses at a distance
+     *
+     * @param distance Object distance in um
+     * @return false without a focus calibration
+     */
+    bool focusLens(int32_t distance) {
+        float power;
+        if (!_focusCal.focalPower(distance, &power))
+            return false;
+        _etl.move(power, 0.0);
+        return true;
+    }
+
+    void configureOptotune() {
+        _etl.setTiming(cfg.getInt(OPTOTIMEOUT), cfg.getInt(OPTORETRIES), cfg.getInt(OPTOTICK));
+        // A lens wait must see a reply or give up on a command in this time
+        _taskWatchdog.setDeadline(TASK_LENS, cfg.getInt(OPTOTIMEOUT) * (cfg.getInt(OPTORETRIES) + 1) + 2 * OPTO_START_DELAY);
+    }
+
+    void configureHostLink() {
+        _hostlink.setPort(getHwPort(cfg.getInt(LINKPORT)));
+    }
+
+    void configureTxQueues() {
+        _txUI1.setPolicy(cfg.getInt(UI1TXPOLICY));
+        _txUI2.setPolicy(cfg.getInt(UI2TXPOLICY));
+        _txDebug.setPolicy(cfg.getInt(USBTXPOLICY));
+    }
+
+    void configureSDLog() {
+        _sdlog.setBinary(cfg.getInt(LOGFORMAT) != LOGFORMAT_TEXT);
+        _flashLogEnabled = cfg.getInt(SDLOG) == 1 && cfg.getInt(FLASHLOG) == 1;
+        if (cfg.getInt(SDLOG) == 1) {
+            if (!_sdlog.isInitialized() && !_sdlog.SdCardInit(&_zerortc))
+                DEBUGPORT.println("SD card not found or failed to mount");
+            setInstrumentsLineCallback(logInstrumentLine, INSTRUMENTS);
+        }
+        else {
+            setInstrumentsLineCallback(NULL, INSTRUMENTS);
+            _sdlog.end();
+        }
+        sdDetectTimer = millis();
+    }
+
+    void updateSDLog() {
+        if (cfg.getInt(SDLOG) == 1 && millis() - sdDetectTimer >= SD_DETECT_INTERVAL) {
+            sdDetectTimer = millis();
+            // Follow card removal and insertion
+            bool present = _sdlog.SDCardPresent();
+            if (!present && _sdlog.isInitialized())
+                _sdlog.end();
+            else if (present && !_sdlog.isInitialized())
+                _sdlog.SdCardInit(&_zerortc);
+        }
+        _sdlog.update();
+
+        // Move flash log pages to the card once it is back
+        if (_flashLogEnabled || !_flashlog.empty()) {
+            bool sdReady = _sdlog.isInitialized();
+            _flashlog.update(sdReady);
+            if (sdReady && _sdlog.capacity() >= FLASH_PAGE_SIZE) {
+                _flashlog.drain([](uint8_t type, const uint8_t * payload, uint8_t len) {
+                    if (type == BINLOG_TYPE_TEXT) {
+                        char line[256];
+                        memcpy(line, payload, len);
+                        line[len] = '\0';
+                        _sdlog.writeLine(line);
+                    }
+                    else {
+                        _sdlog.writeRecord(type, payload, len);
+                    }
+                });
+            }
+        }
+    }
+
+    /**
+     * @brief Start sending the waiting flash log pages to a session
+     *
+     * FLASHDUMP leaves the pages waiting for the SD card, FLASHDRAIN marks
+     * each one drained after writing it. updateFlashDump() sends one page
+     * per loop pass and the session prompt comes back at the end.
+     */
+    void startFlashDump(LineEditor * ed, bool drain) {
+        Stream * in = ed->getPort();
+        if (dumpEditor != NULL) {
+            in->print("\r\nBUSY: flash log dump in use by ");
+            in->print(dumpEditor->getName());
+            return;
+        }
+        in->print("\r\n");
+        in->print(drain ? "Draining " : "Dumping ");
+        in->print(_flashlog.pending());
+        in->print(" flash log pages, Ctrl-E to stop\r\n");
+        dumpEditor = ed;
+        dumpDrain = drain;
+        dumpPage = _flashlog.oldest();
+        dumpPages = 0;
+    }
+
+    void endFlashDump(const char * reason) {
+        if (dumpEditor == NULL)
+            return;
+        Stream * ui = dumpEditor->getPort();
+        ui->print("\r\nFlash log dump ");
+        ui->print(reason);
+        ui->print(", ");
+        ui->print(dumpPages);
+        ui->print(dumpDrain ? " pages drained, " : " pages sent, ");
+        ui->print(_flashlog.pending());
+        ui->print(" waiting");
+        LineEditor * ed = dumpEditor;
+        dumpEditor = NULL;
+        ed->open(LINE_COMMAND);
+    }
+
+    /** Send one flash log page to the dump session, text as is and binary as hex */
+    void updateFlashDump() {
+        if (dumpEditor == NULL)
+            return;
+        Stream * ui = dumpEditor->getPort();
+        while (ui->available() > 0) {
+            if (ui->read() == PORT_BREAK_CHAR) {
+                endFlashDump("stopped");
+                return;
+            }
+        }
+
+        // The SD card drain or a full ring may have moved past a read only dump
+        if ((int32_t)(dumpPage - _flashlog.oldest()) < 0)
+            dumpPage = _flashlog.oldest();
+        if (dumpDrain ? _flashlog.pending() == 0 : dumpPage - _flashlog.oldest() >= _flashlog.pending()) {
+            endFlashDump("done");
+            return;
+        }
+        if (_flash.busy())
+            return;
+
+        auto sink = [ui](uint8_t type, const uint8_t * payload, uint8_t len) {
+            if (type == BINLOG_TYPE_TEXT) {
+                ui->write(payload, len);
+                ui->println();
+                return;
+            }
+            char line[8 + 2 * 255];
+            FixedFormat f(line, sizeof(line));
+            f.str("$BIN,").u32(type).sep();
+            for (int i = 0; i < len; i++)
+                f.hex8(payload[i]);
+            ui->println(line);
+        };
+        _taskWatchdog.enter(TASK_FLASHDUMP);
+        // A page that fails its CRC is passed over either way
+        if (dumpDrain)
+            dumpPages += _flashlog.drain(sink);
+        else
+            dumpPages += _flashlog.read(dumpPage++, sink);
+        _taskWatchdog.leave();
+    }
+
+    template <class I>
+    void updateCTDTime(I & instrument) {
+        if (instrument.haveNewData()) {
+            _ctdTime.addSample(instrument.lastSample(), _zerortc.getEpoch());
+            instrument.invalidateData();
+        }
+    }
+
+    void tagFrames() {
+        // Emit depth and temperature interpolated at each queued trigger
+        while (frameTail != frameHead) {
+            unsigned int i = frameTail % FRAME_QUEUE_SIZE;
+            unsigned long t = frameMicros[i];
+            float dBar = 0.0, temp = 0.0;
+            int res = _ctdTime.interpolate(t, &dBar, &temp);
+            if (res == TIMEBASE_PENDING && micros() - t < FRAME_TAG_TIMEOUT)
+                break; // wait for the next CTD record
+            // Sweep frames go out without CTD data too, for their focal power
+            bool tagged = res == TIMEBASE_OK;
+            if (tagged || frameSwept[i]) {
+                char output[64];
+                FixedFormat f(output, sizeof(output));
+                f.str(FRAME_PROMPT).sep().u32(frameNumber[i]).sep();
+                if (tagged)
+                    f.fixedf(dBar, 3).sep().fixedf(temp, 4);
+                else
+                    f.sep();
+                f.sep();
+                if (frameFocus[i] != FRAME_NO_FOCUS)
+                    f.fixed(frameFocus[i], 3);
+                if (cfg.getInt(FRAMETAGS) == 1 || frameSwept[i])
+                    printAllPorts(output);
+                BinaryFrameRecord r;
+                r.frame = frameNumber[i];
+                r.pressure = tagged ? binlogFixed(dBar, 1000, BINLOG_NULL_I32 + 1, INT32_MAX) : BINLOG_NULL_I32;
+                r.temp = tagged ? binlogFixed(temp, 10000, BINLOG_NULL_I32 + 1, INT32_MAX) : BINLOG_NULL_I32;
+                r.focalPower = frameFocus[i];
+                if (_sdlog.isBinary())
+                    logRecord(BINLOG_TYPE_FRAME, &r, sizeof(r));
+                else
+                    logLine(output);
+                _hostlink.telemetry(BINLOG_TYPE_FRAME, &r, sizeof(r));
+            }
+            frameTail++;
+        }
+    }
+
+    void printCTDClock(Stream * ui) {
+        char output[96];
+        sprintf(output, "\r\nCTD samples: %d, offset: %0.3f s, drift: %0.1f ppm, latency: %0.3f s",
+            _ctdTime.samples(),
+            _ctdTime.clockOffset(),
+            _ctdTime.clockDrift(),
+            _ctdTime.latency()
+        );
+        ui->print(output);
+    }
+
     void writeConfig() {
         if (systemOkay) {
             cfg.writeConfig();
@@ -620,22 +1520,31 @@ class SystemControl
     }
 
     void checkInput() {
-        if (DEBUGPORT.available() > 0) {
-            readInput(&DEBUGPORT);
-        }
-        if (UI1.available() > 0) {
-            _rbr.disableEcho();
-            readInput(&UI1);
-        }
-        if (UI2.available() > 0) {
-            _rbr.disableEcho();
-            readInput(&UI2);
+        _taskWatchdog.run(TASK_INPUT);
+
+        // Back to the prompt of the session that started a passthrough
+        Stream * bridgeUser = _bridge.getUser();
+        if (!_bridge.update()) {
+            LineEditor * editors[] = {&_debugEditor, &_ui1Editor, &_ui2Editor};
+            for (int i = 0; i < 3; i++) {
+                if (editors[i]->getPort() == bridgeUser)
+                    editors[i]->open(LINE_COMMAND);
+            }
         }
+        while (_hostlink.poll())
+            runPacket();
+        readInput(_debugEditor);
+        readInput(_ui1Editor);
+        readInput(_ui2Editor);
+        _taskWatchdog.run(TASK_LOOP);
     }
 
     void checkCameraPower() {
-
-
+        // The Jetson had SHUTDOWNWAIT to shut down, cut its power and the strobes
+        if (pendingPowerOff && _zerortc.getEpoch() - pendingPowerOffTimer >= (unsigned int)cfg.getInt(SHUTDOWNWAIT)) {
+            pendingPowerOff = false;
+            turnOffCamera(true);
+        }
     }
 
     void checkEnv() {
@@ -643,10 +1552,12 @@ class SystemControl
             return;
 
 
-        // Update moving average of temperature
-        float latestTemp = avgTemp.update(_sensors.temperature);
-        float latestHum = avgHum.update(_sensors.humidity);
-        //float latestVoltage = _sensors.voltage[0];
+        // Update moving average of temperature with each new reading
+        if (_sensors.newEnv) {
+            latestTemp = avgTemp.update(_sensors.temperature);
+            latestHum = avgHum.update(_sensors.humidity);
+            _sensors.newEnv = false;
+        }
 
         // Make sure this check happens AFTER updating the average measurement, otherwise
         // the average will not be calculated properly
@@ -658,7 +1569,9 @@ class SystemControl
 
         if (latestTemp > cfg.getInt(TEMPLIMIT)) {
             char output[64];
-            sprintf(output,"Temperature %0.2f C exceeds limit of %0.2f C", latestTemp, (float)cfg.getInt(TEMPLIMIT));
+            FixedFormat f(output, sizeof(output));
+            f.str("Temperature ").fixed(avgTemp.fixedMean(), 2);
+            f.str(" C exceeds limit of ").fixed(cfg.getInt(TEMPLIMIT) * 100L, 2).str(" C");
             printAllPorts(output);
             badEnv = true;
             if (cameraOn) {
@@ -669,7 +1582,9 @@ class SystemControl
 
         if (latestHum > cfg.getInt(HUMLIMIT)) {
             char output[64];
-            sprintf(output,"Humidity %0.2f %% exceeds limit of %0.2f %%", latestHum, (float)cfg.getInt(HUMLIMIT));
+            FixedFormat f(output, sizeof(output));
+            f.str("Humidity ").fixed(avgHum.fixedMean(), 2);
+            f.str(" % exceeds limit of ").fixed(cfg.getInt(HUMLIMIT) * 100L, 2).str(" %");
             printAllPorts(output);
             badEnv = true;
             if (cameraOn) {
@@ -684,12 +1599,29 @@ class SystemControl
 
     void checkVoltage() {
 
-        if (_zerortc.getEpoch() - startupTimer <= (unsigned int)cfg.getInt(STARTUPTIME))
-            return;
+        bool starting = _zerortc.getEpoch() - startupTimer <= (unsigned int)cfg.getInt(STARTUPTIME);
+
+        if (_sensors.newPower) {
+            _sensors.newPower = false;
 
-        // Update moving average of voltage
-        float latestVoltage = avgVoltage.update(_sensors.voltage[0]);
-        //float latestVoltage = _sensors.voltage[0];
+            // Check every new INA260 result against the limits, the ALERT pin
+            // only covers one of them
+            if (!powerFault) {
+                if (_sensors.voltage[0] >= USB_POWER_VOLTAGE && _sensors.voltage[0] < cfg.getInt(LOWVOLTAGE))
+                    setPowerFault(FAULT_UNDERVOLTAGE);
+                else if (_sensors.current[0] > cfg.getInt(CURRENTLIMIT))
+                    setPowerFault(FAULT_OVERCURRENT);
+            }
+
+            _counters.addPower(powerState(), _sensors.power[0]);
+
+            // Update moving average of voltage with each new reading, for logging
+            if (!starting)
+                latestVoltage = avgVoltage.update(_sensors.voltage[0]);
+        }
+
+        if (starting)
+            return;
 
         // Make sure this check happens AFTER updating the average measurement, otherwise
         // the average will not be calculated properly
@@ -699,47 +1631,207 @@ class SystemControl
         // Reset check timer
         voltageTimer = _zerortc.getEpoch();
 
-        if (latestVoltage < 6000.0) {
+        if (latestVoltage < USB_POWER_VOLTAGE) {
             // likely on USB power, note voltage is in mV
             return;
         }
 
-        // If battery voltage is too low, notify and sleep
-        // If the camera is running at this point, shut it down first
+        // If the average battery voltage is low, notify and sleep. Shutting
+        // down the camera is handled immediately by checkPowerFault()
         if (latestVoltage < cfg.getInt(LOWVOLTAGE)) {
-            char output[256];
-            sprintf(output,"Voltage %f below threshold %d", latestVoltage, cfg.getInt(LOWVOLTAGE));
+            char output[64];
+            FixedFormat f(output, sizeof(output));
+            f.str("Voltage ").i32(avgVoltage.fixedMean()).str(" mV below threshold ").i32(cfg.getInt(LOWVOLTAGE)).str(" mV");
             printAllPorts(output);
-            if (cameraOn) {
-                sendShutdown();
-            }
             if (cfg.getInt(STANDBY) == 1 && !cameraOn) {
                 goToSleep();
             }
         }
     }
 
-    void goToSleep() {
-        
-        printAllPorts("Going to sleep...");
-        _zerortc.setAlarmTime(0, 0, 0);
-        if (cfg.getInt(CHECKHOURLY) == 1) {
-            printAllPorts("Alarm Set for 1 Hour");
-            _zerortc.enableAlarm(RTCZero::MATCH_MMSS);
+    int powerState() {
+        if (cameraOn && cfg.getInt(TRIGENABLED) == 1 && !powerFault)
+            return STATE_IMAGING;
+        if (cameraOn)
+            return STATE_CAMERA;
+        return STATE_IDLE;
+    }
+
+    void configurePowerLimits() {
+        // Program the INA260 ALERT pin with one of the limits and arm the interrupt
+        detachInterrupt(digitalPinToInterrupt(INA260_ALERT_PIN));
+        alertArmed = false;
+
+        if (cfg.getInt(ALERTMODE) == 0) {
+            // Don't arm the undervoltage alert when running from USB
+            if (_sensors.readBusVoltage() < USB_POWER_VOLTAGE) {
+                DEBUGPORT.println("Bus voltage low, likely on USB power, ALERT not armed.");
+                return;
+            }
+            alertType = FAULT_UNDERVOLTAGE;
+            if (!_sensors.configureAlert(INA260_ALERT_UNDERVOLTAGE, cfg.getInt(LOWVOLTAGE)))
+                return;
         }
         else {
-            printAllPorts("Alarm Set for 1 Minute");
-            _zerortc.enableAlarm(RTCZero::MATCH_SS);
+            alertType = FAULT_OVERCURRENT;
+            if (!_sensors.configureAlert(INA260_ALERT_OVERCURRENT, cfg.getInt(CURRENTLIMIT)))
+                return;
         }
-        if (cfg.getInt(STANDBY) == 1) {
-            _zerortc.standbyMode();
+
+        if (!powerFault) {
+            pinMode(INA260_ALERT_PIN, INPUT_PULLUP);
+            attachInterrupt(digitalPinToInterrupt(INA260_ALERT_PIN), powerFaultCallback, FALLING);
+            alertArmed = true;
+        }
+    }
+
+    void stopImaging() {
+        // Safe to call from an interrupt, no I2C or serial
+        digitalWrite(CAMERA_TRIG, LOW);
+        digitalWrite(WHITE_FLASH_TRIG, LOW);
+        digitalWrite(UV_FLASH_TRIG, LOW);
+    }
+
+    void setPowerFault(int type) {
+        powerFaultType = type;
+        powerFault = true;
+        stopImaging();
+    }
+
+    void powerFaultISR() {
+        if (!alertArmed)
+            return;
+        // A latched alert re-asserts on every conversion, only act once
+        detachInterrupt(digitalPinToInterrupt(INA260_ALERT_PIN));
+        alertArmed = false;
+        setPowerFault(alertType);
+    }
+
+    void checkPowerFault() {
+        // Finish the protective response started by the ALERT interrupt
+        if (!powerFault || powerFaultHandled)
+            return;
+
+        powerFaultHandled = true;
+        faultTrigEnabled = cfg.getInt(TRIGENABLED);
+        cfg.set(TRIGENABLED, 0);
+        _sensors.clearAlert();
+
+        char output[96];
+        FixedFormat f(output, sizeof(output));
+        if (powerFaultType == FAULT_UNDERVOLTAGE)
+            f.str("Power fault: voltage ").fixedf(_sensors.voltage[0], 0).str(" mV below ").i32(cfg.getInt(LOWVOLTAGE)).str(" mV");
+        else
+            f.str("Power fault: current ").fixedf(_sensors.current[0], 0).str(" mA above ").i32(cfg.getInt(CURRENTLIMIT)).str(" mA");
+        printAllPorts(output);
+        if (cameraOn) {
+            // The strobes share the camera rail, it goes off once the Jetson is down
+            f.clear();
+            f.str("Triggers stopped, camera and strobe power off in ").i32(cfg.getInt(SHUTDOWNWAIT));
+            f.str(" s. Send CLEARFAULT to resume.");
+            printAllPorts(output);
+            sendShutdown();
+        }
+        else {
+            printAllPorts("Triggers stopped. Send CLEARFAULT to resume.");
+        }
+    }
+
+    /** Re-arm the protection and put TRIGENABLED back as the fault found it */
+    void clearPowerFault() {
+        if (powerFaultHandled)
+            cfg.set(TRIGENABLED, faultTrigEnabled);
+        powerFault = false;
+        powerFaultHandled = false;
+        powerFaultType = FAULT_NONE;
+        configurePowerLimits();
+    }
+
+    /** Low voltage sleep, wakes to check again after a minute or an hour */
+    void goToSleep() {
+        sleepFor(cfg.getInt(CHECKHOURLY) == 1 ? 3600 : 60);
+    }
+
+    bool sleepFor(uint32_t seconds) {
+        return sleepUntil(_zerortc.getEpoch() + seconds);
+    }
+
+    /**
+     * @brief Power down, stand by until an RTC time and come back up
+     *
+     * Peripherals go down from the outside in: the serial ports and what
+     * runs on them, the I2C sensors, then the SPI flash once the log and
+     * counters are on it. They come back in the reverse order, each after
+     * what it depends on, and the time from the alarm until the system is
+     * ready is measured.
+     *
+     * @return false if the camera is on or the time is not in the future
+     */
+    bool sleepUntil(uint32_t epoch) {
+        uint32_t now = _zerortc.getEpoch();
+        if (cameraOn || epoch <= now)
+            return false;
+
+        char output[64];
+        sprintf(output, "Going to sleep for %lu s...", (unsigned long)(epoch - now));
+        printAllPorts(output);
+        _counters.checkpoint(true);
+        _sdlog.end();
+        _bridge.stop("sleep");
+        endFlashDump("stopped for sleep");
+        _sweep.stop();
+        _txUI1.flush();
+        _txUI2.flush();
+        _txDebug.flush();
+
+        // Serial ports, the CTD and host link on them are idle from here
+        Uart * ports[] = {&HWPORT0, &HWPORT1, &HWPORT2, &HWPORT3};
+        for (int i = 0; i < 4; i++) {
+            ports[i]->flush();
+            ports[i]->end();
         }
+        // I2C sensors, the ALERT pin is meaningless with the INA260 off
+        detachInterrupt(digitalPinToInterrupt(INA260_ALERT_PIN));
+        alertArmed = false;
+        _sensors.powerDown();
+        // SPI flash
+        while (_flash.busy());
+        _flash.sleep();
+        // The watchdog would reset us in a long sleep
+        _taskWatchdog.stop();
+
+        _deepSleep.sleepUntil(epoch);
+
+        _flash.wakeup();
+        _sensors.powerUp();
+        configurePowerLimits();
+        ports[0]->begin(cfg.getInt(HWPORT0BAUD));
+        ports[1]->begin(cfg.getInt(HWPORT1BAUD));
+        ports[2]->begin(cfg.getInt(HWPORT2BAUD));
+        ports[3]->begin(cfg.getInt(HWPORT3BAUD));
+        configSerialPins();
+        _timeService.resume();
+        configureSDLog();
+        configWatchdog();
+        _deepSleep.ready();
+
+        sprintf(output, "Awake, ready in %lu us", _deepSleep.getLastReady());
+        printAllPorts(output);
+        return true;
     }
 
     void sendShutdown() {
         if (cameraOn) {
-            DEBUGPORT.println("Sending to Jetson: sudo shutdown -h now");
-            JETSONPORT.println("sudo shutdown -h now\n");
+            if (_hostlink.getPort() == &JETSONPORT) {
+                DEBUGPORT.println("Sending to Jetson: shutdown event");
+                _hostlink.event(HL_EVENT_SHUTDOWN);
+            }
+            else {
+                DEBUGPORT.println("Sending to Jetson: sudo shutdown -h now");
+                // Don't splice the command into a queued log line
+                getTxQueue(&JETSONPORT)->finishLine();
+                JETSONPORT.println("sudo shutdown -h now\n");
+            }
             pendingPowerOff = true;
             pendingPowerOffTimer = _zerortc.getEpoch();
         }
@@ -770,7 +1862,9 @@ class SystemControl
         int uv_mod = 20;
         int flashCounter = 0;
         DEBUGPORT.flush();
+        _taskWatchdog.enter(TASK_FLASHTEST);
         while (DEBUGPORT.available() <= 0) {
+            _taskWatchdog.checkIn();
             if (flashCounter % uv_mod == 0) {
                 doFlash(UV_FLASH_TRIG, 5000, 20);
             }
@@ -780,11 +1874,12 @@ class SystemControl
             flashCounter++;
             delay(50);
         }
+        _taskWatchdog.leave();
     }
 
 void triggerImage() {
 
-    if (!(cfg.getInt(TRIGENABLED) == 1)) {
+    if (!(cfg.getInt(TRIGENABLED) == 1) || powerFault) {
         return;
     }
 
@@ -793,34 +1888,39 @@ void triggerImage() {
     int uvFlashDelay = cfg.getInt(UVFLASH);
     int imagingMode = cfg.getInt(IMAGINGMODE);
 
+    int channel = CHANNEL_WHITE;
+    if (imagingMode == 1 || (imagingMode == 2 && imageCounter % 2 != 0))
+        channel = CHANNEL_UV;
+    int flashPin = channel == CHANNEL_UV ? UV_FLASH_TRIG : WHITE_FLASH_TRIG;
+    int flashDelay = channel == CHANNEL_UV ? uvFlashDelay : whiteFlashDelay;
+
     digitalWrite(CAMERA_TRIG,HIGH);
-    delayMicroseconds(300);
-    switch(imagingMode) {
-        case 0:
-            digitalWrite(WHITE_FLASH_TRIG,HIGH);
-            delayMicroseconds(whiteFlashDelay);
-            digitalWrite(WHITE_FLASH_TRIG,LOW);
-            break;
-        case 1:
-            digitalWrite(UV_FLASH_TRIG,HIGH);
-            delayMicroseconds(uvFlashDelay);
-            digitalWrite(UV_FLASH_TRIG,LOW);
-            break;
-        case 2:
-            if (imageCounter % 2 == 0) {
-                digitalWrite(WHITE_FLASH_TRIG,HIGH);
-                delayMicroseconds(whiteFlashDelay);
-                digitalWrite(WHITE_FLASH_TRIG,LOW);
-            }
-            else {
-                digitalWrite(UV_FLASH_TRIG,HIGH);
-                delayMicroseconds(uvFlashDelay);
-                digitalWrite(UV_FLASH_TRIG,LOW);
-            }
-            break;
+    unsigned long exposureStart = micros();
+    float focus = _etl.getPosition();
+    // Start a strobe current conversion if one is armed, within the pre flash delay
+    _strobe.trigger(channel, flashDelay);
+    unsigned long elapsed = micros() - exposureStart;
+    if (elapsed < STROBE_PRE_DELAY)
+        delayMicroseconds(STROBE_PRE_DELAY - elapsed);
+    digitalWrite(flashPin,HIGH);
+    delayMicroseconds(flashDelay);
+    digitalWrite(flashPin,LOW);
+    _counters.addFlash(channel, flashDelay);
+    digitalWrite(CAMERA_TRIG,LOW);
+
+    // The exposure is over, the sweep may move the lens on
+    bool swept = _sweep.frameTaken();
+
+    // Queue the trigger time for depth tagging, skip it if the queue is full
+    if (frameHead - frameTail < FRAME_QUEUE_SIZE) {
+        unsigned int i = frameHead % FRAME_QUEUE_SIZE;
+        frameMicros[i] = exposureStart;
+        frameNumber[i] = imageCounter;
+        frameFocus[i] = _etl.getPort() != NULL ? binlogClamp(lround(focus * 1000), FRAME_NO_FOCUS + 1, INT16_MAX) : FRAME_NO_FOCUS;
+        frameSwept[i] = swept;
+        frameHead++;
     }
     imageCounter++;
-    digitalWrite(CAMERA_TRIG,LOW);
 }   
 
 };
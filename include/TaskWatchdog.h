@@ -0,0 +1,286 @@
+/** @file TaskWatchdog.h
+ *  @brief Per task software watchdog in front of the 8 s hardware watchdog
+ *
+ *  The code that runs is always inside a named task. The phases of the
+ *  main loop (checks, input, sensors, CTD, lens, storage) replace one
+ *  another at the bottom of a small stack, and a long path such as a
+ *  sequence, a lens wait or the flash test is pushed on top of the phase
+ *  that started it and popped when it returns. Only the task on top is
+ *  timed: it must check in within its own deadline, the tasks under it are
+ *  waiting on it.
+ *
+ *  feed() clears the hardware watchdog only while the running task is
+ *  within its deadline. A task past it gets its name written to the hang
+ *  record and the hardware watchdog resets the board within 8 s. A task
+ *  that hangs without ever reaching feed() again is still named: the id of
+ *  the running task is in the record from the moment it starts.
+ *
+ *  The record lives in the .noinit RAM section that the startup code does
+ *  not clear, so it survives a watchdog reset and begin() reports it at
+ *  boot. After a power on the section holds noise, the magic and its
+ *  complement reject it.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _TASKWATCHDOG
+
+#define _TASKWATCHDOG
+
+#include <Arduino.h>
+#include <WDTZero.h>
+
+// Tasks, loop phases first
+#define TASK_LOOP 0                 /**< Power, voltage and environment checks, the log line */
+#define TASK_INPUT 1                /**< Commands from the UIs and the host link */
+#define TASK_SENSORS 2
+#define TASK_CTD 3
+#define TASK_LENS 4
+#define TASK_STORAGE 5              /**< SD log, flash log, counters and focus calibration */
+#define TASK_SEQUENCE 6
+#define TASK_FLASHTEST 7
+#define TASK_FLASHDUMP 8
+#define N_TASKS 9
+#define TASK_NONE 0xFF
+
+#define TASK_NAME_SIZE 12
+#define TASK_DEPTH 4                /**< Nesting of long paths on a loop phase */
+#define TASK_FEED_INTERVAL 500      /**< Least ms between hardware watchdog clears */
+#define TASK_RECORD_MAGIC 0x54574454    /**< "TWDT" */
+
+/** Survives a watchdog reset in .noinit RAM */
+struct TaskHangRecord {
+    uint32_t magic;
+    uint8_t running;                /**< Task on top of the stack */
+    uint8_t reserved;
+    uint16_t resets;                /**< Watchdog resets since the last power on */
+    char overdue[TASK_NAME_SIZE];   /**< Task found past its deadline, empty if none */
+    uint32_t late;                  /**< ms it was past the deadline */
+    uint32_t check;                 /**< ~magic */
+};
+
+TaskHangRecord _taskHangRecord __attribute__((section(".noinit")));
+
+class TaskWatchdog {
+
+    private:
+    struct Task {
+        const char * name;
+        unsigned long deadline;     /**< ms allowed between check ins while running */
+        unsigned long since;        /**< Last check in */
+        unsigned long maxTime;      /**< Longest ms between check ins seen */
+        uint32_t overruns;
+    };
+
+    Task tasks[N_TASKS];
+    uint8_t stack[TASK_DEPTH];
+    uint8_t depth;
+    WDTZero wdt;
+    bool enabled;
+    unsigned long lastFeed;
+    uint32_t feeds;
+    uint32_t refused;
+
+    // Last reset, from begin()
+    bool wdtReset;
+    char resetTask[TASK_NAME_SIZE];
+    bool resetOverdue;              /**< resetTask was found past its deadline */
+    uint16_t resets;
+
+    TaskHangRecord & rec() {
+        return _taskHangRecord;
+    }
+
+    void setRunning(uint8_t task) {
+        tasks[task].since = millis();
+        rec().running = task;
+    }
+
+    void lap(Task & t, unsigned long now) {
+        if (now - t.since > t.maxTime)
+            t.maxTime = now - t.since;
+        t.since = now;
+    }
+
+    public:
+
+    TaskWatchdog() {
+        const char * names[N_TASKS] = {"loop", "input", "sensors", "ctd", "lens",
+            "storage", "sequence", "flashtest", "flashdump"};
+        const unsigned long deadlines[N_TASKS] = {1000, 4000, 1000, 1000, 1000,
+            3000, 2000, 1000, 2000};
+        for (int i = 0; i < N_TASKS; i++) {
+            tasks[i].name = names[i];
+            tasks[i].deadline = deadlines[i];
+        }
+        depth = 1;
+        stack[0] = TASK_LOOP;
+        enabled = false;
+        wdtReset = false;
+        resetTask[0] = '\0';
+        resetOverdue = false;
+        resets = 0;
+        clearStats();
+    }
+
+    /**
+     * @brief Read the hang record left by the last reset and start a new one
+     *
+     * @return true if the last reset was the watchdog
+     */
+    bool begin() {
+        bool valid = rec().magic == TASK_RECORD_MAGIC && rec().check == ~(uint32_t)TASK_RECORD_MAGIC;
+        wdtReset = (PM->RCAUSE.reg & PM_RCAUSE_WDT) != 0;
+        resets = valid ? rec().resets : 0;
+        if (wdtReset) {
+            resets++;
+            resetOverdue = valid && rec().overdue[0] != '\0';
+            if (resetOverdue) {
+                strncpy(resetTask, rec().overdue, TASK_NAME_SIZE - 1);
+                resetTask[TASK_NAME_SIZE - 1] = '\0';
+            }
+            else if (valid && rec().running < N_TASKS) {
+                strcpy(resetTask, tasks[rec().running].name);
+            }
+            else {
+                strcpy(resetTask, "unknown");
+            }
+        }
+        memset(&rec(), 0, sizeof(TaskHangRecord));
+        rec().magic = TASK_RECORD_MAGIC;
+        rec().check = ~(uint32_t)TASK_RECORD_MAGIC;
+        rec().resets = resets;
+        rec().running = stack[depth - 1];
+        return wdtReset;
+    }
+
+    /** Arm the hardware watchdog or leave it off, all tasks start afresh */
+    void start(bool enable) {
+        enabled = enable;
+        wdt.setup(enable ? WDT_HARDCYCLE8S : WDT_OFF);
+        unsigned long now = millis();
+        for (int i = 0; i < N_TASKS; i++)
+            tasks[i].since = now;
+        lastFeed = now;
+    }
+
+    /** Hardware watchdog off, eg. for a standby longer than 8 s */
+    void stop() {
+        if (enabled)
+            wdt.setup(WDT_OFF);
+        enabled = false;
+    }
+
+    void setDeadline(uint8_t task, unsigned long ms) {
+        if (task < N_TASKS)
+            tasks[task].deadline = ms;
+    }
+
+    /** Switch the main loop to another phase */
+    void run(uint8_t task) {
+        lap(tasks[stack[0]], millis());
+        stack[0] = task;
+        if (depth == 1)
+            setRunning(task);
+    }
+
+    /** Start a long path on top of the running task */
+    void enter(uint8_t task) {
+        if (depth >= TASK_DEPTH)
+            return;
+        stack[depth++] = task;
+        setRunning(task);
+    }
+
+    /** Back to the task that started the long path, it resumes its deadline */
+    void leave() {
+        if (depth <= 1)
+            return;
+        lap(tasks[stack[--depth]], millis());
+        setRunning(stack[depth - 1]);
+        feed();
+    }
+
+    /** The running task made progress */
+    void checkIn() {
+        lap(tasks[stack[depth - 1]], millis());
+        feed();
+    }
+
+    /**
+     * @brief Clear the hardware watchdog if the running task is within its deadline
+     *
+     * Safe to call from any wait, the clear itself is rate limited since it
+     * waits on the slow watchdog clock domain.
+     *
+     * @return false if the task is overdue
+     */
+    bool feed() {
+        unsigned long now = millis();
+        Task & t = tasks[stack[depth - 1]];
+        if (now - t.since > t.deadline) {
+            if (rec().overdue[0] == '\0') {
+                strncpy(rec().overdue, t.name, TASK_NAME_SIZE - 1);
+                t.overruns++;
+            }
+            rec().late = now - t.since - t.deadline;
+            refused++;
+            return false;
+        }
+        rec().overdue[0] = '\0';
+        if (enabled && now - lastFeed >= TASK_FEED_INTERVAL) {
+            wdt.clear();
+            lastFeed = now;
+            feeds++;
+        }
+        return true;
+    }
+
+    bool lastResetWasWatchdog() {
+        return wdtReset;
+    }
+
+    void clearStats() {
+        for (int i = 0; i < N_TASKS; i++) {
+            tasks[i].since = millis();
+            tasks[i].maxTime = 0;
+            tasks[i].overruns = 0;
+        }
+        feeds = 0;
+        refused = 0;
+    }
+
+    /** One line on the last reset */
+    void printReset(Stream * ui) {
+        char output[96];
+        if (!wdtReset)
+            sprintf(output, "Last reset not by the watchdog, %u watchdog resets", resets);
+        else if (resetOverdue)
+            sprintf(output, "Watchdog reset, task %s overdue, %u watchdog resets", resetTask, resets);
+        else
+            sprintf(output, "Watchdog reset, hung in task %s, %u watchdog resets", resetTask, resets);
+        ui->print(output);
+    }
+
+    void print(Stream * ui) {
+        char output[96];
+        sprintf(output, "\r\nHardware watchdog %s, feeds: %lu, refused: %lu\r\n",
+            enabled ? "on" : "off", (unsigned long)feeds, (unsigned long)refused);
+        ui->print(output);
+        printReset(ui);
+        ui->print("\r\nTask       deadline ms  max ms  overruns");
+        for (int i = 0; i < N_TASKS; i++) {
+            bool running = false;
+            for (int j = 0; j < depth; j++)
+                running |= stack[j] == i;
+            sprintf(output, "\r\n%-10s %11lu %7lu %9lu%s", tasks[i].name, tasks[i].deadline,
+                tasks[i].maxTime, (unsigned long)tasks[i].overruns, running ? "  running" : "");
+            ui->print(output);
+        }
+    }
+};
+
+// Global so the waits in Utils, Optotune and Sequence can check in
+TaskWatchdog _taskWatchdog;
+
+#endif
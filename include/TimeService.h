@@ -0,0 +1,411 @@
+/** @file TimeService.h
+ *  @brief Sub-second wall clock from the DS3231 seconds and micros()
+ *
+ *  The DS3231 only counts whole seconds and every read is an I2C
+ *  transaction. The service latches the instant its seconds register
+ *  changes to micros() and from then on serves time from micros() alone:
+ *  the epoch of the latched second plus the micros() elapsed since,
+ *  corrected by the measured rate of the MCU clock against the DS3231.
+ *
+ *  There is no SQW line to the MCU so the edge is found by polling the
+ *  seconds register. At boot that blocks for up to a second, after a
+ *  standby the edge is searched for by polling instead. Every resync
+ *  interval the loop waits for the next predicted edge once it is less than
+ *  TIME_SYNC_LEAD away, then polls the register from TIME_SYNC_GUARD before
+ *  to TIME_SYNC_GUARD after it, which places the edge within the length of
+ *  one register read (~100 us at 400 kHz). An edge that is not found there
+ *  is searched for again by polling once per loop, which is coarser, and
+ *  refined at the next second.
+ *
+ *  Each resync measures the error of the prediction, the timing error of
+ *  the model, and the rate of micros() against the DS3231 over the last
+ *  interval, its drift.
+ *
+ *  Served times never go backwards: after a resync that moves the clock
+ *  back, time is held until the model catches up.
+ *
+ *  Without a DS3231 the RTCZero seconds are used the same way, without the
+ *  I2C reads.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _TIMESERVICE
+
+#define _TIMESERVICE
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <RTCZero.h>
+#include <RTCLib.h>
+#include "I2CBus.h"
+#include "FixedFormat.h"
+#include "InstrumentTimebase.h"
+
+#define DS3231_ADDR 0x68
+#define DS3231_REG_SECONDS 0x00
+#define TIME_SYNC_GUARD 2000        /**< us polled on each side of a predicted edge */
+#define TIME_SYNC_LEAD 20000        /**< us before a predicted edge a resync starts waiting for it */
+#define TIME_REBASE 1800            /**< s without an edge before the reference is moved, micros() wraps at 4294 s */
+#define TIME_BOOT_TIMEOUT 1100      /**< ms to find the first edge at boot */
+#define TIME_MAX_DRIFT 500          /**< ppm, larger measured drifts are rejected as a missed edge */
+
+/**
+ * @brief Civil date and time of seconds since 1970-01-01
+ */
+void epochToCivil(uint32_t epoch, int * year, int * month, int * day, int * hour, int * minute, int * second) {
+    // Civil from days, http://howardhinnant.github.io/date_algorithms.html
+    long days = epoch / 86400;
+    long secs = epoch % 86400;
+    *hour = secs / 3600;
+    *minute = secs / 60 % 60;
+    *second = secs % 60;
+    days += 719468;
+    long era = days / 146097;
+    unsigned long doe = (unsigned long)(days - era * 146097);
+    unsigned long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned long mp = (5 * doy + 2) / 153;
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = yoe + era * 400 + (*month <= 2);
+}
+
+class TimeService {
+
+    private:
+
+    typedef enum {
+        TIME_UNSYNCED,      /**< No edge latched yet */
+        TIME_WAIT,          /**< Serving time until the next resync */
+        TIME_COARSE         /**< Polling once per loop for an edge */
+    } TimeState;
+
+    TimeState state;
+    RTC_DS3231 * ds3231;
+    RTCZero * rtc;
+    bool useDs3231;
+
+    uint32_t edgeEpoch;         /**< Epoch of the latched second */
+    unsigned long edgeMicros;   /**< micros() at the start of that second */
+    uint32_t rateMicros;        /**< micros() elapsed over rateSeconds DS3231 seconds */
+    uint32_t rateSeconds;
+    uint32_t refEpoch;          /**< Last precise edge, the start of the next rate measurement */
+    unsigned long refMicros;
+    bool haveRef;
+    uint64_t lastServed;        /**< Last time returned by nowMicros(), us since epoch */
+    unsigned long syncTimer;    /**< millis() of the last resync */
+    int lastSeconds;            /**< Seconds register at the last coarse poll */
+    unsigned long lastPoll;     /**< micros() of the last coarse poll */
+
+    // Statistics
+    uint32_t syncs;
+    uint32_t misses;
+    long lastError;             /**< us, latched edge minus predicted edge */
+    long maxError;
+    unsigned long uncertainty;  /**< us, width of the window the last edge was found in */
+    float drift;                /**< ppm, micros() against the DS3231 */
+    bool haveDrift;
+
+    /** Seconds register of the time source, -1 on a bus error */
+    int readSeconds() {
+        if (!useDs3231)
+            return rtc->getSeconds();
+        I2CBusLock lock;
+        Wire.beginTransmission(DS3231_ADDR);
+        Wire.write((uint8_t)DS3231_REG_SECONDS);
+        if (Wire.endTransmission(false) != 0)
+            return -1;
+        if (Wire.requestFrom((uint8_t)DS3231_ADDR, (size_t)1) != 1)
+            return -1;
+        uint8_t bcd = Wire.read();
+        return (bcd >> 4) * 10 + (bcd & 0x0F);
+    }
+
+    uint32_t readEpoch() {
+        if (useDs3231) {
+            I2CBusLock lock;
+            return ds3231->now().unixtime();
+        }
+        return rtc->getEpoch();
+    }
+
+    /** micros() elapsed over n seconds of the time source */
+    unsigned long secondsToMicros(uint32_t n) {
+        return (unsigned long)((uint64_t)n * rateMicros / rateSeconds);
+    }
+
+    /**
+     * @brief Take a second edge as the new reference
+     *
+     * @param at    micros() of the edge
+     * @param width Uncertainty of the edge in us
+     */
+    void latch(unsigned long at, unsigned long width) {
+        uint32_t epoch = readEpoch();
+        bool precise = width < TIME_SYNC_GUARD;
+        uncertainty = width;
+
+        if (state != TIME_UNSYNCED && epoch > edgeEpoch) {
+            unsigned long predicted = edgeMicros + secondsToMicros(epoch - edgeEpoch);
+            lastError = (long)(at - predicted);
+            long e = lastError < 0 ? -lastError : lastError;
+            if (precise && e > maxError)
+                maxError = e;
+        }
+
+        // Rate between precise edges only, rejected if an edge was clearly wrong
+        if (precise && haveRef && epoch > refEpoch && epoch - refEpoch < TIME_REBASE) {
+            uint32_t seconds = epoch - refEpoch;
+            uint32_t elapsed = at - refMicros;
+            float ppm = (float)((int64_t)elapsed - (int64_t)seconds * 1000000) / seconds;
+            if (ppm > -TIME_MAX_DRIFT && ppm < TIME_MAX_DRIFT) {
+                rateMicros = elapsed;
+                rateSeconds = seconds;
+                drift = ppm;
+                haveDrift = true;
+            }
+        }
+        if (precise) {
+            refEpoch = epoch;
+            refMicros = at;
+            haveRef = true;
+        }
+
+        edgeEpoch = epoch;
+        edgeMicros = at;
+        state = TIME_WAIT;
+        syncs++;
+
+        // Keep the RTCZero, used for the coarse timers, on the same second
+        if (useDs3231 && rtc->getEpoch() != epoch)
+            rtc->setEpoch(epoch);
+    }
+
+    /**
+     * @brief Poll tightly around the predicted next edge
+     *
+     * Blocks for up to TIME_SYNC_LEAD + TIME_SYNC_GUARD once the edge is
+     * near, returns false right away otherwise.
+     */
+    bool fineSync() {
+        // The next edge less than TIME_SYNC_LEAD away, if any
+        unsigned long elapsed = micros() - edgeMicros + TIME_SYNC_LEAD;
+        uint32_t next = (uint32_t)((uint64_t)elapsed * rateSeconds / rateMicros);
+        unsigned long predicted = edgeMicros + secondsToMicros(next);
+        if ((long)(predicted - micros()) <= TIME_SYNC_GUARD)
+            return false;   // too close to read the old second first
+
+        while ((long)(predicted - micros()) > TIME_SYNC_GUARD)
+            ;
+
+        int before = readSeconds();
+        unsigned long prev = micros();
+        while ((long)(micros() - predicted) < TIME_SYNC_GUARD) {
+            int s = readSeconds();
+            unsigned long t = micros();
+            if (s < 0 || before < 0)
+                break;
+            if (s != before) {
+                latch(prev + (t - prev) / 2, t - prev);
+                return true;
+            }
+            prev = t;
+        }
+        // Not where the model said, fall back to polling each loop
+        misses++;
+        lastSeconds = readSeconds();
+        lastPoll = micros();
+        state = TIME_COARSE;
+        return true;
+    }
+
+    public:
+
+    TimeService() {
+        state = TIME_UNSYNCED;
+        ds3231 = NULL;
+        rtc = NULL;
+        useDs3231 = false;
+        edgeEpoch = 0;
+        edgeMicros = 0;
+        rateMicros = 1000000;
+        rateSeconds = 1;
+        haveRef = false;
+        lastServed = 0;
+        resetStats();
+    }
+
+    /**
+     * @brief Latch the first second edge, blocks for up to a second
+     *
+     * @param ds3231    DS3231 if present, else NULL
+     * @param rtc       RTCZero, used without a DS3231 and kept in step
+     */
+    void begin(RTC_DS3231 * ds3231, RTCZero * rtc) {
+        this->ds3231 = ds3231;
+        this->rtc = rtc;
+        useDs3231 = ds3231 != NULL;
+        state = TIME_UNSYNCED;
+        syncTimer = millis();
+
+        int before = readSeconds();
+        unsigned long start = millis();
+        unsigned long prev = micros();
+        while (before >= 0 && millis() - start < TIME_BOOT_TIMEOUT) {
+            int s = readSeconds();
+            unsigned long t = micros();
+            if (s != before) {
+                latch(prev + (t - prev) / 2, t - prev);
+                return;
+            }
+            prev = t;
+        }
+        // No edge, serve the source time from now on and retry in update()
+        edgeEpoch = readEpoch();
+        edgeMicros = micros();
+        lastSeconds = readSeconds();
+        lastPoll = micros();
+        state = TIME_COARSE;
+    }
+
+    /** Restart from a new time, eg. after the clock was set */
+    void reset() {
+        lastServed = 0;
+        haveRef = false;
+        begin(useDs3231 ? ds3231 : NULL, rtc);
+    }
+
+    /**
+     * @brief Carry on after a standby without blocking
+     *
+     * micros() stood still while the core slept, so the latched edge is
+     * void. Time is served from the RTCZero second, which kept counting,
+     * and update() polls for the next edge of the time source once per
+     * loop as after a missed resync. No I2C here.
+     */
+    void resume() {
+        if (rtc == NULL)
+            return;
+        edgeEpoch = rtc->getEpoch();
+        edgeMicros = micros();
+        // No rate measurement across the standby
+        haveRef = false;
+        lastSeconds = -1;
+        lastPoll = micros();
+        state = TIME_COARSE;
+    }
+
+    /**
+     * @brief Resync when due, call every loop
+     *
+     * @param interval  Seconds between resyncs
+     * @param busFree   false while another user owns the I2C bus
+     */
+    void update(int interval, bool busFree) {
+        if (rtc == NULL)
+            return;
+
+        // Without edges for a long time move the reference before micros() wraps
+        if (micros() - edgeMicros > (unsigned long)TIME_REBASE * 1000000) {
+            uint32_t n = (uint32_t)((uint64_t)(micros() - edgeMicros) * rateSeconds / rateMicros);
+            edgeEpoch += n;
+            edgeMicros += secondsToMicros(n);
+        }
+
+        if (useDs3231 && !busFree)
+            return;
+
+        switch (state) {
+            case TIME_UNSYNCED:
+                break;
+            case TIME_WAIT:
+                if (millis() - syncTimer < (unsigned long)interval * 1000)
+                    break;
+                if (fineSync())
+                    syncTimer = millis();
+                break;
+            case TIME_COARSE: {
+                int s = readSeconds();
+                unsigned long t = micros();
+                if (s >= 0 && lastSeconds >= 0 && s != lastSeconds) {
+                    latch(lastPoll + (t - lastPoll) / 2, t - lastPoll);
+                    // Refine at the next edge
+                    syncTimer = millis() - (unsigned long)interval * 1000;
+                }
+                lastSeconds = s;
+                lastPoll = t;
+                break;
+            }
+        }
+    }
+
+    /** Microseconds since 1970-01-01, never decreasing */
+    uint64_t nowMicros() {
+        unsigned long elapsed = micros() - edgeMicros;
+        uint64_t us = (uint64_t)edgeEpoch * 1000000 + (uint64_t)elapsed * rateSeconds * 1000000 / rateMicros;
+        if (us < lastServed)
+            return lastServed;
+        lastServed = us;
+        return us;
+    }
+
+    /**
+     * @brief Current time split in seconds and microseconds
+     */
+    void now(uint32_t * epoch, uint32_t * us) {
+        uint64_t t = nowMicros();
+        *epoch = (uint32_t)(t / 1000000);
+        *us = (uint32_t)(t % 1000000);
+    }
+
+    /**
+     * @brief Format the current time as YYYY-MM-DD hh:mm:ss.mmm
+     *
+     * @param buf At least 24 bytes
+     */
+    void timeString(char * buf) {
+        uint32_t epoch, us;
+        now(&epoch, &us);
+        int year, month, day, hour, minute, second;
+        epochToCivil(epoch, &year, &month, &day, &hour, &minute, &second);
+        FixedFormat f(buf, 24);
+        f.u32(year, 4).chr('-').u32(month, 2).chr('-').u32(day, 2);
+        f.chr(' ').u32(hour, 2).chr(':').u32(minute, 2).chr(':').u32(second, 2);
+        f.chr('.').u32(us / 1000, 3);
+    }
+
+    bool synced() {
+        return state != TIME_UNSYNCED;
+    }
+
+    void resetStats() {
+        syncs = 0;
+        misses = 0;
+        lastError = 0;
+        maxError = 0;
+        uncertainty = 0;
+        drift = 0.0;
+        haveDrift = false;
+    }
+
+    void print(Stream * ui) {
+        char output[96];
+        char ts[24];
+        timeString(ts);
+        ui->println();
+        sprintf(output, "Time: %s from %s, %s", ts, useDs3231 ? "DS3231" : "RTCZero",
+            state == TIME_COARSE ? "searching for a second edge" : "locked");
+        ui->println(output);
+        sprintf(output, "Resyncs: %lu, missed edges: %lu, last edge within %lu us",
+            (unsigned long)syncs, (unsigned long)misses, uncertainty);
+        ui->println(output);
+        if (haveDrift)
+            sprintf(output, "Drift: %0.1f ppm, last error: %ld us, worst error: %ld us", drift, lastError, maxError);
+        else
+            sprintf(output, "Drift: not measured yet");
+        ui->println(output);
+    }
+};
+
+#endif
@@ -0,0 +1,336 @@
+/** @file TxQueue.h
+ *  @brief Non-blocking transmit queues in front of the output ports
+ *
+ *  Telemetry used to be written straight to UI1, UI2 and USB, so the loop
+ *  waited at the pace of the slowest link once a driver buffer filled, and
+ *  for a USB host that stopped reading. Lines now go into a RAM ring per
+ *  port and pump() hands them on only as fast as availableForWrite()
+ *  reports room, so the driver never blocks. The UART driver buffers are
+ *  drained by the SERCOM data register empty interrupt as before.
+ *
+ *  pumpTxQueues() is called every loop and from yield(), which delay()
+ *  calls while it waits.
+ *
+ *  When a queue is full the port policy decides what happens: TX_BLOCK
+ *  waits for room as the direct writes did, for up to TX_BLOCK_TIMEOUT,
+ *  TX_DROP_OLDEST discards whole queued lines to make room, never the rest
+ *  of a line already being sent, and TX_DROP_NEWEST discards the line being
+ *  written. Dropped bytes and lines are counted.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#ifndef _TXQUEUE
+
+#define _TXQUEUE
+
+#include <Arduino.h>
+#include "Config.h"
+
+#define TX_QUEUE_SIZE 1024      /**< Bytes per port, power of 2 */
+#define TX_QUEUE_MASK (TX_QUEUE_SIZE - 1)
+#define TX_BLOCK_TIMEOUT 100    /**< ms any wait on a port gives up after, eg. USB host gone */
+
+typedef enum {
+    TX_BLOCK = 0,
+    TX_DROP_OLDEST = 1,
+    TX_DROP_NEWEST = 2
+} TxPolicy;
+
+class TxQueue {
+
+    private:
+    Stream * port;
+    const char * name;
+    uint8_t buffer[TX_QUEUE_SIZE];
+    uint16_t head;              /**< Next byte written */
+    uint16_t tail;              /**< Next byte sent */
+    TxPolicy policy;
+    bool atLineStart;           /**< The last byte sent ended a line */
+    bool pumping;
+    bool held;                  /**< Queue but do not send, eg. while a command prompt is open */
+    bool framed;                /**< Port carries HostLink frames, text lines are not sent */
+    uint8_t delimiter;          /**< Last byte of a line or frame */
+
+    // Statistics
+    uint32_t bytesQueued;
+    uint32_t bytesDropped;
+    uint32_t linesDropped;
+    uint16_t maxFill;
+    unsigned long blockTime;    /**< Total ms spent waiting under TX_BLOCK */
+
+    uint16_t fill() {
+        return (head - tail) & TX_QUEUE_MASK;
+    }
+
+    uint16_t space() {
+        return TX_QUEUE_MASK - fill();
+    }
+
+    /**
+     * @brief Discard the oldest queued line that has not started sending
+     *
+     * The unsent rest of a partly sent line stays at the tail and the
+     * complete line after it is cut out, so lines and frames on the wire
+     * are never spliced.
+     *
+     * @return false if there was no such line
+     */
+    bool dropOldest() {
+        uint16_t start = tail;
+        if (!atLineStart) {
+            while (start != head) {
+                uint8_t c = buffer[start];
+                start = (start + 1) & TX_QUEUE_MASK;
+                if (c == delimiter)
+                    break;
+            }
+        }
+        uint16_t end = start;
+        while (end != head) {
+            uint8_t c = buffer[end];
+            end = (end + 1) & TX_QUEUE_MASK;
+            if (c == delimiter)
+                break;
+        }
+        if (end == start)
+            return false;
+        bytesDropped += (end - start) & TX_QUEUE_MASK;
+        linesDropped++;
+
+        // Move the kept rest up against the next line
+        while (start != tail) {
+            start = (start - 1) & TX_QUEUE_MASK;
+            end = (end - 1) & TX_QUEUE_MASK;
+            buffer[end] = buffer[start];
+        }
+        tail = end;
+        return true;
+    }
+
+    /** Make room for len bytes according to the policy */
+    bool reserve(size_t len) {
+        if (len > TX_QUEUE_MASK) {
+            bytesDropped += len;
+            linesDropped++;
+            return false;
+        }
+        if (space() >= len)
+            return true;
+
+        switch (policy) {
+            case TX_BLOCK: {
+                if (held)
+                    break;
+                unsigned long start = millis();
+                while (space() < len && millis() - start < TX_BLOCK_TIMEOUT)
+                    pump();
+                blockTime += millis() - start;
+                if (space() >= len)
+                    return true;
+                break;
+            }
+            case TX_DROP_OLDEST:
+                while (space() < len) {
+                    if (!dropOldest())
+                        break;
+                }
+                if (space() >= len)
+                    return true;
+                break;
+            case TX_DROP_NEWEST:
+                break;
+        }
+        bytesDropped += len;
+        linesDropped++;
+        return false;
+    }
+
+    void copy(const uint8_t * data, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            buffer[head] = data[i];
+            head = (head + 1) & TX_QUEUE_MASK;
+        }
+        bytesQueued += len;
+        if (fill() > maxFill)
+            maxFill = fill();
+    }
+
+    public:
+
+    /**
+     * @param port  Output port, NULL discards everything
+     * @param name  Port name for printStats()
+     */
+    TxQueue(Stream * port, const char * name) {
+        this->port = port;
+        this->name = name;
+        head = 0;
+        tail = 0;
+        policy = TX_DROP_OLDEST;
+        atLineStart = true;
+        pumping = false;
+        held = false;
+        framed = false;
+        delimiter = '\n';
+        resetStats();
+    }
+
+    void setPolicy(int policy) {
+        this->policy = (TxPolicy)policy;
+    }
+
+    /**
+     * @brief Stop sending while an operator uses the port
+     *
+     * Lines keep being queued under the port policy, TX_BLOCK drops them
+     * instead of waiting. Sending resumes with the next pump() after release.
+     */
+    void hold(bool held) {
+        this->held = held;
+    }
+
+    /**
+     * @brief Queue a line and its line ending as a unit
+     *
+     * Not for use from interrupts, TX_BLOCK waits on the port.
+     *
+     * @return false if the line was dropped
+     */
+    bool writeLine(const char * line) {
+        if (framed)
+            return false;
+        size_t len = strlen(line);
+        if (!reserve(len + 2))
+            return false;
+        copy((const uint8_t *)line, len);
+        copy((const uint8_t *)"\r\n", 2);
+        return true;
+    }
+
+    /**
+     * @brief Switch the port between text lines and HostLink frames
+     *
+     * A framed port only takes writeFrame(), frames end with a 0 byte.
+     */
+    void setFramed(bool framed) {
+        this->framed = framed;
+        delimiter = framed ? 0 : '\n';
+    }
+
+    /**
+     * @brief Queue a complete frame as a unit
+     *
+     * @param frame Encoded frame including its 0 delimiter
+     * @return false if the frame was dropped
+     */
+    bool writeFrame(const uint8_t * frame, size_t len) {
+        if (!reserve(len))
+            return false;
+        copy(frame, len);
+        return true;
+    }
+
+    /**
+     * @brief Pump until len bytes fit, whatever the policy
+     *
+     * For output that must not be lost and is produced faster than the
+     * loop pumps, eg. a command reply. Gives up after TX_BLOCK_TIMEOUT.
+     */
+    bool waitForRoom(size_t len) {
+        if (space() >= len)
+            return true;
+        unsigned long start = millis();
+        while (space() < len && !held && millis() - start < TX_BLOCK_TIMEOUT)
+            pump();
+        blockTime += millis() - start;
+        return space() >= len;
+    }
+
+    /** Hand as many queued bytes to the port as it takes without blocking */
+    void pump() {
+        if (pumping || held)
+            return;
+        pumping = true;
+        if (port == NULL)
+            tail = head;
+        while (tail != head) {
+            int room = port->availableForWrite();
+            if (room <= 0)
+                break;
+            // Contiguous run up to the end of the ring
+            uint16_t end = head >= tail ? head : TX_QUEUE_SIZE;
+            size_t n = end - tail;
+            if (n > (size_t)room)
+                n = room;
+            size_t sent = port->write(&buffer[tail], n);
+            if (sent == 0)
+                break;
+            atLineStart = buffer[(tail + sent - 1) & TX_QUEUE_MASK] == delimiter;
+            tail = (tail + sent) & TX_QUEUE_MASK;
+        }
+        pumping = false;
+    }
+
+    /**
+     * @brief Send the rest of a partly sent line, blocking
+     *
+     * Called before writing to the port directly (eg. command replies) so
+     * the direct output does not land in the middle of a queued line.
+     */
+    void finishLine() {
+        if (held)
+            return;     // nothing was sent since the hold started
+        unsigned long start = millis();
+        while (!atLineStart && tail != head && millis() - start < TX_BLOCK_TIMEOUT)
+            pump();
+    }
+
+    /** Send everything queued, blocking, ends a hold */
+    void flush() {
+        held = false;
+        unsigned long start = millis();
+        while (tail != head && millis() - start < TX_BLOCK_TIMEOUT)
+            pump();
+    }
+
+    void resetStats() {
+        bytesQueued = 0;
+        bytesDropped = 0;
+        linesDropped = 0;
+        maxFill = 0;
+        blockTime = 0;
+    }
+
+    void printStats(Stream * ui) {
+        char output[128];
+        const char * policies[] = {"block", "drop oldest", "drop newest"};
+        sprintf(output, "%-6s %-11s queued: %lu B, dropped: %lu B in %lu lines, peak fill: %u of %d B, blocked: %lu ms",
+            name, policies[policy], (unsigned long)bytesQueued, (unsigned long)bytesDropped,
+            (unsigned long)linesDropped, maxFill, TX_QUEUE_SIZE - 1, blockTime);
+        ui->println(output);
+    }
+};
+
+TxQueue _txUI1(&UI1, "UI1");
+TxQueue _txUI2(&UI2, "UI2");
+TxQueue _txDebug(&DEBUGPORT, "USB");
+
+/** Queue for a port, NULL if the port is not queued */
+TxQueue * getTxQueue(Stream * port) {
+    if (port == &UI1)
+        return &_txUI1;
+    if (port == &UI2)
+        return &_txUI2;
+    if (port == &DEBUGPORT)
+        return &_txDebug;
+    return NULL;
+}
+
+void pumpTxQueues() {
+    _txUI1.pump();
+    _txUI2.pump();
+    _txDebug.pump();
+}
+
+#endif
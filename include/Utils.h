@@ -2,10 +2,11 @@
 
 #define _UTILS
 
-#define PORT_BREAK_CHAR 5
 
 #include <Arduino.h>
 #include "MillisTimer.h"
+#include "TxQueue.h"
+#include "TaskWatchdog.h"
 
 void Blink(int DELAY_MS, byte loops)
 {
@@ -77,50 +78,10 @@ bool escapeReceived() {
     }
 }
 
-void portpass(Stream * in, Stream * out, bool localecho = false) {
-    while (true) {
-        if (in->available()) {
-            unsigned char c = in->read();
-            if (c == PORT_BREAK_CHAR) {
-                break;
-            }
-            else{
-                out->write(c);
-            }
-        }
-        if (out->available()) {
-            in->write(out->read());
-        }
-    }
-}
-
-bool confirm(Stream * in, const char * prompt, unsigned int cmdTimeout) {
-    unsigned long startTimer = millis();
-    in->println();
-    in->print(prompt);
-
-    while (startTimer <= millis() && millis() - startTimer < cmdTimeout) {
-
-        // Wait on user input
-        if (in->available()) {
-            // Read the next char and reset timer          
-            char c = in->read();
-            if (c == 'Y' || c == 'y') {
-                return true;
-            }
-            else {
-                return false;
-            }
-        }
-    }
-
-    return false;
-}
-
 void printAllPorts(const char output[]) {
-    UI1.println(output);
-    UI2.println(output);
-    DEBUGPORT.println(output);
+    _txUI1.writeLine(output);
+    _txUI2.writeLine(output);
+    _txDebug.writeLine(output);
 }
 
 int strncmp_ci(const char * input, const char * command, unsigned int n) {
@@ -146,6 +107,22 @@ int strncmp_ci(const char * input, const char * command, unsigned int n) {
     return 0;
 }
 
+/**
+ * @brief CRC-16/CCITT-FALSE of a buffer
+ *
+ * @param data  The bytes to checksum
+ * @param len   The number of bytes
+ * @param crc   Initial value, or the result of a previous call to continue
+ */
+uint16_t crc16(const uint8_t * data, size_t len, uint16_t crc = 0xFFFF) {
+    while (len--) {
+        crc ^= (uint16_t)(*data++) << 8;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
+
 /**
  * @brief Sleep for given amount of time with periodic checks for exit
  *
@@ -158,6 +135,7 @@ bool wakeable_sleep(int us) {
 		for (int i=0; i < iterations; i++) {
 			if (escapeReceived())
 				return true;
+			_taskWatchdog.checkIn();
 			delayMicroseconds(wake_period);
 		}
 	}
@@ -188,6 +166,9 @@ bool wakeable_long_sleep(int ms) {
 			if (escapeReceived())
 				return true;
 
+			// A bounded sleep is progress for the task waiting in it
+			_taskWatchdog.checkIn();
+
 			int delta = wake_period - wakeTimer.elapsed();
 			if (delta > 0)
 				delay(delta);
@@ -200,73 +181,4 @@ bool wakeable_long_sleep(int ms) {
 	return false;
 }
 
-/** 
- * @brief Get input from the user over the serial port
- *
- * This function creates a very simple text input UI with
- * backspace handled properly and timeouts applied.
- *
- * It is intended to be used either for user interaction,
- * or for taking input from another program line-by-line
- *
- * The function fills a buffer while reading chars and
- * exits when it times out or if it recevies a 
- * @verbatim '\r' or '\n' @endverbatim
- *
- * Valid characters are echoed on the serial port in a
- * way similar to a terminal prompt
- *
- * @param port      The serial port to send/receive on
- * @param buf       The character buffer to store input in
- * @param maxLength The length of the character buffer
- *
- * @return  True when a line of characters followed by a @verbatim '\r' or '\n' @endverbatim
- *          was received before timeout.
- */
-bool readUIInput(Stream * port, char * buf, int maxLength) {
-
-    char c;
-    int count = 0;
-    int avail = 0;
-    bool recvd = false;
-    MillisTimer uiTimer;
-
-	//if (!port->available())
-	//	return false;
-
-
-    uiTimer.reset();
-    uiTimer.start();
-    while (uiTimer.elapsed() < 60000 && count < maxLength) {
-        avail = port->available();
-        if (avail > 0) {
-            c = port->read();
-			
-            if (c == '\n' || c == '\r') {
-				uiTimer.reset();
-                uiTimer.start();
-                buf[count++] = '\0';
-                recvd = true;
-                break;
-            }
-			// Handle backspace
-			if (c == '\b' || c == 127) {
-                count--;
-                if (count < 0)
-                    count = 0;
-                else
-                    port->print("\b \b");
-            }
-            else {
-                port->print(c);
-                buf[count++] = tolower(c);
-            }
-        }
-    }
-    port->flush();
-    return recvd;
-}
-
-
-
 #endif
\ No newline at end of file
@@ -22,6 +22,41 @@ void setFlashes() {
     sys.configureFlashDurations();
 }
 
+void setInstruments() {
+    sys.configureInstruments();
+}
+
+void setPowerLimits() {
+    sys.configurePowerLimits();
+}
+
+void setSDLog() {
+    sys.configureSDLog();
+}
+
+void setTxPolicy() {
+    sys.configureTxQueues();
+}
+
+void setHostLink() {
+    sys.configureHostLink();
+}
+
+void setOptotune() {
+    sys.configureOptotune();
+}
+
+void powerFaultCallback() {
+    sys.powerFaultISR();
+}
+
+// Called by delay() while it waits, keeps telemetry moving
+// and the watchdog fed while the running task is within its deadline
+void yield() {
+    pumpTxQueues();
+    _taskWatchdog.feed();
+}
+
 void setup() {
 
     pinMode(10,OUTPUT);
@@ -44,7 +79,7 @@ void setup() {
 
     // Add config parameters for system
     // IMPORTANT: add parameters at the end of the list, otherwise you'll need to reflash the saved params in EEPROM before reading
-    sys.cfg.addParam(LOGINT, "Time in ms between log events", "ms", 0, 100000, 250);
+    sys.cfg.addParam(LOGINT, "Time in ms between log events, each reports min/max/mean over the interval", "ms", 0, 100000, 250);
     sys.cfg.addParam(DEPTHCHECKINTERVAL, "Time in seconds between depth checks for testing ascent/descent", "s", 10, 300, 30);
     sys.cfg.addParam(DEPTHTHRESHOLD, "Depth change threshold to denote ascent or descent", "mm", 500, 10000, 1000);
     sys.cfg.addParam(LOCALECHO, "When > 0, echo serial input", "", 0, 1, 1);
@@ -67,14 +102,35 @@ void setup() {
     sys.cfg.addParam(MAXREPEAT, "Maximum number of cycles in sequence REPEAT cmd.", "cycles", 0, 1000, 100000);
     sys.cfg.addParam(MAXDELAY, "Maximum ms delay in sequence DELAY cmd", "ms", 0, 1000, 10000);
     sys.cfg.addParam(MAXLONGDELAY, "Maximum seconds in sequence LONGDELAY cmd.", "s", 0, 3600, 10000);
-    sys.cfg.addParam(LOWVOLTAGE, "Voltage in mV where we shut down system", "mV", 10000, 14000, 11500);
+    sys.cfg.addParam(LOWVOLTAGE, "Voltage in mV where we shut down system", "mV", 10000, 14000, 11500, false, setPowerLimits);
     sys.cfg.addParam(STANDBY, "If voltage is low go into standby mode", "", 0, 1, 0);
     sys.cfg.addParam(CHECKHOURLY, "0 = check every minute, 1 = check every hour", "", 0, 1, 0);
     sys.cfg.addParam(CHECKINTERVAL, "Time in seconds between checking system health", "s", 10, 60, 3600);
     sys.cfg.addParam(STARTUPTIME, "Time in seconds before performing any system checks", "s", 0, 60, 10);
-    sys.cfg.addParam(WATCHDOG, "0 = no watchdog, 1 = hardware watchdog timer with 8 sec timeout","", 0, 1, 0);
+    sys.cfg.addParam(WATCHDOG, "0 = no watchdog, 1 = hardware watchdog timer with 8 sec timeout, fed only while no task is past its deadline","", 0, 1, 0);
     sys.cfg.addParam(TEMPLIMIT, "Temerature in C where controller will shutdown and power off camera","C", 0, 80, 55);
     sys.cfg.addParam(HUMLIMIT, "Humidity in % where controller will shutdown and power off camera","%", 0, 100, 60);
+    sys.cfg.addParam(CTDPORT, "Hardware port the CTD is connected to, -1 = no CTD", "", -1, 3, -1, false, setInstruments);
+    sys.cfg.addParam(CTDTYPE, "0 = RBR CTD, 1 = SBE39 CTD", "", 0, 1, 0, false, setInstruments);
+    sys.cfg.addParam(FRAMETAGS, "When = 1, output CTD depth and temperature interpolated at each trigger", "", 0, 1, 0);
+    sys.cfg.addParam(CURRENTLIMIT, "Current in mA where we stop triggers and shut down system", "mA", 100, 15000, 10000, false, setPowerLimits);
+    sys.cfg.addParam(ALERTMODE, "INA260 ALERT pin limit, 0 = LOWVOLTAGE, 1 = CURRENTLIMIT", "", 0, 1, 0, false, setPowerLimits);
+    sys.cfg.addParam(COUNTERINTERVAL, "Time in seconds between saving lifetime counters to flash", "s", 60, 86400, 900);
+    sys.cfg.addParam(STROBECHECK, "Triggers between strobe current captures, 0 = off", "", 0, 100000, 100);
+    sys.cfg.addParam(STROBEALARM, "Strobe alarm when pulse energy falls below this percentage of the baseline", "%", 10, 95, 50);
+    sys.cfg.addParam(SDLOG, "When = 1, log $PCTL, CTD and frame records to the SD card", "", 0, 1, 0, false, setSDLog);
+    sys.cfg.addParam(LOGFORMAT, "0 = text, 1 = binary SD log, 2 = binary SD log and no $PCTL text", "", 0, 2, 0, false, setSDLog);
+    sys.cfg.addParam(FLASHLOG, "When = 1 and SDLOG = 1, log to SPI flash while no SD card is usable", "", 0, 1, 1, false, setSDLog);
+    sys.cfg.addParam(UI1TXPOLICY, "UI1 output queue when full, 0 = wait, 1 = drop oldest lines, 2 = drop new lines", "", 0, 2, 1, false, setTxPolicy);
+    sys.cfg.addParam(UI2TXPOLICY, "UI2 output queue when full, 0 = wait, 1 = drop oldest lines, 2 = drop new lines", "", 0, 2, 1, false, setTxPolicy);
+    sys.cfg.addParam(USBTXPOLICY, "USB output queue when full, 0 = wait, 1 = drop oldest lines, 2 = drop new lines", "", 0, 2, 1, false, setTxPolicy);
+    sys.cfg.addParam(TIMESYNC, "Time in seconds between resyncs of the sub-second clock to the RTC", "s", 10, 600, 60);
+    sys.cfg.addParam(LINKPORT, "Hardware port for the binary host link, its command prompt is off, -1 = no link", "", -1, 3, -1, false, setHostLink);
+    sys.cfg.addParam(OPTOTIMEOUT, "Time in ms to wait for a lens reply before sending the command again", "ms", 10, 5000, 200, false, setOptotune);
+    sys.cfg.addParam(OPTORETRIES, "Times a lens command is sent again before the move is abandoned", "", 0, 10, 2, false, setOptotune);
+    sys.cfg.addParam(OPTOTICK, "Time in ms between the steps of a slewed lens move", "ms", 1, 1000, 20, false, setOptotune);
+    sys.cfg.addParam(LOOPIDLE, "When = 1, sleep the core between loop passes until the next ms tick or interrupt", "", 0, 1, 1);
+    sys.cfg.addParam(SHUTDOWNWAIT, "Time in seconds from the Jetson shutdown command to cutting camera and strobe power", "s", 5, 600, 60);
 
     // Start the remaining serial ports
     HWPORT0.begin(sys.cfg.getInt(HWPORT0BAUD));
@@ -93,22 +149,40 @@ void setup() {
     // Setup flashes triggers and polling
     setFlashes();
     setTriggers();
+    setInstruments();
+
+    // Arm the INA260 ALERT interrupt
+    setPowerLimits();
+
+    // Apply the output queue policies
+    setTxPolicy();
+
+    // Start the binary host link if a port is set
+    setHostLink();
+
+    // Lens reply timeout, retries and slew tick
+    setOptotune();
+
+    // Mount the SD card if logging is enabled
+    setSDLog();
     
 }
 
 void loop() {
 
-    sys.clearWatchdog();
+    sys.feedWatchdog();
 
-    sys.update();
+    sys.checkPowerFault();
+    bool logged = sys.update();
     sys.checkInput();
     sys.checkVoltage();
     sys.checkEnv();
     sys.checkCameraPower(); 
 
-    int logInt = sys.cfg.getInt(LOGINT);
+    if (logged)
+        Blink(10, 1);
 
-    delay(logInt);
-    Blink(10, 1);
+    // Nothing left for this pass, wait for the next tick or interrupt
+    sys.idle();
 
 }
@@ -0,0 +1,111 @@
+/** @file test_main.cpp
+ *  @brief Host tests of the binary log format, records written as the
+ *  firmware does and read back as tools/binlog2csv.cpp does
+ *
+ *  pio test -e native -f test_binlog
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#include <unity.h>
+#include "BinaryLogFormat.h"
+#include "FixedFormat.h"
+
+static char line[256];
+
+void setUp() {
+    line[0] = '\0';
+}
+
+void tearDown() {
+}
+
+/** The CSV fields of a record, as binlog2csv prints them */
+static const char * decode(const void * record, const BinaryLogField * fields, int count) {
+    const uint8_t * p = (const uint8_t *)record;
+    size_t n = 0;
+    for (int i = 0; i < count; i++) {
+        char value[32];
+        binlogFormatValue(value, sizeof(value), binlogReadField(p, fields[i].type), fields[i].type,
+            fields[i].decimals);
+        n += snprintf(line + n, sizeof(line) - n, "%s%s", i > 0 ? "," : "", value);
+        p += binlogFieldSize(fields[i].type);
+    }
+    return line;
+}
+
+void test_frame_record_sizes() {
+    size_t size = 0;
+    for (int i = 0; i < BINLOG_FIELDS(binlogFrameFields); i++)
+        size += binlogFieldSize(binlogFrameFields[i].type);
+    TEST_ASSERT_EQUAL(sizeof(BinaryFrameRecord), size);
+    size = 0;
+    for (int i = 0; i < BINLOG_FIELDS(binlogPctlFields); i++)
+        size += binlogFieldSize(binlogPctlFields[i].type);
+    TEST_ASSERT_EQUAL(sizeof(BinaryPctlRecord), size);
+}
+
+void test_frame_values_round_trip() {
+    BinaryFrameRecord r;
+    r.frame = 1234;
+    r.pressure = binlogFixed(-0.25, 1000, BINLOG_NULL_I32 + 1, INT32_MAX);
+    r.temp = binlogFixed(12.3456, 10000, BINLOG_NULL_I32 + 1, INT32_MAX);
+    r.focalPower = -1500;
+    TEST_ASSERT_EQUAL_STRING("1234,-0.250,12.3456,-1.500",
+        decode(&r, binlogFrameFields, BINLOG_FIELDS(binlogFrameFields)));
+}
+
+void test_frame_without_ctd_or_lens() {
+    BinaryFrameRecord r;
+    r.frame = 7;
+    r.pressure = BINLOG_NULL_I32;
+    r.temp = BINLOG_NULL_I32;
+    r.focalPower = BINLOG_NULL_I16;
+    TEST_ASSERT_EQUAL_STRING("7,,,", decode(&r, binlogFrameFields, BINLOG_FIELDS(binlogFrameFields)));
+}
+
+void test_clamped_values_are_not_null() {
+    BinaryFrameRecord r;
+    r.frame = 0;
+    r.pressure = binlogFixed(-1e9, 1000, BINLOG_NULL_I32 + 1, INT32_MAX);
+    r.temp = binlogFixed(1e9, 10000, BINLOG_NULL_I32 + 1, INT32_MAX);
+    r.focalPower = binlogClamp(-40000, BINLOG_NULL_I16 + 1, INT16_MAX);
+    TEST_ASSERT_EQUAL_STRING("0,-2147483.647,214748.3647,-32.767",
+        decode(&r, binlogFrameFields, BINLOG_FIELDS(binlogFrameFields)));
+}
+
+void test_pctl_power_range() {
+    // 15 A on the 12 V bus, 10 mW steps hold up to 655 W
+    BinaryPctlRecord r;
+    memset(&r, 0, sizeof(r));
+    int32_t mW[3] = {180000, 4990, 655350};
+    for (int i = 0; i < 3; i++)
+        r.power[i] = binlogClamp(fixedDivRound(mW[i], 10), 0, UINT16_MAX);
+    decode(&r, binlogPctlFields, BINLOG_FIELDS(binlogPctlFields));
+    const char * power = line + strlen(line) - strlen("180.00,4.99,655.35");
+    TEST_ASSERT_EQUAL_STRING("180.00,4.99,655.35", power);
+}
+
+void test_unsigned_fields_have_no_null() {
+    uint8_t p[4] = {0x00, 0x00, 0x00, 0x80};
+    TEST_ASSERT_FALSE(binlogIsNull(binlogReadField(p, BINLOG_U32), BINLOG_U32));
+    TEST_ASSERT_TRUE(binlogIsNull(binlogReadField(p, BINLOG_I32), BINLOG_I32));
+}
+
+void test_header_size() {
+    uint8_t header[binlogHeaderSize()];
+    TEST_ASSERT_EQUAL(binlogHeaderSize(), binlogWriteHeader(header));
+    TEST_ASSERT_EQUAL_MEMORY(BINLOG_MAGIC, header, 4);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_frame_record_sizes);
+    RUN_TEST(test_frame_values_round_trip);
+    RUN_TEST(test_frame_without_ctd_or_lens);
+    RUN_TEST(test_clamped_values_are_not_null);
+    RUN_TEST(test_pctl_power_range);
+    RUN_TEST(test_unsigned_fields_have_no_null);
+    RUN_TEST(test_header_size);
+    return UNITY_END();
+}
@@ -0,0 +1,329 @@
+/** @file test_main.cpp
+ *  @brief Host tests of FixedFormat against the sprintf and String output
+ *  it replaced, and a benchmark of a $PCTL line
+ *
+ *  glibc and newlib printf both round the exact binary value half to even,
+ *  so "%.Nf" here is the reference for the target too. String(float) on
+ *  the SAMD core goes through dtostrf and prints the same as "%.2f".
+ *
+ *  pio test -e native -f test_fixedformat
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "FixedFormat.h"
+
+#define RANDOM_VALUES 1000000
+#define BENCH_LINES 100000
+
+static char expected[64];
+// Keeps the compiler from dropping the timed loops
+static volatile unsigned long sink;
+static char actual[64];
+
+void setUp() {
+    srand(1);
+}
+
+void tearDown() {
+}
+
+static uint32_t random32() {
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+static float floatFromBits(uint32_t bits) {
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/** fixedRound() as it was, in double precision */
+static int32_t fixedRoundDouble(float value, int decimals) {
+    double v = (double)value * fixedPow10[decimals];
+    bool negative = v < 0;
+    if (negative)
+        v = -v;
+    if (v >= 2147483647.0)
+        return negative ? INT32_MIN : INT32_MAX;
+    uint32_t n = (uint32_t)v;
+    double frac = v - n;
+    if (frac > 0.5 || (frac == 0.5 && (n & 1)))
+        n++;
+    return negative ? -(int32_t)n : (int32_t)n;
+}
+
+static const char * newFixed(int32_t v, int decimals) {
+    FixedFormat f(actual, sizeof(actual));
+    f.fixed(v, decimals);
+    return actual;
+}
+
+/** Percentage of n in total, for the messages */
+static void report(const char * what, int n, int total) {
+    char output[128];
+    snprintf(output, sizeof(output), "%s: %d of %d differ from the old output (%.2f%%)", what, n, total,
+        100.0 * n / total);
+    TEST_MESSAGE(output);
+}
+
+void test_fixed_matches_printf() {
+    for (int i = 0; i < RANDOM_VALUES; i++) {
+        int decimals = i % (FIXED_MAX_DECIMALS + 1);
+        int32_t v = (int32_t)random32();
+        snprintf(expected, sizeof(expected), "%.*f", decimals, (double)v / fixedPow10[decimals]);
+        TEST_ASSERT_EQUAL_STRING(expected, newFixed(v, decimals));
+    }
+    TEST_ASSERT_EQUAL_STRING("-2147483.648", newFixed(INT32_MIN, 3));
+    TEST_ASSERT_EQUAL_STRING("0.000001", newFixed(1, 6));
+}
+
+void test_fixedf_matches_printf() {
+    for (int i = 0; i < RANDOM_VALUES; i++) {
+        int decimals = i % (FIXED_MAX_DECIMALS + 1);
+        // Saturation is covered below, here the scaled value must fit
+        float v = floatFromBits(random32() & 0xCFFFFFFF);
+        if (fabs(v) * fixedPow10[decimals] >= 2147483647.0)
+            continue;
+        snprintf(expected, sizeof(expected), "%.*f", decimals, (double)v);
+        FixedFormat f(actual, sizeof(actual));
+        f.fixedf(v, decimals);
+        TEST_ASSERT_EQUAL_STRING(expected, actual);
+    }
+}
+
+void test_fixedf_ties_and_signs() {
+    const float ties[] = {0.5, 1.5, 2.5, -0.5, -2.5, 0.125, 0.375, -0.625};
+    const int decimals[] = {0, 0, 0, 0, 0, 2, 2, 2};
+    for (int i = 0; i < 8; i++) {
+        snprintf(expected, sizeof(expected), "%.*f", decimals[i], (double)ties[i]);
+        FixedFormat f(actual, sizeof(actual));
+        f.fixedf(ties[i], decimals[i]);
+        TEST_ASSERT_EQUAL_STRING(expected, actual);
+    }
+    FixedFormat f(actual, sizeof(actual));
+    f.fixedf(-0.001, 1);
+    TEST_ASSERT_EQUAL_STRING("-0.0", actual);
+}
+
+void test_fixed_round_matches_double() {
+    // Every exponent, so saturation, subnormals, inf and NaN are covered
+    for (int i = 0; i < RANDOM_VALUES; i++) {
+        float v = floatFromBits(random32());
+        if (v != v) {
+            TEST_ASSERT_EQUAL(0, fixedRound(v, 3));
+            continue;
+        }
+        int decimals = i % (FIXED_MAX_DECIMALS + 1);
+        TEST_ASSERT_EQUAL(fixedRoundDouble(v, decimals), fixedRound(v, decimals));
+    }
+    TEST_ASSERT_EQUAL(INT32_MAX, fixedRound(2147483647.0, 0));
+    TEST_ASSERT_EQUAL(INT32_MIN, fixedRound(-1e30, 0));
+    TEST_ASSERT_EQUAL(0, fixedRound(1e-40, 6));
+    TEST_ASSERT_EQUAL(2147483520, fixedRound(2147483520.0, 0));
+}
+
+void test_fixed_round_q() {
+    // 1.5 and 2.5 in Q.8 round to even
+    TEST_ASSERT_EQUAL(2, fixedRoundQ(384, 8, 0));
+    TEST_ASSERT_EQUAL(2, fixedRoundQ(640, 8, 0));
+    TEST_ASSERT_EQUAL(12345, fixedRoundQ(12345, 0, 0));
+    TEST_ASSERT_EQUAL(50, fixedRoundQ(128, 8, 2));
+}
+
+void test_bme280_fields() {
+    // The Adafruit driver returned Q24.8 Pa and Q22.10 %RH as floats
+    int pressureDiffs = 0;
+    int humidityDiffs = 0;
+    int total = 0;
+    for (uint32_t raw = 30000 * 256; raw < 110000 * 256; raw += 7) {
+        snprintf(expected, sizeof(expected), "%.2f", (double)raw / 256);
+        TEST_ASSERT_EQUAL_STRING(expected, newFixed(fixedRoundQ(raw, 8, 2), 2));
+        char old[32];
+        snprintf(old, sizeof(old), "%.2f", (double)((float)raw / 256));
+        if (strcmp(old, actual) != 0) {
+            pressureDiffs++;
+            // One step of the last digit, from the LSB the float dropped
+            TEST_ASSERT_FLOAT_WITHIN(0.0101, strtod(old, NULL), strtod(actual, NULL));
+        }
+        total++;
+    }
+    report("$BME280 pressure", pressureDiffs, total);
+
+    for (uint32_t raw = 0; raw <= 100 * 1024; raw++) {
+        snprintf(expected, sizeof(expected), "%.2f", (double)raw / 1024);
+        TEST_ASSERT_EQUAL_STRING(expected, newFixed(fixedRoundQ(raw, 10, 2), 2));
+        char old[32];
+        snprintf(old, sizeof(old), "%.2f", (double)((float)raw / 1024.0));
+        humidityDiffs += strcmp(old, actual) != 0;
+    }
+    TEST_ASSERT_EQUAL(0, humidityDiffs);
+
+    // Temperature was the 0.01 C integer of the driver divided by 100
+    for (int32_t raw = -4000; raw <= 8500; raw++) {
+        snprintf(expected, sizeof(expected), "%.2f", (double)((float)raw / 100));
+        TEST_ASSERT_EQUAL_STRING(expected, newFixed(raw, 2));
+    }
+}
+
+void test_ina260_fields() {
+    // Current and voltage were register * 1.25 and power register * 10
+    for (int32_t raw = -32768; raw <= 32767; raw++) {
+        snprintf(expected, sizeof(expected), "%.2f", (double)(raw * 1.25f));
+        TEST_ASSERT_EQUAL_STRING(expected, newFixed(raw * 125L, 2));
+    }
+    for (int32_t raw = 0; raw <= 65535; raw++) {
+        snprintf(expected, sizeof(expected), "%.2f", (double)(raw * 10.0f));
+        TEST_ASSERT_EQUAL_STRING(expected, newFixed(raw * 1000L, 2));
+    }
+}
+
+void test_pctl_voltage_and_power() {
+    // One sample windows. The old line printed a float of V and W with
+    // "%.2f", the new one rounds mV and mW half away from zero like the
+    // window means.
+    int voltageDiffs = 0;
+    int ties = 0;
+    int total = 0;
+    for (int32_t raw = 0; raw <= 32767; raw++) {
+        int32_t mV = fixedDivRound(raw * 5, 4);
+        newFixed(fixedDivRound(mV, 10), 2);
+        // Exact V is raw / 800, rounded half away to 0.01 V is (raw + 4) / 8
+        snprintf(expected, sizeof(expected), "%.2f", (raw + 4) / 8 / 100.0);
+        TEST_ASSERT_EQUAL_STRING(expected, actual);
+        char old[32];
+        snprintf(old, sizeof(old), "%.2f", (double)(float)(raw * 1.25f / 1000.0));
+        if (strcmp(old, actual) != 0) {
+            voltageDiffs++;
+            // Every difference is an exact x.xx5 V tie
+            TEST_ASSERT_EQUAL(4, raw % 8);
+        }
+        ties += raw % 8 == 4;
+        total++;
+    }
+    report("$PCTL voltage", voltageDiffs, total);
+    TEST_ASSERT_LESS_OR_EQUAL(ties, voltageDiffs);
+
+    for (int32_t raw = 0; raw <= 65535; raw++) {
+        snprintf(expected, sizeof(expected), "%.2f", (double)(float)(raw * 10.0f / 1000.0));
+        TEST_ASSERT_EQUAL_STRING(expected, newFixed(fixedDivRound(raw * 10, 10), 2));
+    }
+}
+
+void test_truncation() {
+    char small[8];
+    FixedFormat f(small, sizeof(small));
+    f.str("$PCTL,").fixed(12345, 2);
+    TEST_ASSERT_TRUE(f.overflow());
+    TEST_ASSERT_EQUAL(7, f.length());
+    TEST_ASSERT_EQUAL_STRING("$PCTL,1", small);
+}
+
+// The window values of a $PCTL line in the units each format kept them in
+struct PctlWindow {
+    int32_t temp[3];        // 0.001 C
+    int32_t pressure[3];    // Pa
+    int32_t hum[3];         // 0.01 %
+    int32_t voltage[3];     // mV
+    int32_t power[3];       // mW
+};
+
+static void pctlFixed(char * output, size_t size, const PctlWindow & w) {
+    FixedFormat f(output, size);
+    f.str("$PCTL").sep().str("2023-06-01 12:00:00.250");
+    f.sep().fixed(w.temp[0], 3).sep().fixed(w.pressure[0], 3).sep().fixed(w.hum[0], 2);
+    f.sep().fixed(fixedDivRound(w.voltage[0], 10), 2).sep().fixed(fixedDivRound(w.power[0], 10), 2);
+    f.sep().i32(1);
+    for (int i = 1; i < 3; i++)
+        f.sep().fixed(w.temp[i], 3);
+    for (int i = 1; i < 3; i++)
+        f.sep().fixed(w.pressure[i], 3);
+    for (int i = 1; i < 3; i++)
+        f.sep().fixed(w.hum[i], 2);
+    for (int i = 1; i < 3; i++)
+        f.sep().fixed(fixedDivRound(w.voltage[i], 10), 2);
+    for (int i = 1; i < 3; i++)
+        f.sep().fixed(fixedDivRound(w.power[i], 10), 2);
+}
+
+static void pctlSprintf(char * output, const float * v) {
+    sprintf(output, "%s,%s.%03u,%0.3f,%0.3f,%0.2f,%0.2f,%0.2f,%d,"
+        "%0.3f,%0.3f,%0.3f,%0.3f,%0.2f,%0.2f,%0.2f,%0.2f,%0.2f,%0.2f",
+        "$PCTL", "2023-06-01 12:00:00", 250U, v[0], v[1], v[2], v[3], v[4], 1,
+        v[5], v[6], v[7], v[8], v[9], v[10], v[11], v[12], v[13], v[14]);
+}
+
+void test_benchmark_pctl_line() {
+    static PctlWindow windows[64];
+    static float floats[64][15];
+    for (int i = 0; i < 64; i++) {
+        PctlWindow & w = windows[i];
+        for (int j = 0; j < 3; j++) {
+            w.temp[j] = 20000 + rand() % 5000;
+            w.pressure[j] = 101000 + rand() % 2000;
+            w.hum[j] = 3000 + rand() % 4000;
+            w.voltage[j] = 24000 + rand() % 1000;
+            w.power[j] = 5000 + rand() % 10000;
+        }
+        float * v = floats[i];
+        v[0] = w.temp[0] / 1000.0;
+        v[1] = w.pressure[0] / 1000.0;
+        v[2] = w.hum[0] / 100.0;
+        v[3] = w.voltage[0] / 1000.0;
+        v[4] = w.power[0] / 1000.0;
+        for (int j = 1; j < 3; j++) {
+            v[4 + j] = w.temp[j] / 1000.0;
+            v[6 + j] = w.pressure[j] / 1000.0;
+            v[8 + j] = w.hum[j] / 100.0;
+            v[10 + j] = w.voltage[j] / 1000.0;
+            v[12 + j] = w.power[j] / 1000.0;
+        }
+    }
+
+    // Reports only, timings depend on the host and its load
+    typedef std::chrono::steady_clock Clock;
+    char output[256];
+    unsigned long check = 0;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < BENCH_LINES; i++) {
+        pctlSprintf(output, floats[i % 64]);
+        check += output[40];
+    }
+    double tSprintf = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / BENCH_LINES;
+    start = Clock::now();
+    for (int i = 0; i < BENCH_LINES; i++) {
+        pctlFixed(output, sizeof(output), windows[i % 64]);
+        check += output[40];
+    }
+    double tFixed = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / BENCH_LINES;
+    sink = check;
+
+    char message[128];
+    snprintf(message, sizeof(message), "$PCTL line, ns: sprintf %.0f, FixedFormat %.0f", tSprintf, tFixed);
+    TEST_MESSAGE(message);
+
+    // Same line for values the float holds closely enough
+    pctlSprintf(output, floats[0]);
+    char line[256];
+    pctlFixed(line, sizeof(line), windows[0]);
+    TEST_ASSERT_EQUAL_STRING(output, line);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_fixed_matches_printf);
+    RUN_TEST(test_fixedf_matches_printf);
+    RUN_TEST(test_fixedf_ties_and_signs);
+    RUN_TEST(test_fixed_round_matches_double);
+    RUN_TEST(test_fixed_round_q);
+    RUN_TEST(test_bme280_fields);
+    RUN_TEST(test_ina260_fields);
+    RUN_TEST(test_pctl_voltage_and_power);
+    RUN_TEST(test_truncation);
+    RUN_TEST(test_benchmark_pctl_line);
+    return UNITY_END();
+}
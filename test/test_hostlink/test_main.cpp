@@ -0,0 +1,141 @@
+/** @file test_main.cpp
+ *  @brief Host tests of the host link COBS framing
+ *
+ *  pio test -e native -f test_hostlink
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#include <unity.h>
+#include "HostLinkFormat.h"
+
+#define GUARD 0xA5
+#define GUARD_BYTES 16
+
+// Decoded packet followed by guard bytes that must never be written
+static uint8_t out[HOSTLINK_MAX_PACKET + GUARD_BYTES];
+
+void setUp() {
+    memset(out, GUARD, sizeof(out));
+}
+
+void tearDown() {
+}
+
+static void checkGuard() {
+    TEST_ASSERT_EACH_EQUAL_UINT8(GUARD, out + HOSTLINK_MAX_PACKET, GUARD_BYTES);
+}
+
+static size_t decode(const uint8_t * frame, size_t len) {
+    return cobsDecode(frame, len, out, HOSTLINK_MAX_PACKET);
+}
+
+void test_max_encoded_size() {
+    // 256 bytes without a zero need two code bytes
+    TEST_ASSERT_EQUAL(258, HOSTLINK_MAX_ENCODED);
+    TEST_ASSERT_EQUAL(259, HOSTLINK_MAX_FRAME);
+}
+
+void test_round_trip_max_packet() {
+    uint8_t packet[HOSTLINK_MAX_PACKET];
+    uint8_t frame[HOSTLINK_MAX_FRAME];
+    for (int i = 0; i < HOSTLINK_MAX_PACKET; i++)
+        packet[i] = i % 255 + 1;
+    size_t n = cobsEncode(packet, sizeof(packet), frame);
+    TEST_ASSERT_EQUAL(HOSTLINK_MAX_FRAME, n);
+    TEST_ASSERT_EQUAL(0, frame[n - 1]);
+    TEST_ASSERT_EQUAL(HOSTLINK_MAX_PACKET, decode(frame, n - 1));
+    TEST_ASSERT_EQUAL_MEMORY(packet, out, HOSTLINK_MAX_PACKET);
+    checkGuard();
+}
+
+void test_round_trip_zeros() {
+    uint8_t packet[HOSTLINK_MAX_PACKET];
+    uint8_t frame[HOSTLINK_MAX_FRAME];
+    for (int i = 0; i < HOSTLINK_MAX_PACKET; i++)
+        packet[i] = i % 3 == 0 ? 0 : i;
+    size_t n = cobsEncode(packet, sizeof(packet), frame);
+    TEST_ASSERT_EQUAL(HOSTLINK_MAX_PACKET, decode(frame, n - 1));
+    TEST_ASSERT_EQUAL_MEMORY(packet, out, HOSTLINK_MAX_PACKET);
+    checkGuard();
+}
+
+void test_all_zero_packet() {
+    uint8_t packet[HOSTLINK_MAX_PACKET] = {0};
+    uint8_t frame[HOSTLINK_MAX_FRAME];
+    size_t n = cobsEncode(packet, sizeof(packet), frame);
+    TEST_ASSERT_EQUAL(HOSTLINK_MAX_PACKET + 2, n);
+    TEST_ASSERT_EQUAL(HOSTLINK_MAX_PACKET, decode(frame, n - 1));
+    TEST_ASSERT_EACH_EQUAL_UINT8(0, out, HOSTLINK_MAX_PACKET);
+    checkGuard();
+}
+
+void test_too_many_zeros_rejected() {
+    // Every 0x01 code is a zero byte: 258 of them decode to 257 bytes
+    uint8_t frame[HOSTLINK_MAX_ENCODED + 1];
+    memset(frame, 0x01, sizeof(frame));
+    TEST_ASSERT_EQUAL(0, decode(frame, HOSTLINK_MAX_ENCODED));
+    checkGuard();
+    TEST_ASSERT_EQUAL(0, decode(frame, sizeof(frame)));
+    checkGuard();
+}
+
+void test_oversized_packet_rejected() {
+    uint8_t packet[HOSTLINK_MAX_PACKET + 1];
+    uint8_t frame[HOSTLINK_MAX_FRAME + 2];
+    for (size_t i = 0; i < sizeof(packet); i++)
+        packet[i] = i % 255 + 1;
+    size_t n = cobsEncode(packet, sizeof(packet), frame);
+    TEST_ASSERT_EQUAL(0, decode(frame, n - 1));
+    checkGuard();
+}
+
+void test_long_block_rejected() {
+    // A full 0xFF block after 200 decoded bytes would write past the packet
+    uint8_t frame[HOSTLINK_MAX_ENCODED];
+    size_t n = 0;
+    frame[n++] = 201;
+    for (int i = 0; i < 200; i++)
+        frame[n++] = 0x55;
+    frame[n++] = 0xFF;
+    for (int i = 0; i < 56; i++)
+        frame[n++] = 0x66;
+    TEST_ASSERT_EQUAL(0, decode(frame, n));
+    checkGuard();
+}
+
+void test_malformed_frames() {
+    // Zero code byte
+    uint8_t zero[] = {0x03, 0x11, 0x22, 0x00, 0x33};
+    TEST_ASSERT_EQUAL(0, decode(zero, sizeof(zero)));
+    // Code runs past the end of the frame
+    uint8_t shortBlock[] = {0x05, 0x11, 0x22};
+    TEST_ASSERT_EQUAL(0, decode(shortBlock, sizeof(shortBlock)));
+    // Empty frame
+    TEST_ASSERT_EQUAL(0, decode(zero, 0));
+    checkGuard();
+}
+
+void test_small_buffer() {
+    uint8_t packet[] = {0x11, 0x00, 0x22, 0x33};
+    uint8_t frame[8];
+    size_t n = cobsEncode(packet, sizeof(packet), frame);
+    TEST_ASSERT_EQUAL(sizeof(packet), cobsDecode(frame, n - 1, out, sizeof(packet)));
+    TEST_ASSERT_EQUAL_MEMORY(packet, out, sizeof(packet));
+    TEST_ASSERT_EQUAL(0, cobsDecode(frame, n - 1, out, sizeof(packet) - 1));
+    TEST_ASSERT_EQUAL(0, cobsDecode(frame, n - 1, out, 1));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_max_encoded_size);
+    RUN_TEST(test_round_trip_max_packet);
+    RUN_TEST(test_round_trip_zeros);
+    RUN_TEST(test_all_zero_packet);
+    RUN_TEST(test_too_many_zeros_rejected);
+    RUN_TEST(test_oversized_packet_rejected);
+    RUN_TEST(test_long_block_rejected);
+    RUN_TEST(test_malformed_frames);
+    RUN_TEST(test_small_buffer);
+    return UNITY_END();
+}
@@ -0,0 +1,289 @@
+/** @file test_main.cpp
+ *  @brief Host tests of the streaming statistics, and a benchmark of
+ *  RingMean against the MovingAverage it replaced
+ *
+ *  pio test -e native -f test_stats
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "Stats.h"
+
+#define BENCH_SAMPLES 200000
+#define BENCH_MIN_NS 50000000L      /**< Time each average over at least 50 ms */
+
+/**
+ * MovingAverage as it was in Stats.h before RingMean, less the Arduino
+ * dependencies: shifts the whole window and resums it on every sample.
+ */
+#define MAX_BUFFER_SIZE 128
+
+template <class T>
+class MovingAverage {
+
+    private:
+    T buffer[MAX_BUFFER_SIZE];
+    int index;
+    int samples;
+
+    public:
+
+    MovingAverage(int samples=64) {
+        this->samples = samples;
+        if (this->samples >= MAX_BUFFER_SIZE) {
+            this->samples = MAX_BUFFER_SIZE;
+        }
+        this->index = 0;
+    }
+
+    float update(T newSample) {
+        if (index < samples) {
+            buffer[index++] = newSample;
+        }
+        else {
+            for (int i = 1; i < index; i++) {
+                buffer[i-1] = buffer[i];
+            }
+            buffer[samples-1] = newSample;
+        }
+        if (index == 0) {
+            return newSample;
+        }
+        else {
+            float avg = 0.0;
+            for (int i = 0; i < index; i++) {
+                avg += buffer[i];
+            }
+            avg /= index;
+            return avg;
+        }
+    }
+};
+
+// Random walk like a slowly changing temperature in C
+static float samples[BENCH_SAMPLES];
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void fillSamples() {
+    srand(1);
+    float x = 20.0;
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        x += (rand() % 201 - 100) / 1000.0f;
+        samples[i] = x;
+    }
+}
+
+void test_ring_mean_window() {
+    RingMean<float, 4> m;
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.0, m.mean());
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 1.0, m.update(1.0));
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 1.5, m.update(2.0));
+    m.update(3.0);
+    TEST_ASSERT_FALSE(m.full());
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 2.5, m.update(4.0));
+    TEST_ASSERT_TRUE(m.full());
+    // 1 drops out of the window
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 3.5, m.update(5.0));
+    TEST_ASSERT_EQUAL(4, m.count());
+    m.clear();
+    TEST_ASSERT_EQUAL(0, m.count());
+}
+
+void test_ring_mean_fixed_point() {
+    RingMean<int16_t, 64, int32_t, 100> m;
+    for (int i = 0; i < 100; i++)
+        m.update(-12.345);
+    // Stored as round(x * 100)
+    TEST_ASSERT_EQUAL(-1235, m.fixedMean());
+    TEST_ASSERT_FLOAT_WITHIN(1e-4, -12.35, m.mean());
+    m.clear();
+    m.update(1.0);
+    m.update(1.01);
+    // 201 / 2 rounds half away from zero
+    TEST_ASSERT_EQUAL(101, m.fixedMean());
+}
+
+void test_ring_mean_float_no_drift() {
+    // Large values removed from the sum leave no error behind
+    RingMean<float, 8> m;
+    for (int i = 0; i < 1000; i++)
+        m.update(i % 2 ? 1e6 : 1.0);
+    for (int i = 0; i < 8; i++)
+        m.update(0.001);
+    TEST_ASSERT_FLOAT_WITHIN(1e-7, 0.001, m.mean());
+}
+
+void test_ewma_float() {
+    Ewma<float, 2> e;
+    TEST_ASSERT_FALSE(e.ready());
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 10.0, e.update(10.0));
+    TEST_ASSERT_TRUE(e.ready());
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 12.5, e.update(20.0));
+    for (int i = 0; i < 200; i++)
+        e.update(20.0);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4, 20.0, e.mean());
+}
+
+void test_ewma_integer_reaches_constant_input() {
+    // A truncated step of (v - value) / 16 stops 15 steps short
+    Ewma<int32_t, 4> up;
+    Ewma<int32_t, 4> down;
+    up.update(0);
+    down.update(0);
+    for (int i = 0; i < 1000; i++) {
+        up.update(1000);
+        down.update(-1000);
+    }
+    TEST_ASSERT_EQUAL(1000, up.fixedMean());
+    TEST_ASSERT_EQUAL(-1000, down.fixedMean());
+    TEST_ASSERT_FLOAT_WITHIN(0.5, 1000.0, up.mean());
+    TEST_ASSERT_FLOAT_WITHIN(0.5, -1000.0, down.mean());
+
+    // And back from there to a value a single step away
+    for (int i = 0; i < 1000; i++)
+        up.update(999);
+    TEST_ASSERT_EQUAL(999, up.fixedMean());
+}
+
+void test_ewma_integer_fixed_point() {
+    Ewma<int32_t, 3, 100> e;
+    e.update(5.0);
+    TEST_ASSERT_EQUAL(500, e.fixedMean());
+    for (int i = 0; i < 500; i++)
+        e.update(-2.37);
+    TEST_ASSERT_EQUAL(-237, e.fixedMean());
+    TEST_ASSERT_FLOAT_WITHIN(0.005, -2.37, e.mean());
+}
+
+void test_ewma_integer_tracks_float() {
+    Ewma<int32_t, 4, 1000> fixed;
+    Ewma<float, 4> ref;
+    fillSamples();
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        fixed.update(samples[i]);
+        ref.update(samples[i]);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.002, ref.mean(), fixed.mean());
+}
+
+void test_min_max() {
+    MinMax<int> r;
+    r.update(3);
+    TEST_ASSERT_EQUAL(3, r.min());
+    TEST_ASSERT_EQUAL(3, r.max());
+    r.update(-7);
+    r.update(12);
+    TEST_ASSERT_EQUAL(-7, r.min());
+    TEST_ASSERT_EQUAL(12, r.max());
+    TEST_ASSERT_EQUAL(3, r.count());
+    r.clear();
+    r.update(5);
+    TEST_ASSERT_EQUAL(5, r.min());
+}
+
+void test_window_stats_rounds() {
+    WindowStats<int32_t> w;
+    TEST_ASSERT_EQUAL(0, w.mean());
+    w.update(1);
+    w.update(2);
+    TEST_ASSERT_EQUAL(2, w.mean());
+    w.clear();
+    w.update(-1);
+    w.update(-2);
+    TEST_ASSERT_EQUAL(-2, w.mean());
+    TEST_ASSERT_EQUAL(-2, w.min());
+    TEST_ASSERT_EQUAL(-1, w.max());
+}
+
+void test_welford() {
+    Welford<float> w;
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.0, w.variance());
+    const float x[] = {2, 4, 4, 4, 5, 5, 7, 9};
+    for (int i = 0; i < 8; i++)
+        w.update(x[i]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5, 5.0, w.mean());
+    TEST_ASSERT_FLOAT_WITHIN(1e-5, 32.0 / 7, w.variance());
+
+    // A large offset ruins a single precision sum of squares, not this
+    Welford<float> big;
+    for (int i = 0; i < 10000; i++)
+        big.update(1e4 + (i % 2 ? 1.0 : -1.0));
+    TEST_ASSERT_FLOAT_WITHIN(0.01, 1.0, big.stddev());
+}
+
+void test_ring_mean_matches_moving_average() {
+    MovingAverage<float> old(64);
+    RingMean<float, 64> ring;
+    RingMean<int16_t, 64, int32_t, 100> fixed;
+    fillSamples();
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        float a = old.update(samples[i]);
+        float b = ring.update(samples[i]);
+        float c = fixed.update(samples[i]);
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, a, b);
+        TEST_ASSERT_FLOAT_WITHIN(0.005, a, c);
+    }
+}
+
+// Keeps the compiler from dropping the timed loops
+static volatile float sink;
+
+/** Time an average over the samples, repeated until BENCH_MIN_NS have passed */
+template <class Avg>
+static double nsPerUpdate(Avg & avg) {
+    typedef std::chrono::steady_clock Clock;
+    long updates = 0;
+    float sum = 0;
+    Clock::time_point start = Clock::now();
+    std::chrono::nanoseconds elapsed;
+    do {
+        for (int i = 0; i < BENCH_SAMPLES; i++)
+            sum += avg.update(samples[i]);
+        updates += BENCH_SAMPLES;
+        elapsed = Clock::now() - start;
+    } while (elapsed.count() < BENCH_MIN_NS);
+    sink = sum;
+    return (double)elapsed.count() / updates;
+}
+
+void test_benchmark_moving_average() {
+    // Reports only, timings depend on the host and its load
+    MovingAverage<float> old(64);
+    RingMean<float, 64> ring;
+    RingMean<int16_t, 64, int32_t, 100> fixed;
+    fillSamples();
+    double t0 = nsPerUpdate(old);
+    double t1 = nsPerUpdate(ring);
+    double t2 = nsPerUpdate(fixed);
+
+    char output[128];
+    snprintf(output, sizeof(output), "64 samples, ns per update: MovingAverage %.2f, RingMean float %.2f, "
+        "RingMean int16 %.2f", t0, t1, t2);
+    TEST_MESSAGE(output);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_ring_mean_window);
+    RUN_TEST(test_ring_mean_fixed_point);
+    RUN_TEST(test_ring_mean_float_no_drift);
+    RUN_TEST(test_ewma_float);
+    RUN_TEST(test_ewma_integer_reaches_constant_input);
+    RUN_TEST(test_ewma_integer_fixed_point);
+    RUN_TEST(test_ewma_integer_tracks_float);
+    RUN_TEST(test_min_max);
+    RUN_TEST(test_window_stats_rounds);
+    RUN_TEST(test_welford);
+    RUN_TEST(test_ring_mean_matches_moving_average);
+    RUN_TEST(test_benchmark_moving_average);
+    return UNITY_END();
+}
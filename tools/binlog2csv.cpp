@@ -0,0 +1,137 @@
+/** @file binlog2csv.cpp
+ *  @brief Convert a binary SD log (LOGFORMAT 1 or 2) to CSV
+ *
+ *  Build on the host with:
+ *      g++ -std=c++11 -O2 -o binlog2csv tools/binlog2csv.cpp
+ *
+ *  Usage:
+ *      binlog2csv LOGFILE.bin > LOGFILE.csv
+ *
+ *  Each record becomes one line starting with $ and its record name, eg.
+ *  $PCTL,..., with the fields scaled by the decimals in the file header.
+ *  Fields without a value are left empty.
+ *  Text records are written unchanged. A comment line with the field names
+ *  and units of every record type is written first.
+ *
+ *  @author pldr
+ *  @copyright 2023 Guatek
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "../include/BinaryLogFormat.h"
+
+struct Schema {
+    bool valid;
+    char name[sizeof(((BinaryLogSchema *)0)->name) + 1];
+    size_t recordSize;
+    std::vector<BinaryLogField> fields;
+};
+
+int main(int argc, char ** argv) {
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s LOGFILE.bin\n", argv[0]);
+        return 1;
+    }
+
+    FILE * f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        data.insert(data.end(), chunk, chunk + n);
+    fclose(f);
+
+    size_t pos = 0;
+    if (data.size() < 6 || memcmp(&data[0], BINLOG_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s: not a binary log\n", argv[1]);
+        return 1;
+    }
+    if (data[4] != BINLOG_VERSION) {
+        fprintf(stderr, "%s: unsupported version %d\n", argv[1], data[4]);
+        return 1;
+    }
+
+    Schema schemas[256];
+    for (int i = 0; i < 256; i++)
+        schemas[i].valid = false;
+
+    int schemaCount = data[5];
+    pos = 6;
+    for (int i = 0; i < schemaCount; i++) {
+        BinaryLogSchema s;
+        if (pos + sizeof(s) > data.size())
+            goto truncated;
+        memcpy(&s, &data[pos], sizeof(s));
+        pos += sizeof(s);
+
+        Schema & schema = schemas[s.recordType];
+        schema.valid = true;
+        memcpy(schema.name, s.name, sizeof(s.name));
+        schema.name[sizeof(s.name)] = '\0';
+        schema.recordSize = 0;
+        schema.fields.clear();
+
+        printf("# $%s", schema.name);
+        for (int j = 0; j < s.fieldCount; j++) {
+            BinaryLogField field;
+            if (pos + sizeof(field) > data.size())
+                goto truncated;
+            memcpy(&field, &data[pos], sizeof(field));
+            pos += sizeof(field);
+            field.name[sizeof(field.name) - 1] = '\0';
+            field.unit[sizeof(field.unit) - 1] = '\0';
+            schema.fields.push_back(field);
+            schema.recordSize += binlogFieldSize(field.type);
+            if (field.unit[0] != '\0')
+                printf(",%s (%s)", field.name, field.unit);
+            else
+                printf(",%s", field.name);
+        }
+        printf("\n");
+    }
+
+    while (pos + BINLOG_FRAME_SIZE <= data.size()) {
+        uint8_t type = data[pos];
+        size_t len = data[pos + 1];
+        pos += BINLOG_FRAME_SIZE;
+        if (pos + len > data.size())
+            goto truncated;
+        const uint8_t * p = &data[pos];
+        pos += len;
+
+        if (type == BINLOG_TYPE_TEXT) {
+            fwrite(p, 1, len, stdout);
+            printf("\n");
+            continue;
+        }
+
+        Schema & schema = schemas[type];
+        if (!schema.valid || schema.recordSize != len) {
+            fprintf(stderr, "skipping record of type %d, length %zu\n", type, len);
+            continue;
+        }
+
+        printf("$%s", schema.name);
+        for (size_t j = 0; j < schema.fields.size(); j++) {
+            char value[32];
+            printf(",%s", binlogFormatValue(value, sizeof(value), binlogReadField(p, schema.fields[j].type),
+                schema.fields[j].type, schema.fields[j].decimals));
+            p += binlogFieldSize(schema.fields[j].type);
+        }
+        printf("\n");
+    }
+
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s: truncated at byte %zu\n", argv[1], pos);
+    return 1;
+}